@@ -0,0 +1,55 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Only calls made from the objects linked into the benchmark land here, libc and libfuse internals don't.
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *str);
+
+static uint64_t g_allocs;
+
+uint64_t bench_allocs() {
+	return __atomic_load_n(&g_allocs, __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(const size_t size) {
+	__atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(const size_t n, const size_t size) {
+	__atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, const size_t size) {
+	__atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *str) {
+	__atomic_add_fetch(&g_allocs, 1, __ATOMIC_RELAXED);
+	return __real_strdup(str);
+}
@@ -0,0 +1,69 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <time.h>
+
+// Iterations are doubled until a batch takes at least this long.
+#define MIN_BATCH_NS (200 * 1000 * 1000ull)
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void bench_run(const char *filter, const char *name, const BenchFunc func, void *data) {
+	if (filter && !strstr(name, filter)) {
+		return;
+	}
+
+	// Warm up the caches, both ours and the kernel's.
+	func(data);
+
+	uint64_t iters = 1;
+	uint64_t elapsed;
+	uint64_t allocs;
+
+	while (true) {
+		const uint64_t allocs_start = bench_allocs();
+		const uint64_t start = now_ns();
+
+		for (uint64_t i = 0; i < iters; ++i) {
+			func(data);
+		}
+
+		elapsed = now_ns() - start;
+		allocs = bench_allocs() - allocs_start;
+
+		if (elapsed >= MIN_BATCH_NS || iters >= (UINT64_C(1) << 40)) {
+			break;
+		}
+
+		iters *= 2;
+	}
+
+	printf("%-40s %12llu %12.1f ns/op %10.2f allocs/op\n", name, (unsigned long long)iters,
+		   (double)elapsed / (double)iters, (double)allocs / (double)iters);
+	fflush(stdout);
+}
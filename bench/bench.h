@@ -0,0 +1,44 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <limits.h>
+
+#define BENCH_ARRAY_SIZE(array) (sizeof(array) / sizeof(*(array)))
+
+// One operation of a benchmark, called until the measurement is stable enough.
+typedef void (*BenchFunc)(void *data);
+
+// Backing directories created for the run, the roots seen by path_init().
+struct BenchDirs {
+	char install[PATH_MAX];
+	char data[PATH_MAX];
+	char run[PATH_MAX];
+};
+
+// Allocations done so far by our own code, counted through the linker's --wrap.
+uint64_t bench_allocs();
+
+// Runs func, unless filter is set and not part of name, and prints its cost per operation.
+void bench_run(const char *filter, const char *name, BenchFunc func, void *data);
+
+void bench_path(const char *filter);
+bool bench_ops(const char *filter, const struct BenchDirs *dirs);
@@ -0,0 +1,95 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include "path.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ftw.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define ENV_VAR_INSTALL_DIR ENV_VAR_PREFIX "INSTALL_DIR"
+#define ENV_VAR_DATA_DIR ENV_VAR_PREFIX "DATA_DIR"
+#define ENV_VAR_RUN_DIR ENV_VAR_PREFIX "RUN_DIR"
+
+static char g_base[PATH_MAX];
+
+static bool make_root(char *buf, const size_t size, const char *name, const char *var) {
+	snprintf(buf, size, "%s/%s", g_base, name);
+
+	if (mkdir(buf, 0755) == -1) {
+		perror(buf);
+		return false;
+	}
+
+	return setenv(var, buf, 1) == 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	(void)st;
+	(void)type;
+	(void)ftw;
+
+	remove(path);
+
+	return 0;
+}
+
+// Usage: steam_xdg_enforcer_bench [filter], only the benchmarks whose name contains filter are run.
+int main(int argc, char *argv[]) {
+	const char *filter = argc > 1 ? argv[1] : NULL;
+
+	const char *tmp = getenv("TMPDIR");
+	snprintf(g_base, sizeof(g_base), "%s/steam_xdg_enforcer_bench.XXXXXX", tmp ? tmp : "/tmp");
+	if (!mkdtemp(g_base)) {
+		perror(g_base);
+		return 1;
+	}
+
+	int ret = 1;
+
+	struct BenchDirs dirs;
+	if (!(make_root(dirs.install, sizeof(dirs.install), "install", ENV_VAR_INSTALL_DIR) &&
+		  make_root(dirs.data, sizeof(dirs.data), "data", ENV_VAR_DATA_DIR) &&
+		  make_root(dirs.run, sizeof(dirs.run), "run", ENV_VAR_RUN_DIR))) {
+		goto REMOVE_BASE;
+	}
+
+	if (!path_init(NULL, false)) {
+		goto REMOVE_BASE;
+	}
+
+	printf("%-40s %12s %15s %20s\n", "benchmark", "iterations", "time", "allocations");
+
+	bench_path(filter);
+
+	if (bench_ops(filter, &dirs)) {
+		ret = 0;
+	}
+
+REMOVE_BASE:
+	nftw(g_base, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+	return ret;
+}
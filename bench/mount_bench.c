@@ -0,0 +1,730 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define ENV_VAR_INSTALL_DIR ENV_VAR_PREFIX "INSTALL_DIR"
+#define ENV_VAR_DATA_DIR ENV_VAR_PREFIX "DATA_DIR"
+#define ENV_VAR_RUN_DIR ENV_VAR_PREFIX "RUN_DIR"
+
+#define STAT_N_DIRS (32)
+#define STAT_N_FILES (128)
+#define SHADER_N_FILES (10000)
+#define BLOCK_SIZE (1024 * 1024)
+#define RANDOM_N_READS (16384)
+#define RANDOM_READ_SIZE (4096)
+#define APPEND_N_WRITES (16384)
+#define APPEND_SIZE (128)
+#define MOUNT_TIMEOUT_MS (10000)
+#define CHECK_TIMEOUT_MS (2000)
+
+// Where the workloads find the Steam directories: the backing roots, or the mount's root for both.
+struct Side {
+	const char *install;
+	const char *data;
+};
+
+struct MountBench {
+	char base[PATH_MAX];
+	char install[PATH_MAX];
+	char data[PATH_MAX];
+	char run[PATH_MAX];
+	char mount[PATH_MAX];
+	char mount_root[PATH_MAX];
+	char daemon[PATH_MAX];
+	const char *options;
+	pid_t pid;
+	size_t pak_size;
+	char *buf;
+};
+
+// Returns the number of operations done in one pass, 0 when the pass failed.
+typedef uint64_t (*Workload)(struct MountBench *bench, const struct Side *side);
+
+struct WorkloadDef {
+	const char *name;
+	Workload func;
+	bool cold;
+};
+
+struct Result {
+	const char *name;
+	uint64_t ops;
+	double direct_ns;
+	double mount_ns;
+};
+
+// A path that is created in the data directory behind the daemon's back, after the mount reported it missing.
+struct CheckDef {
+	const char *name;
+	const char *vpath;
+	const char *real;
+};
+
+struct CheckResult {
+	const char *name;
+	const char *result;
+};
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static bool make_dir(const char *path) {
+	if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+		fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static bool write_file(const char *path, size_t size, const char *block) {
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	bool ret = true;
+
+	while (size) {
+		const size_t len = size < BLOCK_SIZE ? size : BLOCK_SIZE;
+		if (write(fd, block, len) != (ssize_t)len) {
+			fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+			ret = false;
+			break;
+		}
+
+		size -= len;
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+static bool make_tree(struct MountBench *bench) {
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/ubuntu12_32", bench->install);
+	if (!make_dir(path)) {
+		return false;
+	}
+
+	for (int i = 0; i < STAT_N_DIRS; ++i) {
+		snprintf(path, sizeof(path), "%s/ubuntu12_32/dir_%02i", bench->install, i);
+		if (!make_dir(path)) {
+			return false;
+		}
+
+		for (int j = 0; j < STAT_N_FILES; ++j) {
+			snprintf(path, sizeof(path), "%s/ubuntu12_32/dir_%02i/lib_%03i.so", bench->install, i, j);
+			if (!write_file(path, 0, NULL)) {
+				return false;
+			}
+		}
+	}
+
+	const char *dirs[] = { "config", "steamapps", "steamapps/common", "steamapps/common/Game", "logs", "shader_cache", "shader_cache/730" };
+	for (size_t i = 0; i < sizeof(dirs) / sizeof(*dirs); ++i) {
+		snprintf(path, sizeof(path), "%s/%s", bench->data, dirs[i]);
+		if (!make_dir(path)) {
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+		bench->buf[i] = (char)(i * 31 + 7);
+	}
+
+	snprintf(path, sizeof(path), "%s/steamapps/common/Game/game.pak", bench->data);
+	if (!write_file(path, bench->pak_size, bench->buf)) {
+		return false;
+	}
+
+	for (int i = 0; i < SHADER_N_FILES; ++i) {
+		snprintf(path, sizeof(path), "%s/shader_cache/730/%08x.foz", bench->data, (unsigned int)i * 2654435761u);
+		if (!write_file(path, 0, NULL)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static uint64_t stat_tree(struct MountBench *bench, const struct Side *side) {
+	(void)bench;
+
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t ops = 0;
+
+	for (int i = 0; i < STAT_N_DIRS; ++i) {
+		for (int j = 0; j < STAT_N_FILES; ++j) {
+			snprintf(path, sizeof(path), "%s/ubuntu12_32/dir_%02i/lib_%03i.so", side->install, i, j);
+			if (lstat(path, &st) == -1) {
+				fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+				return 0;
+			}
+
+			++ops;
+		}
+	}
+
+	return ops;
+}
+
+static int open_pak(const struct Side *side) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/steamapps/common/Game/game.pak", side->data);
+
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+	}
+
+	return fd;
+}
+
+static uint64_t read_seq(struct MountBench *bench, const struct Side *side) {
+	const int fd = open_pak(side);
+	if (fd == -1) {
+		return 0;
+	}
+
+	uint64_t ops = 0;
+
+	ssize_t ret;
+	while ((ret = read(fd, bench->buf, BLOCK_SIZE)) > 0) {
+		++ops;
+	}
+
+	close(fd);
+
+	return ret == 0 ? ops : 0;
+}
+
+// The same pseudo-random offsets are read on both sides.
+static uint64_t read_rand(struct MountBench *bench, const struct Side *side) {
+	const int fd = open_pak(side);
+	if (fd == -1) {
+		return 0;
+	}
+
+	const uint64_t n_blocks = bench->pak_size / RANDOM_READ_SIZE;
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+	uint64_t ops = 0;
+
+	for (; ops < RANDOM_N_READS; ++ops) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		const off_t off = (off_t)(state % n_blocks) * RANDOM_READ_SIZE;
+		if (pread(fd, bench->buf, RANDOM_READ_SIZE, off) != RANDOM_READ_SIZE) {
+			ops = 0;
+			break;
+		}
+	}
+
+	close(fd);
+
+	return ops;
+}
+
+static uint64_t append_logs(struct MountBench *bench, const struct Side *side) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/logs/content_log.txt", side->data);
+
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	memset(bench->buf, 'x', APPEND_SIZE - 1);
+	bench->buf[APPEND_SIZE - 1] = '\n';
+
+	uint64_t ops = 0;
+
+	for (; ops < APPEND_N_WRITES; ++ops) {
+		if (write(fd, bench->buf, APPEND_SIZE) != APPEND_SIZE) {
+			ops = 0;
+			break;
+		}
+	}
+
+	close(fd);
+
+	return ops;
+}
+
+static uint64_t readdir_shader_cache(struct MountBench *bench, const struct Side *side) {
+	(void)bench;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/shader_cache/730", side->data);
+
+	DIR *dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	uint64_t ops = 0;
+	while (readdir(dir)) {
+		++ops;
+	}
+
+	closedir(dir);
+
+	return ops;
+}
+
+static const struct WorkloadDef g_workloads[] = {
+	{ "stat_cold",            stat_tree,            true  },
+	{ "stat_warm",            stat_tree,            false },
+	{ "read_seq",             read_seq,             false },
+	{ "read_rand",            read_rand,            false },
+	{ "append_logs",          append_logs,          false },
+	{ "readdir_shader_cache", readdir_shader_cache, false }
+};
+
+// The real directory is watched on behalf of /root/config first, the file-level redirects into it are probed after.
+static const struct CheckDef g_checks[] = {
+	{ "external_create/config",       "root/config/settings.vdf", "config/settings.vdf" },
+	{ "external_create/registry.vdf", "registry.vdf",             "config/registry.vdf" },
+	{ "external_create/.crash",       "root/.crash",              "config/.crash"       }
+};
+
+static bool is_mounted(const struct MountBench *bench) {
+	struct stat base;
+	struct stat mount;
+
+	return stat(bench->base, &base) == 0 && stat(bench->mount, &mount) == 0 && base.st_dev != mount.st_dev;
+}
+
+static bool start_daemon(struct MountBench *bench) {
+	const char *argv[] = { bench->daemon, "-f", bench->mount, bench->options ? "-o" : NULL, bench->options, NULL };
+
+	bench->pid = fork();
+	if (bench->pid == -1) {
+		perror("fork");
+		return false;
+	}
+
+	if (bench->pid == 0) {
+		// The daemon's own messages would end up in the report.
+		const int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (null != -1) {
+			dup2(null, STDOUT_FILENO);
+		}
+
+		execv(bench->daemon, (char **)argv);
+		perror(bench->daemon);
+		_exit(127);
+	}
+
+	for (int waited = 0; waited < MOUNT_TIMEOUT_MS; waited += 10) {
+		if (is_mounted(bench)) {
+			return true;
+		}
+
+		int status;
+		if (waitpid(bench->pid, &status, WNOHANG) == bench->pid) {
+			fprintf(stderr, "%s exited before mounting.\n", bench->daemon);
+			bench->pid = 0;
+			return false;
+		}
+
+		const struct timespec ts = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+		nanosleep(&ts, NULL);
+	}
+
+	fprintf(stderr, "%s didn't mount within %d ms.\n", bench->daemon, MOUNT_TIMEOUT_MS);
+
+	return false;
+}
+
+// libfuse unmounts when the daemon receives SIGTERM.
+static void stop_daemon(struct MountBench *bench) {
+	if (bench->pid <= 0) {
+		return;
+	}
+
+	kill(bench->pid, SIGTERM);
+	waitpid(bench->pid, NULL, 0);
+	bench->pid = 0;
+}
+
+// Empties the kernel's dentry and inode caches, only possible as root.
+static bool drop_caches() {
+	const int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+
+	const bool ret = write(fd, "2", 1) == 1;
+	close(fd);
+
+	return ret;
+}
+
+// The kernel keeps negative entries for negative_timeout, they are dropped so that only the daemon is asked.
+static bool wait_visible(const char *path) {
+	for (int waited = 0; waited < CHECK_TIMEOUT_MS; waited += 10) {
+		struct stat st;
+		if (drop_caches() && lstat(path, &st) == 0) {
+			return true;
+		}
+
+		const struct timespec ts = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+		nanosleep(&ts, NULL);
+	}
+
+	return false;
+}
+
+// Returns the number of checks that failed, they are skipped when the kernel's caches can't be dropped.
+static size_t run_checks(struct MountBench *bench, const char *filter, struct CheckResult *results, size_t *n_results) {
+	const size_t n_checks = sizeof(g_checks) / sizeof(*g_checks);
+	const bool can_drop = drop_caches();
+	char path[PATH_MAX];
+	bool missing[n_checks];
+	size_t n_failed = 0;
+
+	for (size_t i = 0; i < n_checks; ++i) {
+		struct stat st;
+		snprintf(path, sizeof(path), "%s/%s", bench->mount, g_checks[i].vpath);
+		missing[i] = lstat(path, &st) == -1 && errno == ENOENT;
+	}
+
+	for (size_t i = 0; i < n_checks; ++i) {
+		if (filter && !strstr(g_checks[i].name, filter)) {
+			continue;
+		}
+
+		struct CheckResult *result = &results[(*n_results)++];
+		result->name = g_checks[i].name;
+
+		snprintf(path, sizeof(path), "%s/%s", bench->data, g_checks[i].real);
+		if (!can_drop || !missing[i] || !write_file(path, 0, NULL)) {
+			result->result = "skipped";
+		} else {
+			snprintf(path, sizeof(path), "%s/%s", bench->mount, g_checks[i].vpath);
+			const bool visible = wait_visible(path);
+			result->result = visible ? "pass" : "fail";
+			n_failed += !visible;
+		}
+
+		fprintf(stderr, "%-30s %s\n", result->name, result->result);
+	}
+
+	return n_failed;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t median(uint64_t *values, const size_t n) {
+	qsort(values, n, sizeof(*values), compare_u64);
+
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+static uint64_t time_pass(struct MountBench *bench, const struct WorkloadDef *def, const struct Side *side, uint64_t *ops) {
+	const uint64_t start = now_ns();
+	*ops = def->func(bench, side);
+
+	return now_ns() - start;
+}
+
+// Alternates direct and mounted passes so that both see the same conditions, the medians are kept.
+static bool run_workload(struct MountBench *bench, const struct WorkloadDef *def, const size_t runs, struct Result *result) {
+	const struct Side direct = { bench->install, bench->data };
+	const struct Side mount = { bench->mount_root, bench->mount_root };
+
+	uint64_t direct_ns[runs];
+	uint64_t mount_ns[runs];
+	uint64_t ops = 0;
+	uint64_t mount_ops = 0;
+
+	if (!def->cold) {
+		time_pass(bench, def, &direct, &ops);
+		time_pass(bench, def, &mount, &mount_ops);
+	}
+
+	for (size_t i = 0; i < runs; ++i) {
+		if (def->cold) {
+			drop_caches();
+		}
+
+		direct_ns[i] = time_pass(bench, def, &direct, &ops);
+
+		// A fresh daemon has no state of its own and the kernel forgot everything about the old mount.
+		if (def->cold) {
+			stop_daemon(bench);
+			if (!start_daemon(bench)) {
+				return false;
+			}
+
+			drop_caches();
+		}
+
+		mount_ns[i] = time_pass(bench, def, &mount, &mount_ops);
+
+		if (!ops || ops != mount_ops) {
+			fprintf(stderr, "%s: %llu operations directly, %llu through the mount.\n", def->name,
+					(unsigned long long)ops, (unsigned long long)mount_ops);
+			return false;
+		}
+	}
+
+	result->name = def->name;
+	result->ops = ops;
+	result->direct_ns = (double)median(direct_ns, runs) / (double)ops;
+	result->mount_ns = (double)median(mount_ns, runs) / (double)ops;
+
+	fprintf(stderr, "%-24s %12.1f ns/op direct %12.1f ns/op mounted %8.2fx\n", result->name, result->direct_ns,
+			result->mount_ns, result->mount_ns / result->direct_ns);
+
+	return true;
+}
+
+static void print_string(const char *str) {
+	if (!str) {
+		printf("null");
+		return;
+	}
+
+	putchar('"');
+
+	for (; *str; ++str) {
+		if (*str == '"' || *str == '\\') {
+			putchar('\\');
+		}
+
+		putchar(*str);
+	}
+
+	putchar('"');
+}
+
+static void print_report(const struct MountBench *bench, const struct CheckResult *checks, const size_t n_checks,
+						 const struct Result *results, const size_t n_results, const size_t runs, const bool cold_dropped) {
+	printf("{\n  \"options\": ");
+	print_string(bench->options);
+	printf(",\n  \"runs\": %zu,\n  \"pak_size\": %zu,\n  \"drop_caches\": %s,\n  \"checks\": [", runs,
+		   bench->pak_size, cold_dropped ? "true" : "false");
+
+	for (size_t i = 0; i < n_checks; ++i) {
+		printf("%s\n    { \"name\": \"%s\", \"result\": \"%s\" }", i ? "," : "", checks[i].name, checks[i].result);
+	}
+
+	printf("\n  ],\n  \"workloads\": [");
+
+	for (size_t i = 0; i < n_results; ++i) {
+		const struct Result *result = &results[i];
+
+		printf("%s\n    { \"name\": \"%s\", \"ops\": %llu, \"direct_ns_per_op\": %.1f, \"mount_ns_per_op\": %.1f, "
+			   "\"ratio\": %.3f }",
+			   i ? "," : "", result->name, (unsigned long long)result->ops, result->direct_ns, result->mount_ns,
+			   result->mount_ns / result->direct_ns);
+	}
+
+	printf("\n  ]\n}\n");
+	fflush(stdout);
+}
+
+static bool make_root(char *buf, const size_t size, const char *base, const char *name, const char *var) {
+	snprintf(buf, size, "%s/%s", base, name);
+
+	if (!make_dir(buf)) {
+		return false;
+	}
+
+	return !var || setenv(var, buf, 1) == 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	(void)st;
+	(void)type;
+	(void)ftw;
+
+	remove(path);
+
+	return 0;
+}
+
+static void print_usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-d DAEMON] [-o OPTIONS] [-n RUNS] [-s MB] [-g RATIO] [filter]\n"
+			"\n"
+			"Mounts the daemon over temporary install, data and run directories and runs the same\n"
+			"workloads through the mount and on the backing directories, then prints the time per\n"
+			"operation of both and their ratio as JSON. Progress goes to stderr.\n"
+			"Beforehand it checks that files created behind the daemon's back show up through the\n"
+			"mount, and exits with status 3 when one doesn't.\n"
+			"\n"
+			"    -d DAEMON   the daemon to mount, steam_xdg_enforcer next to this program by default\n"
+			"    -o OPTIONS  mount options passed to the daemon, e.g. lowlevel,io_uring\n"
+			"    -n RUNS     passes per workload and side, the median is reported (5)\n"
+			"    -s MB       size of the file read by read_seq and read_rand (64)\n"
+			"    -g RATIO    exit with status 2 when a workload is more than RATIO times slower mounted\n",
+			name);
+}
+
+// Usage: steam_xdg_enforcer_mount_bench [options] [filter], only the checks and workloads whose name contains filter are run.
+int main(int argc, char *argv[]) {
+	static struct MountBench bench;
+	size_t runs = 5;
+	double max_ratio = 0;
+
+	bench.pak_size = 64 * 1024 * 1024;
+
+	char self[PATH_MAX];
+	const ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	self[len > 0 ? len : 0] = '\0';
+	snprintf(bench.daemon, sizeof(bench.daemon), "%s/steam_xdg_enforcer", dirname(self));
+
+	int opt;
+	while ((opt = getopt(argc, argv, "d:o:n:s:g:")) != -1) {
+		if (opt == 'd') {
+			snprintf(bench.daemon, sizeof(bench.daemon), "%s", optarg);
+		} else if (opt == 'o') {
+			bench.options = optarg;
+		} else if (opt == 'n') {
+			runs = strtoul(optarg, NULL, 10);
+		} else if (opt == 's') {
+			bench.pak_size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+		} else if (opt == 'g') {
+			max_ratio = strtod(optarg, NULL);
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind < argc - 1 || !runs || bench.pak_size < RANDOM_READ_SIZE) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	const char *filter = optind < argc ? argv[optind] : NULL;
+
+	bench.buf = malloc(BLOCK_SIZE);
+	if (!bench.buf) {
+		return 1;
+	}
+
+	const char *tmp = getenv("TMPDIR");
+	snprintf(bench.base, sizeof(bench.base), "%s/steam_xdg_enforcer_mount_bench.XXXXXX", tmp ? tmp : "/tmp");
+	if (!mkdtemp(bench.base)) {
+		perror(bench.base);
+		free(bench.buf);
+		return 1;
+	}
+
+	int ret = 1;
+
+	if (!(make_root(bench.install, sizeof(bench.install), bench.base, "install", ENV_VAR_INSTALL_DIR) &&
+		  make_root(bench.data, sizeof(bench.data), bench.base, "data", ENV_VAR_DATA_DIR) &&
+		  make_root(bench.run, sizeof(bench.run), bench.base, "run", ENV_VAR_RUN_DIR) &&
+		  make_root(bench.mount, sizeof(bench.mount), bench.base, "mnt", NULL))) {
+		goto REMOVE_BASE;
+	}
+
+	snprintf(bench.mount_root, sizeof(bench.mount_root), "%s/root", bench.mount);
+
+	if (!make_tree(&bench) || !start_daemon(&bench)) {
+		goto STOP_DAEMON;
+	}
+
+	const bool cold_dropped = drop_caches();
+	if (!cold_dropped) {
+		fprintf(stderr, "Can't drop the kernel's caches, stat_cold only starts from a fresh mount.\n");
+	}
+
+	struct CheckResult checks[sizeof(g_checks) / sizeof(*g_checks)];
+	size_t n_checks = 0;
+	const size_t n_failed = run_checks(&bench, filter, checks, &n_checks);
+
+	struct Result results[sizeof(g_workloads) / sizeof(*g_workloads)];
+	size_t n_results = 0;
+
+	for (size_t i = 0; i < sizeof(g_workloads) / sizeof(*g_workloads); ++i) {
+		if (filter && !strstr(g_workloads[i].name, filter)) {
+			continue;
+		}
+
+		if (!run_workload(&bench, &g_workloads[i], runs, &results[n_results])) {
+			goto STOP_DAEMON;
+		}
+
+		++n_results;
+	}
+
+	print_report(&bench, checks, n_checks, results, n_results, runs, cold_dropped);
+
+	ret = 0;
+
+	for (size_t i = 0; i < n_results; ++i) {
+		if (max_ratio > 0 && results[i].mount_ns / results[i].direct_ns > max_ratio) {
+			fprintf(stderr, "%s is %.2fx slower mounted, more than %.2fx.\n", results[i].name,
+					results[i].mount_ns / results[i].direct_ns, max_ratio);
+			ret = 2;
+		}
+	}
+
+	if (n_failed) {
+		fprintf(stderr, "%zu of the checks failed.\n", n_failed);
+		ret = 3;
+	}
+
+STOP_DAEMON:
+	stop_daemon(&bench);
+REMOVE_BASE:
+	nftw(bench.base, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	free(bench.buf);
+
+	return ret;
+}
@@ -0,0 +1,278 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include "dirindex.h"
+#include "filesystem.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <fuse.h>
+
+#define GAME_N_FILES (256)
+#define PAK_SIZE (1024 * 1024)
+#define READ_SIZE (4096)
+
+struct OpsCase {
+	const struct fuse_operations *ops;
+	const char *path;
+	enum fuse_readdir_flags readdir_flags;
+	struct fuse_file_info fi;
+	off_t off;
+	size_t n_entries;
+	char buf[READ_SIZE];
+};
+
+static bool make_dirs(const char *root, const char *rel) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", root, rel);
+
+	for (char *ptr = path + strlen(root) + 1; ; ++ptr) {
+		if (*ptr != '/' && *ptr != '\0') {
+			continue;
+		}
+
+		const char old = *ptr;
+		*ptr = '\0';
+
+		if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+			printf("Failed to create %s: %s\n", path, strerror(errno));
+			return false;
+		}
+
+		if (!old) {
+			return true;
+		}
+
+		*ptr = old;
+	}
+}
+
+static bool write_file(const char *root, const char *rel, size_t size) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", root, rel);
+
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		printf("Failed to create %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	char block[4096];
+	memset(block, 'x', sizeof(block));
+
+	bool ret = true;
+
+	while (size) {
+		const size_t len = size < sizeof(block) ? size : sizeof(block);
+		if (write(fd, block, len) != (ssize_t)len) {
+			printf("Failed to write %s: %s\n", path, strerror(errno));
+			ret = false;
+			break;
+		}
+
+		size -= len;
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+static bool make_tree(const struct BenchDirs *dirs) {
+	if (!(make_dirs(dirs->install, "ubuntu12_32") &&
+		  make_dirs(dirs->data, "config") &&
+		  make_dirs(dirs->data, "steamapps/common/Game") &&
+		  make_dirs(dirs->data, "userdata") &&
+		  write_file(dirs->install, "steam.sh", 4096) &&
+		  write_file(dirs->install, "ubuntu12_32/steamclient.so", 64 * 1024) &&
+		  write_file(dirs->data, "config/config.vdf", 4096) &&
+		  write_file(dirs->data, "steamapps/common/Game/data.pak", PAK_SIZE))) {
+		return false;
+	}
+
+	for (int i = 0; i < GAME_N_FILES; ++i) {
+		char name[64];
+		snprintf(name, sizeof(name), "steamapps/common/Game/asset_%03i.bin", i);
+		if (!write_file(dirs->data, name, 0)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off, enum fuse_fill_dir_flags flags) {
+	(void)name;
+	(void)st;
+	(void)off;
+	(void)flags;
+
+	++*(size_t *)buf;
+
+	return 0;
+}
+
+struct FindEntry {
+	const char *name;
+	bool found;
+};
+
+static int find_entry(void *buf, const char *name, const struct stat *st, off_t off, enum fuse_fill_dir_flags flags) {
+	(void)st;
+	(void)off;
+	(void)flags;
+
+	struct FindEntry *find = buf;
+	if (strcmp(name, find->name) == 0) {
+		find->found = true;
+	}
+
+	return 0;
+}
+
+// Lists path the way libfuse does with nullpath_ok, without passing the path to readdir.
+static bool check_readdir(const struct fuse_operations *ops, const char *path, const char *name) {
+	struct FindEntry find = { .name = name };
+
+	struct fuse_file_info fi = { .flags = O_RDONLY | O_DIRECTORY };
+	int ret = ops->opendir(path, &fi);
+	if (ret == 0) {
+		ret = ops->readdir(NULL, &find, find_entry, 0, &fi, 0);
+		ops->releasedir(NULL, &fi);
+	}
+
+	if (ret != 0 || !find.found) {
+		printf("Listing %s: %s\n", path, ret != 0 ? strerror(-ret) : "missing entry");
+		return false;
+	}
+
+	return true;
+}
+
+static void run_getattr(void *data) {
+	struct OpsCase *op = data;
+
+	struct stat st;
+	op->ops->getattr(op->path, &st, NULL);
+}
+
+static void run_open_release(void *data) {
+	struct OpsCase *op = data;
+
+	struct fuse_file_info fi = { .flags = O_RDONLY };
+	if (op->ops->open(op->path, &fi) == 0) {
+		op->ops->release(op->path, &fi);
+	}
+}
+
+// Reads through the returned buffer the way libfuse does when splicing is unavailable.
+static void run_read(void *data) {
+	struct OpsCase *op = data;
+
+	struct fuse_bufvec *src;
+	if (op->ops->read_buf(op->path, &src, READ_SIZE, op->off, &op->fi) != 0) {
+		return;
+	}
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(READ_SIZE);
+	dst.buf[0].mem = op->buf;
+
+	fuse_buf_copy(&dst, src, 0);
+	free(src);
+
+	op->off = (op->off + READ_SIZE) % PAK_SIZE;
+}
+
+static void run_readdir(void *data) {
+	struct OpsCase *op = data;
+
+	struct fuse_file_info fi = { .flags = O_RDONLY | O_DIRECTORY };
+	if (op->ops->opendir(op->path, &fi) != 0) {
+		return;
+	}
+
+	op->n_entries = 0;
+	op->ops->readdir(NULL, &op->n_entries, count_entry, 0, &fi, op->readdir_flags);
+	op->ops->releasedir(NULL, &fi);
+}
+
+bool bench_ops(const char *filter, const struct BenchDirs *dirs) {
+	if (!make_tree(dirs)) {
+		return false;
+	}
+
+	// Builds the merged listings of the directories with redirects.
+	dirindex_init();
+
+	static struct OpsCase op;
+	op.ops = filesystem_get_operations();
+
+	if (!(check_readdir(op.ops, "/", "root") &&
+		  check_readdir(op.ops, "/root", "steamapps") &&
+		  check_readdir(op.ops, "/root/steamapps/common/Game", "data.pak"))) {
+		return false;
+	}
+
+	op.path = "/root/ubuntu12_32/steamclient.so";
+	bench_run(filter, "getattr/install", run_getattr, &op);
+	op.path = "/root/steamapps/common/Game/data.pak";
+	bench_run(filter, "getattr/prefix", run_getattr, &op);
+	op.path = "/root/.crash";
+	bench_run(filter, "getattr/strict_enoent", run_getattr, &op);
+	op.path = "/bin64";
+	bench_run(filter, "getattr/fixed", run_getattr, &op);
+
+	op.path = "/root/config/config.vdf";
+	bench_run(filter, "open_release/prefix", run_open_release, &op);
+	op.path = "/root/steam.sh";
+	bench_run(filter, "open_release/install", run_open_release, &op);
+
+	op.path = "/root/steamapps/common/Game/data.pak";
+	op.fi = (struct fuse_file_info){ .flags = O_RDONLY };
+	if (op.ops->open(op.path, &op.fi) == 0) {
+		bench_run(filter, "read_4k/prefix", run_read, &op);
+		op.ops->release(op.path, &op.fi);
+	}
+
+	op.path = "/root/steamapps/common/Game";
+	op.readdir_flags = 0;
+	bench_run(filter, "readdir/prefix", run_readdir, &op);
+	op.readdir_flags = FUSE_READDIR_PLUS;
+	bench_run(filter, "readdirplus/prefix", run_readdir, &op);
+
+	op.path = "/";
+	op.readdir_flags = 0;
+	bench_run(filter, "readdir/mount_root", run_readdir, &op);
+	op.path = "/root";
+	bench_run(filter, "readdir/install_root_merged", run_readdir, &op);
+	op.readdir_flags = FUSE_READDIR_PLUS;
+	bench_run(filter, "readdirplus/install_root_merged", run_readdir, &op);
+
+	return true;
+}
@@ -0,0 +1,141 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include "path.h"
+
+#include <limits.h>
+#include <stddef.h>
+
+struct Corpus {
+	const char *const *paths;
+	size_t n;
+	size_t next;
+};
+
+// Exact matches of the strict specs, only these translate.
+static const char *const g_strict[] = {
+	"/steam.pid",
+	"/steam.pipe",
+	"/steam.token",
+	"/starting",
+	"/root/.crash",
+	"/root/update_hosts_cached.vdf"
+};
+
+// Everything below a redirected directory, as seen while Steam downloads and games load.
+static const char *const g_prefix[] = {
+	"/registry.vdf",
+	"/root/config/config.vdf",
+	"/root/config/loginusers.vdf",
+	"/root/steamapps/appmanifest_570.acf",
+	"/root/steamapps/common/Proton - Experimental/files/lib64/wine/x86_64-windows/kernel32.dll",
+	"/root/steamapps/compatdata/1245620/pfx/drive_c/users/steamuser/AppData/Roaming",
+	"/root/steamapps/shadercache/1245620/fozpipelinesv6/steamapprun_pipeline_cache",
+	"/root/userdata/12345678/config/localconfig.vdf",
+	"/root/appcache/librarycache/1245620_library_600x900.jpg",
+	"/root/logs/content_log.txt",
+	"/root/depotcache/1245621_1234567890123456789.manifest"
+};
+
+// Paths that fall through to the install directory.
+static const char *const g_install[] = {
+	"/root",
+	"/root/steam.sh",
+	"/root/ubuntu12_32/steamclient.so",
+	"/root/ubuntu12_32/steam-runtime/usr/lib/x86_64-linux-gnu/libSDL2-2.0.so.0",
+	"/root/linux64/steamclient.so",
+	"/root/public/steambootstrapper_english.txt",
+	"/root/resource/layout/steamrootdialog.layout"
+};
+
+// Not below /root, only normalized.
+static const char *const g_other[] = {
+	"/",
+	"/bin32",
+	"/sdk64",
+	"/rootfs/file",
+	"/home/user/.local/share/Steam"
+};
+
+// Unnormalized input, which is cleaned up before matching.
+static const char *const g_unnormalized[] = {
+	"/root/./steamapps/../steamapps/common/Game/data.pak",
+	"//root//config//config.vdf",
+	"/root/ubuntu12_32/../ubuntu12_64/steamwebhelper"
+};
+
+static const char *const g_links[] = {
+	"/bin",
+	"/bin32",
+	"/bin64",
+	"/sdk32",
+	"/sdk64",
+	"/steam",
+	"/root",
+	"/root/steamapps"
+};
+
+#define CORPUS(array) { array, BENCH_ARRAY_SIZE(array), 0 }
+
+static inline const char *corpus_next(struct Corpus *corpus) {
+	const char *path = corpus->paths[corpus->next];
+	corpus->next = (corpus->next + 1) % corpus->n;
+
+	return path;
+}
+
+static void run_get_real(void *data) {
+	char buf[PATH_MAX];
+	path_get_real(corpus_next(data), buf, sizeof(buf));
+}
+
+static void run_get_real_at(void *data) {
+	char buf[PATH_MAX];
+	int dirfd;
+	path_get_real_at(corpus_next(data), buf, sizeof(buf), &dirfd);
+}
+
+static void run_get_link(void *data) {
+	volatile const char *link = path_get_link(corpus_next(data), true);
+	(void)link;
+}
+
+static void run_is_fixed(void *data) {
+	volatile bool fixed = path_is_fixed(corpus_next(data));
+	(void)fixed;
+}
+
+void bench_path(const char *filter) {
+	struct Corpus strict = CORPUS(g_strict);
+	struct Corpus prefix = CORPUS(g_prefix);
+	struct Corpus install = CORPUS(g_install);
+	struct Corpus other = CORPUS(g_other);
+	struct Corpus unnormalized = CORPUS(g_unnormalized);
+	struct Corpus links = CORPUS(g_links);
+
+	bench_run(filter, "path_get_real/strict", run_get_real, &strict);
+	bench_run(filter, "path_get_real/prefix", run_get_real, &prefix);
+	bench_run(filter, "path_get_real/install", run_get_real, &install);
+	bench_run(filter, "path_get_real/other", run_get_real, &other);
+	bench_run(filter, "path_get_real/unnormalized", run_get_real, &unnormalized);
+	bench_run(filter, "path_get_real_at/prefix", run_get_real_at, &prefix);
+	bench_run(filter, "path_get_real_at/install", run_get_real_at, &install);
+	bench_run(filter, "path_get_link", run_get_link, &links);
+	bench_run(filter, "path_is_fixed", run_is_fixed, &links);
+}
@@ -0,0 +1,501 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dirindex.h"
+#include "filesystem.h"
+#include "path.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include <fuse.h>
+
+// Writes, setxattr and the read buffers never need more than this.
+#define DATA_SIZE (1024 * 1024)
+
+// A file handle from the trace along with the one it maps to during the replay.
+struct Handle {
+	uint64_t recorded;
+	int fd;
+	struct fuse_file_info fi;
+};
+
+struct Replay {
+	const char *mount;
+	const struct fuse_operations *ops;
+	struct Handle *handles;
+	size_t n_handles;
+	size_t cap_handles;
+	char *data;
+};
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static struct Handle *handle_find(struct Replay *replay, const uint64_t recorded) {
+	for (size_t i = 0; i < replay->n_handles; ++i) {
+		if (replay->handles[i].recorded == recorded) {
+			return &replay->handles[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct Handle *handle_add(struct Replay *replay, const uint64_t recorded) {
+	struct Handle *handle = handle_find(replay, recorded);
+	if (handle) {
+		return handle;
+	}
+
+	if (replay->n_handles == replay->cap_handles) {
+		const size_t cap = replay->cap_handles ? replay->cap_handles * 2 : 64;
+		struct Handle *handles = realloc(replay->handles, cap * sizeof(*handles));
+		if (!handles) {
+			return NULL;
+		}
+
+		replay->handles = handles;
+		replay->cap_handles = cap;
+	}
+
+	handle = &replay->handles[replay->n_handles++];
+	*handle = (struct Handle){ .recorded = recorded, .fd = -1 };
+
+	return handle;
+}
+
+static void handle_remove(struct Replay *replay, struct Handle *handle) {
+	*handle = replay->handles[--replay->n_handles];
+}
+
+static inline int64_t check(const int64_t ret) {
+	return ret < 0 ? -errno : ret;
+}
+
+static int fill_nothing(void *buf, const char *name, const struct stat *st, off_t off, enum fuse_fill_dir_flags flags) {
+	(void)buf;
+	(void)name;
+	(void)st;
+	(void)off;
+	(void)flags;
+
+	return 0;
+}
+
+// Issues the system call that causes the recorded request when it reaches the mount.
+static int64_t replay_mount(struct Replay *replay, const struct TraceRecord *rec, const char *rel, const char *rel2) {
+	char path[PATH_MAX];
+	char path2[PATH_MAX];
+	snprintf(path, sizeof(path), "%s%s", replay->mount, rel);
+	snprintf(path2, sizeof(path2), "%s%s", replay->mount, rel2);
+
+	struct Handle *handle = rec->fh ? handle_find(replay, rec->fh) : NULL;
+	const int fd = handle ? handle->fd : -1;
+	const size_t size = rec->size < DATA_SIZE ? rec->size : DATA_SIZE;
+
+	struct stat st;
+	struct statvfs stvfs;
+
+	switch ((enum StatsOp)rec->op) {
+		case STATS_OP_GETATTR:
+			return check(fd >= 0 ? fstat(fd, &st) : lstat(path, &st));
+		case STATS_OP_READLINK:
+			return readlink(path, replay->data, size) < 0 ? -errno : 0;
+		case STATS_OP_MKNOD:
+			return check(mknod(path, rec->flags, rec->size));
+		case STATS_OP_MKDIR:
+			return check(mkdir(path, rec->flags));
+		case STATS_OP_UNLINK:
+			return check(unlink(path));
+		case STATS_OP_RMDIR:
+			return check(rmdir(path));
+		case STATS_OP_SYMLINK:
+			// The target is stored as is, it's not a path on the mount.
+			return check(symlink(rel, path2));
+		case STATS_OP_RENAME:
+			return check(renameat2(AT_FDCWD, path, AT_FDCWD, path2, rec->flags));
+		case STATS_OP_LINK:
+			return check(link(path, path2));
+		case STATS_OP_CHMOD:
+			return check(fd >= 0 ? fchmod(fd, rec->flags) : chmod(path, rec->flags));
+		case STATS_OP_CHOWN:
+			return check(fd >= 0 ? fchown(fd, (uid_t)rec->offset, (gid_t)rec->size) : lchown(path, (uid_t)rec->offset, (gid_t)rec->size));
+		case STATS_OP_TRUNCATE:
+			return check(fd >= 0 ? ftruncate(fd, rec->offset) : truncate(path, rec->offset));
+		case STATS_OP_UTIMENS:
+			return check(utimensat(AT_FDCWD, path, NULL, AT_SYMLINK_NOFOLLOW));
+		case STATS_OP_OPEN:
+		case STATS_OP_OPENDIR: {
+			const int flags = rec->op == STATS_OP_OPENDIR ? O_RDONLY | O_DIRECTORY : (int)rec->flags;
+			const int ret = open(path, (flags & ~(O_CREAT | O_EXCL)) | O_CLOEXEC);
+			if (ret < 0) {
+				return -errno;
+			}
+
+			struct Handle *new = rec->result == 0 ? handle_add(replay, rec->fh) : NULL;
+			if (!new) {
+				close(ret);
+				return 0;
+			}
+
+			if (new->fd >= 0) {
+				close(new->fd);
+			}
+
+			new->fd = ret;
+
+			return 0;
+		}
+		case STATS_OP_READ:
+			return check(pread(fd, replay->data, size, rec->offset));
+		case STATS_OP_WRITE:
+			return check(pwrite(fd, replay->data, size, rec->offset));
+		case STATS_OP_STATFS:
+			return check(statvfs(path, &stvfs));
+		case STATS_OP_RELEASE:
+		case STATS_OP_RELEASEDIR:
+			if (handle) {
+				close(handle->fd);
+				handle_remove(replay, handle);
+			}
+
+			return 0;
+		case STATS_OP_FSYNC:
+		case STATS_OP_FSYNCDIR:
+			return check(rec->flags ? fdatasync(fd) : fsync(fd));
+		case STATS_OP_READDIR:
+		case STATS_OP_READDIRPLUS:
+			if (lseek(fd, rec->offset, SEEK_SET) < 0) {
+				return -errno;
+			}
+
+			return getdents64(fd, replay->data, DATA_SIZE) < 0 ? -errno : 0;
+		case STATS_OP_ACCESS:
+			return check(faccessat(AT_FDCWD, path, (int)rec->flags, AT_SYMLINK_NOFOLLOW));
+		case STATS_OP_SETXATTR:
+			return check(lsetxattr(path, rel2, replay->data, size, (int)rec->flags));
+		case STATS_OP_GETXATTR:
+			return check(lgetxattr(path, rel2, replay->data, size));
+		case STATS_OP_LISTXATTR:
+			return check(llistxattr(path, replay->data, size));
+		case STATS_OP_REMOVEXATTR:
+			return check(lremovexattr(path, rel2));
+		case STATS_OP_FALLOCATE:
+			return check(fallocate(fd, (int)rec->flags, rec->offset, (off_t)rec->size));
+		case STATS_OP_COPY_FILE_RANGE: {
+			struct Handle *out = handle_find(replay, rec->fh2);
+			off_t off_in = rec->offset;
+			off_t off_out = rec->offset2;
+
+			return check(copy_file_range(fd, &off_in, out ? out->fd : -1, &off_out, rec->size, rec->flags));
+		}
+		case STATS_OP_LSEEK:
+			return check(lseek(fd, rec->offset, (int)rec->flags));
+		default:
+			// Flushes happen on close, the rest only exist in the low-level backend.
+			return rec->result;
+	}
+}
+
+// Calls the handlers of the high-level backend directly, without a mount.
+static int64_t replay_local(struct Replay *replay, const struct TraceRecord *rec, const char *path, const char *path2) {
+	const struct fuse_operations *ops = replay->ops;
+
+	struct Handle *handle = rec->fh ? handle_find(replay, rec->fh) : NULL;
+	struct fuse_file_info *fi = handle ? &handle->fi : NULL;
+	const size_t size = rec->size < DATA_SIZE ? rec->size : DATA_SIZE;
+
+	struct stat st;
+	struct statvfs stvfs;
+
+	// Handlers that need a handle fail the same way the daemon would without one.
+	struct fuse_file_info none = { .fh = UINT64_MAX };
+	if (!fi) {
+		fi = &none;
+	}
+
+	switch ((enum StatsOp)rec->op) {
+		case STATS_OP_GETATTR:
+			return ops->getattr(path, &st, handle ? fi : NULL);
+		case STATS_OP_READLINK:
+			return ops->readlink(path, replay->data, size);
+		case STATS_OP_MKNOD:
+			return ops->mknod(path, rec->flags, rec->size);
+		case STATS_OP_MKDIR:
+			return ops->mkdir(path, rec->flags);
+		case STATS_OP_UNLINK:
+			return ops->unlink(path);
+		case STATS_OP_RMDIR:
+			return ops->rmdir(path);
+		case STATS_OP_SYMLINK:
+			return ops->symlink(path, path2);
+		case STATS_OP_RENAME:
+			return ops->rename(path, path2, rec->flags);
+		case STATS_OP_LINK:
+			return ops->link(path, path2);
+		case STATS_OP_CHMOD:
+			return ops->chmod(path, rec->flags, handle ? fi : NULL);
+		case STATS_OP_CHOWN:
+			return ops->chown(path, (uid_t)rec->offset, (gid_t)rec->size, handle ? fi : NULL);
+		case STATS_OP_TRUNCATE:
+			return ops->truncate(path, rec->offset, handle ? fi : NULL);
+		case STATS_OP_UTIMENS:
+			return ops->utimens(path, NULL, handle ? fi : NULL);
+		case STATS_OP_OPEN:
+		case STATS_OP_OPENDIR: {
+			struct fuse_file_info new_fi = { .flags = (int)rec->flags };
+			const int ret = rec->op == STATS_OP_OPENDIR ? ops->opendir(path, &new_fi) : ops->open(path, &new_fi);
+			if (ret != 0) {
+				return ret;
+			}
+
+			struct Handle *new = rec->result == 0 ? handle_add(replay, rec->fh) : NULL;
+			if (!new) {
+				rec->op == STATS_OP_OPENDIR ? ops->releasedir(path, &new_fi) : ops->release(path, &new_fi);
+				return 0;
+			}
+
+			new->fi = new_fi;
+
+			return 0;
+		}
+		case STATS_OP_READ: {
+			struct fuse_bufvec *src;
+			const int ret = ops->read_buf(path, &src, size, rec->offset, fi);
+			if (ret != 0) {
+				return ret;
+			}
+
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+			dst.buf[0].mem = replay->data;
+
+			const ssize_t copied = fuse_buf_copy(&dst, src, 0);
+			free(src);
+
+			return copied;
+		}
+		case STATS_OP_WRITE: {
+			struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+			src.buf[0].mem = replay->data;
+
+			return ops->write_buf(path, &src, rec->offset, fi);
+		}
+		case STATS_OP_STATFS:
+			return ops->statfs(path, &stvfs);
+		case STATS_OP_FLUSH:
+			return ops->flush(path, fi);
+		case STATS_OP_RELEASE:
+		case STATS_OP_RELEASEDIR: {
+			if (!handle) {
+				return 0;
+			}
+
+			const int ret = rec->op == STATS_OP_RELEASEDIR ? ops->releasedir(path, fi) : ops->release(path, fi);
+			handle_remove(replay, handle);
+
+			return ret;
+		}
+		case STATS_OP_FSYNC:
+			return ops->fsync(path, (int)rec->flags, fi);
+		case STATS_OP_FSYNCDIR:
+			return ops->fsyncdir(path, (int)rec->flags, fi);
+		case STATS_OP_READDIR:
+		case STATS_OP_READDIRPLUS:
+			return ops->readdir(path, NULL, fill_nothing, rec->offset, handle ? fi : NULL, (enum fuse_readdir_flags)rec->flags);
+		case STATS_OP_ACCESS:
+			return ops->access(path, (int)rec->flags);
+		case STATS_OP_SETXATTR:
+			return ops->setxattr(path, path2, replay->data, size, (int)rec->flags);
+		case STATS_OP_GETXATTR:
+			return ops->getxattr(path, path2, replay->data, size);
+		case STATS_OP_LISTXATTR:
+			return ops->listxattr(path, replay->data, size);
+		case STATS_OP_REMOVEXATTR:
+			return ops->removexattr(path, path2);
+		case STATS_OP_FALLOCATE:
+			return ops->fallocate(path, (int)rec->flags, rec->offset, (off_t)rec->size, fi);
+		case STATS_OP_COPY_FILE_RANGE: {
+			struct Handle *out = handle_find(replay, rec->fh2);
+
+			return ops->copy_file_range(path, fi, rec->offset, path2, out ? &out->fi : &none, rec->offset2, rec->size, (int)rec->flags);
+		}
+		case STATS_OP_LSEEK:
+			return ops->lseek(path, rec->offset, (int)rec->flags, fi);
+		default:
+			return rec->result;
+	}
+}
+
+static bool read_string(FILE *file, char *buf, const size_t len) {
+	if (len >= PATH_MAX || (len && fread(buf, 1, len, file) != len)) {
+		return false;
+	}
+
+	buf[len] = '\0';
+
+	return true;
+}
+
+static void print_usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-f] [-m MOUNTPOINT] TRACE\n"
+			"\n"
+			"Replays a trace recorded with -o trace=FILE, one request after another.\n"
+			"Without -m the handlers are called in-process, with the roots taken from the\n"
+			"same environment variables the daemon uses.\n"
+			"\n"
+			"    -f             don't wait for the recorded start times, replay as fast as possible\n"
+			"    -m MOUNTPOINT  issue the corresponding system calls on a mounted instance\n",
+			name);
+}
+
+int main(int argc, char *argv[]) {
+	struct Replay replay = { 0 };
+	bool fast = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "fm:")) != -1) {
+		switch (opt) {
+			case 'f':
+				fast = true;
+				break;
+			case 'm':
+				replay.mount = optarg;
+				break;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	FILE *file = fopen(argv[optind], "rbe");
+	if (!file) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	int ret = 1;
+
+	struct TraceHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != TRACE_VERSION || header.record_size < sizeof(struct TraceRecord)) {
+		fprintf(stderr, "%s is not a trace this version can replay.\n", argv[optind]);
+		goto CLOSE_FILE;
+	}
+
+	if (!replay.mount) {
+		if (!path_init(NULL, false)) {
+			goto CLOSE_FILE;
+		}
+
+		dirindex_init();
+		replay.ops = filesystem_get_operations();
+	}
+
+	replay.data = calloc(1, DATA_SIZE);
+	if (!replay.data) {
+		goto CLOSE_FILE;
+	}
+
+	uint64_t n_records = 0;
+	uint64_t n_mismatches = 0;
+	uint64_t recorded_ns = 0;
+	const uint64_t start = now_ns();
+
+	struct TraceRecord rec;
+	char path[PATH_MAX];
+	char path2[PATH_MAX];
+
+	while (fread(&rec, sizeof(rec), 1, file) == 1) {
+		if (header.record_size > sizeof(rec)) {
+			fseek(file, header.record_size - sizeof(rec), SEEK_CUR);
+		}
+
+		if (!read_string(file, path, rec.path_len) || !read_string(file, path2, rec.path2_len)) {
+			fprintf(stderr, "The trace is truncated after %llu records.\n", (unsigned long long)n_records);
+			break;
+		}
+
+		if (!fast) {
+			const uint64_t elapsed = now_ns() - start;
+			if (rec.start_ns > elapsed) {
+				const uint64_t wait = rec.start_ns - elapsed;
+				const struct timespec ts = { .tv_sec = (time_t)(wait / 1000000000ull), .tv_nsec = (long)(wait % 1000000000ull) };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		const int64_t result = replay.mount ? replay_mount(&replay, &rec, path, path2) : replay_local(&replay, &rec, path, path2);
+
+		// Only errors are compared, byte counts depend on how the kernel splits requests.
+		if ((result < 0 || rec.result < 0) && result != rec.result) {
+			++n_mismatches;
+			printf("%s %s: recorded %lld, replayed %lld\n", stats_op_name((enum StatsOp)rec.op), path,
+				   (long long)rec.result, (long long)result);
+		}
+
+		recorded_ns += rec.latency_ns;
+		++n_records;
+	}
+
+	const double elapsed_ms = (double)(now_ns() - start) / 1e6;
+
+	printf("Replayed %llu requests in %.1f ms, %llu with a different outcome.\n", (unsigned long long)n_records,
+		   elapsed_ms, (unsigned long long)n_mismatches);
+	printf("Recorded handler time: %.1f ms\n", (double)recorded_ns / 1e6);
+
+	ret = 0;
+
+	for (size_t i = 0; i < replay.n_handles; ++i) {
+		if (replay.handles[i].fd >= 0) {
+			close(replay.handles[i].fd);
+		}
+	}
+
+	free(replay.handles);
+	free(replay.data);
+CLOSE_FILE:
+	fclose(file);
+
+	return ret;
+}
@@ -0,0 +1,300 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "dirindex.h"
+
+#include "path.h"
+#include "str.h"
+#include "watch.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+struct Cached {
+	struct Cached *next;
+	char *vpath;
+	struct DirIndex *index;
+};
+
+struct Builder {
+	struct DirIndex *index;
+	size_t cap;
+	bool failed;
+};
+
+static struct {
+	struct Cached *list;
+	uint64_t generation;
+	struct Watcher *watcher;
+	pthread_mutex_t lock;
+} g_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void free_index(struct DirIndex *index) {
+	for (size_t i = 0; i < index->n; ++i) {
+		free(index->entries[i].name);
+	}
+
+	free(index->entries);
+	free(index);
+}
+
+static struct DirIndexEntry *find_entry(const struct DirIndex *index, const char *name) {
+	for (size_t i = 0; i < index->n; ++i) {
+		if (streq(index->entries[i].name, name)) {
+			return &index->entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void add_entry(struct Builder *builder, const char *name, const unsigned char type) {
+	struct DirIndex *index = builder->index;
+
+	struct DirIndexEntry *entry = find_entry(index, name);
+	if (entry) {
+		entry->type = type;
+		return;
+	}
+
+	if (index->n == builder->cap) {
+		const size_t cap = builder->cap ? builder->cap * 2 : 64;
+
+		struct DirIndexEntry *entries = realloc(index->entries, cap * sizeof(*entries));
+		if (!entries) {
+			builder->failed = true;
+			return;
+		}
+
+		index->entries = entries;
+		builder->cap = cap;
+	}
+
+	entry = &index->entries[index->n];
+	entry->name = strdup(name);
+	entry->type = type;
+
+	if (!entry->name) {
+		builder->failed = true;
+		return;
+	}
+
+	++index->n;
+}
+
+static void remove_entry(struct Builder *builder, const char *name) {
+	struct DirIndex *index = builder->index;
+
+	struct DirIndexEntry *entry = find_entry(index, name);
+	if (entry) {
+		free(entry->name);
+		*entry = index->entries[--index->n];
+	}
+}
+
+static void watch_dir(const char *path) {
+	struct stat st;
+	if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+		watch_add(g_cache.watcher, AT_FDCWD, path, &st, NULL, 0);
+	}
+}
+
+// Redirected children are listed only if they exist, exactly like a lookup would find them.
+static void add_redirect(void *data, const char *name, const char *vpath) {
+	struct Builder *builder = data;
+
+	char real[PATH_MAX];
+	if (path_get_real(vpath, real, sizeof(real)) < 0) {
+		return;
+	}
+
+	struct stat st;
+	if (path_is_dir_link(vpath)) {
+		add_entry(builder, name, DT_LNK);
+	} else if (lstat(real, &st) == 0) {
+		add_entry(builder, name, IFTODT(st.st_mode));
+	} else {
+		remove_entry(builder, name);
+	}
+
+	char *slash = strrchr(real, '/');
+	if (slash && slash != real) {
+		*slash = '\0';
+		watch_dir(real);
+	}
+}
+
+static struct DirIndex *build_index(const char *vpath) {
+	struct Builder builder = { .index = calloc(1, sizeof(*builder.index)) };
+	if (!builder.index) {
+		return NULL;
+	}
+
+	if (path_is_root(vpath)) {
+		const char **names = path_get_root_names();
+		for (const char *name = *names; name; name = *(++names)) {
+			char child[NAME_MAX + 2];
+			snprintf(child, sizeof(child), "/%s", name);
+
+			add_entry(&builder, name, path_is_stats(child) ? DT_REG : path_get_link(child, false) ? DT_LNK : DT_DIR);
+		}
+	} else {
+		char real[PATH_MAX];
+		const ssize_t len = path_get_real(vpath, real, sizeof(real));
+		if (len < 0) {
+			free_index(builder.index);
+			errno = (int)-len;
+			return NULL;
+		}
+
+		DIR *dir = opendir(real);
+		if (!dir) {
+			const int err = errno;
+			free_index(builder.index);
+			errno = err;
+			return NULL;
+		}
+
+		struct dirent *ent;
+		while ((ent = readdir(dir)) != NULL) {
+			add_entry(&builder, ent->d_name, ent->d_type);
+		}
+
+		closedir(dir);
+
+		watch_dir(real);
+	}
+
+	path_foreach_redirect(vpath, add_redirect, &builder);
+
+	if (builder.failed) {
+		free_index(builder.index);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	builder.index->refs = 1;
+
+	return builder.index;
+}
+
+static void on_change(const char *vpath, uint64_t ino, const char *name, uint32_t mask) {
+	(void)vpath;
+	(void)ino;
+	(void)name;
+
+	if (mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_Q_OVERFLOW)) {
+		dirindex_invalidate();
+	}
+}
+
+bool dirindex_init() {
+	// Only the few directories with redirects are watched.
+	g_cache.watcher = watch_new(on_change, 0);
+
+	return g_cache.watcher;
+}
+
+struct DirIndex *dirindex_get(const char *vpath) {
+	pthread_mutex_lock(&g_cache.lock);
+
+	struct Cached *cached = g_cache.list;
+	while (cached && !streq(cached->vpath, vpath)) {
+		cached = cached->next;
+	}
+
+	if (cached && cached->index) {
+		struct DirIndex *index = cached->index;
+		__atomic_add_fetch(&index->refs, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&g_cache.lock);
+		return index;
+	}
+
+	const uint64_t generation = g_cache.generation;
+
+	pthread_mutex_unlock(&g_cache.lock);
+
+	struct DirIndex *index = build_index(vpath);
+	if (!index) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&g_cache.lock);
+
+	// Don't cache an index that may have missed an invalidation while being built.
+	if (generation == g_cache.generation) {
+		if (!cached) {
+			cached = calloc(1, sizeof(*cached));
+			if (cached && !(cached->vpath = strdup(vpath))) {
+				free(cached);
+				cached = NULL;
+			}
+
+			if (cached) {
+				cached->next = g_cache.list;
+				g_cache.list = cached;
+			}
+		}
+
+		if (cached) {
+			if (cached->index) {
+				dirindex_put(cached->index);
+			}
+
+			__atomic_add_fetch(&index->refs, 1, __ATOMIC_RELAXED);
+			cached->index = index;
+		}
+	}
+
+	pthread_mutex_unlock(&g_cache.lock);
+
+	return index;
+}
+
+void dirindex_put(struct DirIndex *index) {
+	if (!__atomic_sub_fetch(&index->refs, 1, __ATOMIC_ACQ_REL)) {
+		free_index(index);
+	}
+}
+
+void dirindex_invalidate() {
+	pthread_mutex_lock(&g_cache.lock);
+
+	++g_cache.generation;
+
+	for (struct Cached *cached = g_cache.list; cached; cached = cached->next) {
+		if (cached->index) {
+			dirindex_put(cached->index);
+			cached->index = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&g_cache.lock);
+}
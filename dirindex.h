@@ -0,0 +1,44 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct DirIndexEntry {
+	char *name;
+	unsigned char type;
+};
+
+// Merged listing of a directory whose children are redirected to different roots.
+struct DirIndex {
+	uint32_t refs;
+	size_t n;
+	struct DirIndexEntry *entries;
+};
+
+bool dirindex_init();
+
+// Returns a reference to the cached index of vpath, building it if needed. NULL with errno set on failure.
+struct DirIndex *dirindex_get(const char *vpath);
+
+void dirindex_put(struct DirIndex *index);
+
+// Drops all the cached indexes, they are rebuilt on the next listing.
+void dirindex_invalidate();
@@ -0,0 +1,215 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "durability.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+// Distinct filesystems in a batch, callers beyond that sync on their own.
+#define MAX_FILESYSTEMS (8)
+
+struct Filesystem {
+	dev_t dev;
+	// Descriptor of one of the waiters, which stay blocked until the batch is committed.
+	int fd;
+};
+
+// Lives on the waiter's stack, the commit thread fills it in before waking it up.
+struct Waiter {
+	struct Waiter *next;
+	int result;
+	bool done;
+};
+
+static struct {
+	unsigned int window_ms;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	bool skipped;
+
+	// Batch being gathered.
+	struct Waiter *waiters;
+	struct Filesystem filesystems[MAX_FILESYSTEMS];
+	size_t n_filesystems;
+
+	pthread_mutex_t lock;
+	pthread_cond_t pending;
+	pthread_cond_t done;
+} g_durability = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.pending = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER
+};
+
+static inline int sync_now(const int fd, const bool datasync) {
+	return (datasync ? fdatasync(fd) : fsync(fd)) == 0 ? 0 : errno;
+}
+
+// Waits for the window to pass once a batch has waiters, so that the ones arriving meanwhile share its syncfs().
+static void *commit_thread(void *arg) {
+	(void)arg;
+
+	const struct timespec window = { .tv_sec = g_durability.window_ms / 1000, .tv_nsec = (long)(g_durability.window_ms % 1000) * 1000000 };
+
+	pthread_mutex_lock(&g_durability.lock);
+
+	while (!g_durability.stop || g_durability.waiters) {
+		if (!g_durability.waiters) {
+			pthread_cond_wait(&g_durability.pending, &g_durability.lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&g_durability.lock);
+		nanosleep(&window, NULL);
+		pthread_mutex_lock(&g_durability.lock);
+
+		struct Filesystem filesystems[MAX_FILESYSTEMS];
+		const size_t n_filesystems = g_durability.n_filesystems;
+		for (size_t i = 0; i < n_filesystems; ++i) {
+			filesystems[i] = g_durability.filesystems[i];
+		}
+
+		struct Waiter *waiters = g_durability.waiters;
+		g_durability.waiters = NULL;
+		g_durability.n_filesystems = 0;
+
+		pthread_mutex_unlock(&g_durability.lock);
+
+		int err = 0;
+		for (size_t i = 0; i < n_filesystems; ++i) {
+			if (syncfs(filesystems[i].fd) == -1) {
+				err = errno;
+			}
+		}
+
+		pthread_mutex_lock(&g_durability.lock);
+
+		for (struct Waiter *waiter = waiters; waiter; waiter = waiter->next) {
+			waiter->result = err;
+			waiter->done = true;
+		}
+
+		pthread_cond_broadcast(&g_durability.done);
+	}
+
+	pthread_mutex_unlock(&g_durability.lock);
+
+	return NULL;
+}
+
+void durability_start(const unsigned int window_ms) {
+	g_durability.window_ms = window_ms;
+
+	if (pthread_create(&g_durability.thread, NULL, commit_thread, NULL) != 0) {
+		printf("Failed to start the group commit thread!\n");
+		return;
+	}
+
+	g_durability.running = true;
+}
+
+static void sync_root(const enum PathRoot root) {
+	const int fd = openat(path_get_root_fd(root), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd != -1) {
+		syncfs(fd);
+		close(fd);
+	}
+}
+
+void durability_stop() {
+	if (g_durability.running) {
+		pthread_mutex_lock(&g_durability.lock);
+		g_durability.stop = true;
+		pthread_cond_signal(&g_durability.pending);
+		pthread_mutex_unlock(&g_durability.lock);
+
+		pthread_join(g_durability.thread, NULL);
+		g_durability.running = false;
+	}
+
+	if (__atomic_load_n(&g_durability.skipped, __ATOMIC_RELAXED)) {
+		sync_root(PATH_ROOT_INSTALL);
+		sync_root(PATH_ROOT_DATA);
+		sync_root(PATH_ROOT_RUN);
+	}
+}
+
+static int group_fsync(const int fd, const bool datasync) {
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		return errno;
+	}
+
+	pthread_mutex_lock(&g_durability.lock);
+
+	size_t i = 0;
+	while (i < g_durability.n_filesystems && g_durability.filesystems[i].dev != st.st_dev) {
+		++i;
+	}
+
+	if (!g_durability.running || g_durability.stop || i == MAX_FILESYSTEMS) {
+		pthread_mutex_unlock(&g_durability.lock);
+		return sync_now(fd, datasync);
+	}
+
+	if (i == g_durability.n_filesystems) {
+		g_durability.filesystems[g_durability.n_filesystems++] = (struct Filesystem){ .dev = st.st_dev, .fd = fd };
+	}
+
+	struct Waiter waiter = { .next = g_durability.waiters };
+	if (!g_durability.waiters) {
+		pthread_cond_signal(&g_durability.pending);
+	}
+
+	g_durability.waiters = &waiter;
+
+	while (!waiter.done) {
+		pthread_cond_wait(&g_durability.done, &g_durability.lock);
+	}
+
+	const int ret = waiter.result;
+
+	pthread_mutex_unlock(&g_durability.lock);
+
+	return ret;
+}
+
+int durability_fsync(const int fd, const bool datasync, const enum PathDurability policy) {
+	if (policy == PATH_DURABILITY_RELAXED) {
+		__atomic_store_n(&g_durability.skipped, true, __ATOMIC_RELAXED);
+		return 0;
+	} else if (policy == PATH_DURABILITY_GROUP) {
+		return group_fsync(fd, datasync);
+	}
+
+	return sync_now(fd, datasync);
+}
+
+void durability_release(const int fd, const int flags, const enum PathDurability policy) {
+	if (policy == PATH_DURABILITY_RELAXED && (flags & O_ACCMODE) != O_RDONLY) {
+		sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "path.h"
+
+#include <stdbool.h>
+
+// Starts the thread that commits group fsyncs, at most window_ms after the first one of a batch.
+void durability_start(unsigned int window_ms);
+
+// Stops the thread and syncs the roots if relaxed fsyncs were skipped.
+void durability_stop();
+
+// fsync() or fdatasync() according to policy, returns 0 or an errno value. Group fsyncs block until their batch
+// is committed, and fall back to a regular one when the thread isn't running.
+int durability_fsync(int fd, bool datasync, enum PathDurability policy);
+
+// Starts writing back what a relaxed file left behind, without waiting for it.
+void durability_release(int fd, int flags, enum PathDurability policy);
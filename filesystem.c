@@ -17,10 +17,22 @@
 
 #include "filesystem.h"
 
-#include "debug.h"
+#include "dirindex.h"
+#include "durability.h"
+#include "log.h"
+#include "move.h"
+#include "negcache.h"
+#include "options.h"
 #include "path.h"
+#include "prefetch.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
+#include "watch.h"
 
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -29,44 +41,225 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/xattr.h>
 
+#include <linux/fs.h>
+
 #include <fuse.h>
 
 #define FD_ROOT (UINT64_MAX)
 
-#define FREE_REAL_PATH(path) \
-	free(real_##path);
+// File handles hold the descriptor in the low 32 bits, the root it belongs to and its durability above them.
+// The stats file's handle is the address of its contents instead, tagged with FH_STATS, and directories' handles
+// the address of a DirHandle, tagged with FH_DIR.
+#define FH_DIR (UINT64_C(1) << 63)
+#define FH_STATS (UINT64_C(1) << 62)
+#define FH_ROOT_SHIFT (32)
+#define FH_DURABILITY_SHIFT (34)
+
+// Readdir gets no path with nullpath_ok, what it needs is kept with the handle.
+struct DirHandle {
+	// What do_open() returned for the directory, FD_ROOT for the mount root.
+	uint64_t fh;
+	// Listing served from the install snapshot, NULL to read the directory.
+	const struct SnapshotEntry *snapshot;
+	char path[];
+};
+
+static struct fuse *g_fuse;
+static struct fuse_config *g_config;
+static struct Watcher *g_watcher;
+static bool g_writeback;
+
+// The high-level API has no per-entry timeouts: until everything cached before a directory stopped being watched
+// has expired, all of them are kept short.
+static pthread_mutex_t g_unwatched_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_unwatched_until;
+
+static inline struct DirHandle *get_dir(const struct fuse_file_info *fi) {
+	return fi->fh != FD_ROOT && (fi->fh & FH_DIR) ? (struct DirHandle *)(uintptr_t)(fi->fh & ~FH_DIR) : NULL;
+}
+
+static inline uint64_t get_fh(const struct fuse_file_info *fi) {
+	const struct DirHandle *handle = get_dir(fi);
+	return handle ? handle->fh : fi->fh;
+}
 
-#define FREE_REAL_PATH_2(path1, path2) \
-	FREE_REAL_PATH(path1) \
-	FREE_REAL_PATH(path2)
+static inline int get_fd(const struct fuse_file_info *fi) {
+	const uint64_t fh = get_fh(fi);
+	return (fh & FH_STATS) ? -1 : (int)(fh & UINT32_MAX);
+}
 
-#define GET_REAL_PATH_NO_RET(path) \
-	char *real_##path = path_get_real(path); \
-	debug_path_func(__func__, path, real_##path);
+static inline bool is_stats(const struct fuse_file_info *fi) {
+	const uint64_t fh = get_fh(fi);
+	return fh != FD_ROOT && (fh & FH_STATS);
+}
 
-#define GET_REAL_PATH(path) \
-	GET_REAL_PATH_NO_RET(path) \
-	if (!real_##path) return -ENOENT;
+static inline enum StatsClass get_class(const struct fuse_file_info *fi) {
+	const uint64_t fh = get_fh(fi);
+	return (fh & FH_STATS) ? STATS_CLASS_FIXED : (enum StatsClass)((fh >> FH_ROOT_SHIFT) & 3);
+}
 
-#define GET_REAL_PATH_2(path1, path2) \
-	GET_REAL_PATH(path1)              \
-	GET_REAL_PATH_NO_RET(path2)       \
-	if (!real_##path2) {              \
-		FREE_REAL_PATH(path1)         \
-		return -ENOENT;               \
+static inline enum PathDurability get_durability(const struct fuse_file_info *fi) {
+	const uint64_t fh = get_fh(fi);
+	return fh == FD_ROOT ? PATH_DURABILITY_STRICT : (enum PathDurability)((fh >> FH_DURABILITY_SHIFT) & 3);
+}
+
+#define GET_REAL_PATH(path)                                                             \
+	char real_##path[PATH_MAX];                                                         \
+	{                                                                                   \
+		const ssize_t real_len = path_get_real(path, real_##path, sizeof(real_##path)); \
+		if (real_len < 0) {                                                             \
+			log_path(__func__, path, NULL, PATH_ROOT_NONE);                             \
+			return (int)real_len;                                                       \
+		}                                                                               \
+		const enum PathRoot root = path_get_root(real_##path);                          \
+		log_path(__func__, path, real_##path, root);                                    \
+		STATS_CLASS(root);                                                              \
 	}
 
-static int fs_getattr(const char *path, struct stat *buf, struct fuse_file_info *fi) {
-	if (fi) {
-		return fstat((int)fi->fh, buf) == 0 ? 0 : -errno;
+#define GET_REAL_PATH_AT(path)                                                                           \
+	char real_##path[PATH_MAX];                                                                          \
+	int fd_##path;                                                                                       \
+	{                                                                                                    \
+		const ssize_t real_len = path_get_real_at(path, real_##path, sizeof(real_##path), &fd_##path);   \
+		if (real_len < 0) {                                                                              \
+			log_path(__func__, path, NULL, PATH_ROOT_NONE);                                              \
+			return (int)real_len;                                                                        \
+		}                                                                                                \
+		const enum PathRoot root = path_get_root_at(fd_##path);                                          \
+		log_path(__func__, path, real_##path, root);                                                     \
+		STATS_CLASS(root);                                                                               \
+	}
+
+#define GET_REAL_PATH_AT_2(path1, path2) \
+	GET_REAL_PATH_AT(path1)              \
+	GET_REAL_PATH_AT(path2)
+
+// The entries of the mount root and, in hybrid mode, the symlinks standing in for whole-directory redirects.
+static inline bool is_fixed_entry(const char *path) {
+	return path_is_fixed(path) || path_is_dir_link(path);
+}
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void set_timeouts(double attr, double entry) {
+	__atomic_store(&g_config->attr_timeout, &attr, __ATOMIC_RELAXED);
+	__atomic_store(&g_config->entry_timeout, &entry, __ATOMIC_RELAXED);
+}
+
+static void unwatched() {
+	const double timeout = g_options.attr_timeout > g_options.entry_timeout ? g_options.attr_timeout : g_options.entry_timeout;
+
+	pthread_mutex_lock(&g_unwatched_lock);
+
+	if (!g_unwatched_until && g_config) {
+		log_message(LOG_LEVEL_WARN, "[%s] changes may go unnoticed, caching for %g seconds at most", __func__, FILESYSTEM_UNWATCHED_TIMEOUT);
+		set_timeouts(g_options.attr_timeout < FILESYSTEM_UNWATCHED_TIMEOUT ? g_options.attr_timeout : FILESYSTEM_UNWATCHED_TIMEOUT,
+					 g_options.entry_timeout < FILESYSTEM_UNWATCHED_TIMEOUT ? g_options.entry_timeout : FILESYSTEM_UNWATCHED_TIMEOUT);
+	}
+
+	__atomic_store_n(&g_unwatched_until, now_ns() + (uint64_t)(timeout * 1e9), __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&g_unwatched_lock);
+}
+
+static void check_unwatched() {
+	const uint64_t until = __atomic_load_n(&g_unwatched_until, __ATOMIC_RELAXED);
+	if (!until || now_ns() < until) {
+		return;
+	}
+
+	pthread_mutex_lock(&g_unwatched_lock);
+
+	if (g_unwatched_until && now_ns() >= g_unwatched_until) {
+		__atomic_store_n(&g_unwatched_until, 0, __ATOMIC_RELAXED);
+		set_timeouts(g_options.attr_timeout, g_options.entry_timeout);
+	}
+
+	pthread_mutex_unlock(&g_unwatched_lock);
+}
+
+// Keeps the merged listings in sync with the changes done through the mount.
+static void entry_changed(const char *path) {
+	negcache_invalidate(path);
+
+	if (path_parent_has_redirects(path)) {
+		dirindex_invalidate();
+	}
+}
+
+// The snapshot entry of a path in the install root with -o install_snapshot, NULL when the tree has to be asked.
+static inline const struct SnapshotEntry *find_install(const int fd_path, const char *real_path) {
+	return path_get_root_at(fd_path) == PATH_ROOT_INSTALL ? snapshot_find(real_path) : NULL;
+}
+
+// The snapshot can't follow changes, so the install tree is read-only through the mount while it's in use.
+static inline bool is_frozen(const enum PathRoot root) {
+	return root == PATH_ROOT_INSTALL && snapshot_active();
+}
+
+static inline bool is_frozen_fi(const struct fuse_file_info *fi) {
+	return get_class(fi) == STATS_CLASS_INSTALL && snapshot_active();
+}
+
+static void stats_attr(struct stat *buf) {
+	buf->st_mode = S_IFREG | 0444;
+	buf->st_nlink = 1;
+}
+
+// Only cached while the real parent exists and is watched, so that whatever creates the entry invalidates it.
+// Events carry the real name, which is reported under the virtual parent: a redirect that renames the entry
+// itself would be invalidated under the wrong path.
+static void add_missing(const char *path, const int fd_path, const char *real_path) {
+	char parent[PATH_MAX];
+	char vparent[PATH_MAX];
+
+	const char *slash = strrchr(real_path, '/');
+	const char *vslash = strrchr(path, '/');
+	if (!streq(slash ? slash + 1 : real_path, vslash + 1)) {
+		return;
+	}
+
+	if (!slash) {
+		snprintf(parent, sizeof(parent), ".");
+	} else {
+		snprintf(parent, sizeof(parent), "%.*s", slash == real_path ? 1 : (int)(slash - real_path), real_path);
+	}
+
+	snprintf(vparent, sizeof(vparent), "%.*s", vslash == path ? 1 : (int)(vslash - path), path);
+
+	struct stat st;
+	if (fstatat(fd_path, parent, &st, 0) == -1 || !S_ISDIR(st.st_mode) ||
+		watch_add(g_watcher, fd_path, parent, &st, vparent, 0) < 0) {
+		return;
 	}
 
+	negcache_add(path);
+}
+
+// Shared with the merged listings, which must not count a GETATTR per entry. cls is only set once the path resolves.
+static int do_getattr(const char *path, struct stat *buf, enum StatsClass *cls) {
+	if (path_is_stats(path)) {
+		stats_attr(buf);
+		return 0;
+	}
+
+	check_unwatched();
+
 	if (path_is_root(path)) {
 		buf->st_mode = S_IFDIR | 0755;
 		buf->st_nlink = PATH_ROOT_N_SYMLINK;
@@ -81,85 +274,256 @@ static int fs_getattr(const char *path, struct stat *buf, struct fuse_file_info
 		return 0;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = lstat(real_path, buf) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
+	char dir_link[PATH_MAX];
+	const ssize_t dir_link_len = path_get_dir_link(path, dir_link, sizeof(dir_link));
+	if (dir_link_len) {
+		if (dir_link_len < 0) {
+			return (int)dir_link_len;
+		}
+
+		buf->st_mode = S_IFLNK | 0777;
+		buf->st_nlink = 1;
+		buf->st_size = dir_link_len;
+		return 0;
+	}
+
+	if (negcache_contains(path)) {
+		return -ENOENT;
+	}
+
+	char real_path[PATH_MAX];
+	int fd_path;
+
+	const ssize_t real_len = path_get_real_at(path, real_path, sizeof(real_path), &fd_path);
+	if (real_len < 0) {
+		log_path(__func__, path, NULL, PATH_ROOT_NONE);
+		return (int)real_len;
+	}
+
+	*cls = (enum StatsClass)path_get_root_at(fd_path);
+	log_path(__func__, path, real_path, path_get_root_at(fd_path));
+
+	const struct SnapshotEntry *entry = find_install(fd_path, real_path);
+	if (entry) {
+		snapshot_stat(entry, buf);
+		return 0;
+	}
+
+	if (fstatat(fd_path, real_path, buf, AT_SYMLINK_NOFOLLOW) == -1) {
+		const int err = errno;
+		if (err == ENOENT) {
+			add_missing(path, fd_path, real_path);
+		}
+
+		return -err;
+	}
+
+	// Every directory on the way to a path is looked up first, so its parent is always being watched.
+	if (S_ISDIR(buf->st_mode) && watch_add(g_watcher, fd_path, real_path, buf, path, 0) < 0 && g_watcher) {
+		unwatched();
+	}
+
+	return 0;
+}
+
+static int fs_getattr(const char *path, struct stat *buf, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_GETATTR)
+
+	if (fi) {
+		if (is_stats(fi)) {
+			stats_attr(buf);
+			return 0;
+		}
+
+		STATS_CLASS(get_class(fi));
+		return fstat(get_fd(fi), buf) == 0 ? 0 : -errno;
+	}
+
+	enum StatsClass cls = STATS_CLASS_FIXED;
+	const int ret = do_getattr(path, buf, &cls);
+	STATS_CLASS(cls);
 
 	return ret;
 }
 
 static int fs_rename(const char *old, const char *new, unsigned int flags) {
-	if (path_is_fixed(old) || path_is_fixed(new)) {
+	STATS_SCOPE(STATS_OP_RENAME)
+
+	if (is_fixed_entry(old) || is_fixed_entry(new)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH_2(old, new)
-	const int ret = renameat2(AT_FDCWD, real_old, AT_FDCWD, real_new, flags) == 0 ? 0 : -errno;
-	FREE_REAL_PATH_2(old, new)
+	GET_REAL_PATH_AT_2(old, new)
+	if (is_frozen(path_get_root_at(fd_old)) || is_frozen(path_get_root_at(fd_new))) {
+		return -EROFS;
+	}
+
+	int ret = renameat2(fd_old, real_old, fd_new, real_new, flags) == 0 ? 0 : -errno;
+	if (ret == -EXDEV) {
+		ret = -move_across(fd_old, real_old, fd_new, real_new, flags);
+	}
+
+	if (ret == 0) {
+		entry_changed(old);
+		entry_changed(new);
+		// Either of them may be a directory with different contents now.
+		negcache_invalidate_tree(old);
+		negcache_invalidate_tree(new);
+
+		// Events below a moved directory have to be reported under its new name.
+		struct stat st;
+		if ((fstatat(fd_new, real_new, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) ||
+			((flags & RENAME_EXCHANGE) && fstatat(fd_old, real_old, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))) {
+			watch_rename(g_watcher, old, new, flags & RENAME_EXCHANGE);
+		}
+	}
 
 	return ret;
 }
 
 static int fs_unlink(const char *path) {
-	if (path_is_fixed(path)) {
+	STATS_SCOPE(STATS_OP_UNLINK)
+
+	if (is_fixed_entry(path)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = unlink(real_path) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
+	GET_REAL_PATH_AT(path)
+	if (is_frozen(path_get_root_at(fd_path))) {
+		return -EROFS;
+	}
+
+	const int ret = unlinkat(fd_path, real_path, 0) == 0 ? 0 : -errno;
+	if (ret == 0) {
+		entry_changed(path);
+	}
 
 	return ret;
 }
 
 static int fs_rmdir(const char *path) {
-	if (path_is_fixed(path)) {
+	STATS_SCOPE(STATS_OP_RMDIR)
+
+	if (is_fixed_entry(path)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = rmdir(real_path) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
+	GET_REAL_PATH_AT(path)
+	if (is_frozen(path_get_root_at(fd_path))) {
+		return -EROFS;
+	}
+
+	const int ret = unlinkat(fd_path, real_path, AT_REMOVEDIR) == 0 ? 0 : -errno;
+	if (ret == 0) {
+		entry_changed(path);
+	}
 
 	return ret;
 }
 
 static int fs_symlink(const char *from, const char *to) {
-	if (path_is_fixed(to)) {
+	STATS_SCOPE(STATS_OP_SYMLINK)
+
+	if (is_fixed_entry(to)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH_2(from, to)
-	const int ret = symlink(real_from, real_to) == 0 ? 0 : -errno;
-	FREE_REAL_PATH_2(from, to)
+	// The link's target is stored as is, so it has to be absolute.
+	GET_REAL_PATH(from)
+	GET_REAL_PATH_AT(to)
+	if (is_frozen(path_get_root_at(fd_to))) {
+		return -EROFS;
+	}
+
+	const int ret = symlinkat(real_from, fd_to, real_to) == 0 ? 0 : -errno;
+	if (ret == 0) {
+		entry_changed(to);
+	}
 
 	return ret;
 }
 
 static int fs_link(const char *from, const char *to) {
-	if (path_is_fixed(to)) {
+	STATS_SCOPE(STATS_OP_LINK)
+
+	if (is_fixed_entry(to)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH_2(from, to)
-	const int ret = link(real_from, real_to) == 0 ? 0 : -errno;
-	FREE_REAL_PATH_2(from, to)
+	GET_REAL_PATH_AT_2(from, to)
+	if (is_frozen(path_get_root_at(fd_from)) || is_frozen(path_get_root_at(fd_to))) {
+		return -EROFS;
+	}
+
+	const int ret = linkat(fd_from, real_from, fd_to, real_to, 0) == 0 ? 0 : -errno;
+	if (ret == 0) {
+		entry_changed(to);
+	}
 
 	return ret;
 }
 
-static int fs_release(const char *path, struct fuse_file_info *fi) {
-	(void)path;
+static int do_release(struct fuse_file_info *fi) {
+	if (is_stats(fi)) {
+		free((void *)(uintptr_t)(fi->fh & ~FH_STATS));
+		return 0;
+	}
 
-	int fd = (int)fi->fh;
+	int fd = get_fd(fi);
 	if (fd == -1) {
 		return -EBADF;
 	}
 
+	prefetch_note_close(fd);
+	durability_release(fd, fi->flags, get_durability(fi));
+
 	return close(fd) == 0 ? 0 : -errno;
 }
 
-static int fs_open(const char *path, struct fuse_file_info *fi) {
+static int fs_release(const char *path, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_RELEASE)
+
+	(void)path;
+
+	STATS_CLASS(get_class(fi));
+
+	return do_release(fi);
+}
+
+static int fs_releasedir(const char *path, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_RELEASEDIR)
+
+	(void)path;
+
+	STATS_CLASS(get_class(fi));
+
+	struct DirHandle *handle = get_dir(fi);
+	const int ret = handle->fh == FD_ROOT ? 0 : do_release(fi);
+
+	free(handle);
+
+	return ret;
+}
+
+// The contents are generated once per open, so that reads at different offsets see the same snapshot.
+static int open_stats(struct fuse_file_info *fi) {
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+
+	size_t len;
+	char *buf = stats_format(&len);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	fi->fh = FH_STATS | (uintptr_t)buf;
+	fi->direct_io = 1;
+
+	return 0;
+}
+
+static int do_open(const char *path, struct fuse_file_info *fi) {
 	if (path_is_root(path)) {
 		fi->fh = FD_ROOT;
 		return 0;
@@ -167,49 +531,187 @@ static int fs_open(const char *path, struct fuse_file_info *fi) {
 
 	const char *link = path_get_link(path, true);
 	if (link) {
-		return fs_open(link, fi);
+		return do_open(link, fi);
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = open(real_path, fi->flags);
-	FREE_REAL_PATH(path)
+	char real_path[PATH_MAX];
+	int fd_path;
+
+	const ssize_t real_len = path_get_real_at(path, real_path, sizeof(real_path), &fd_path);
+	if (real_len < 0) {
+		log_path(__func__, path, NULL, PATH_ROOT_NONE);
+		return (int)real_len;
+	}
+
+	log_path(__func__, path, real_path, path_get_root_at(fd_path));
+
+	if (is_frozen(path_get_root_at(fd_path)) && ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))) {
+		return -EROFS;
+	}
+
+	const int ret = openat(fd_path, real_path, fi->flags);
 
 	if (ret == -1) {
 		return -errno;
 	}
 
-	fi->fh = ret;
+	fi->fh = (uint64_t)ret | ((uint64_t)path_get_root_at(fd_path) << FH_ROOT_SHIFT) |
+			 ((uint64_t)path_get_durability(path) << FH_DURABILITY_SHIFT);
 
 	return 0;
 }
 
-static int fs_read(const char *path, char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+static int fs_open(const char *path, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_OPEN)
+
+	if (path_is_stats(path)) {
+		return open_stats(fi);
+	}
+
+	int ret;
+	if (g_writeback) {
+		const int flags = fi->flags;
+
+		fi->flags = filesystem_writeback_flags(flags);
+		ret = do_open(path, fi);
+
+		// Files that can't be promoted bypass the page cache, partial pages would be read through a write-only handle.
+		if (ret == -EACCES && (flags & O_ACCMODE) == O_WRONLY) {
+			fi->flags = flags & ~O_APPEND;
+			ret = do_open(path, fi);
+			fi->direct_io = 1;
+		}
+
+		fi->flags = flags;
+	} else {
+		ret = do_open(path, fi);
+	}
+
+	if (ret == 0) {
+		STATS_CLASS(get_class(fi));
+		prefetch_note_open(get_fd(fi), fi->flags);
+	}
+
+	return ret;
+}
+
+static int fs_opendir(const char *path, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_OPENDIR)
+
+	const size_t len = strlen(path);
+
+	struct DirHandle *handle = malloc(sizeof(*handle) + len + 1);
+	if (!handle) {
+		return -ENOMEM;
+	}
+
+	const int ret = do_open(path, fi);
+	if (ret != 0) {
+		free(handle);
+		return ret;
+	}
+
+	STATS_CLASS(get_class(fi));
+
+	handle->fh = fi->fh;
+	handle->snapshot = NULL;
+	memcpy(handle->path, path, len + 1);
+
+	char real_path[PATH_MAX];
+	int fd_path;
+	if (get_class(fi) == STATS_CLASS_INSTALL && !path_has_redirects(path) &&
+		path_get_real_at(path, real_path, sizeof(real_path), &fd_path) >= 0) {
+		const struct SnapshotEntry *dir = find_install(fd_path, real_path);
+		if (dir && S_ISDIR(snapshot_mode(dir))) {
+			handle->snapshot = dir;
+		}
+	}
+
+	fi->fh = FH_DIR | (uintptr_t)handle;
+
+	return 0;
+}
+
+// Hands libfuse a buffer backed by the real file, so that the data is spliced into the reply instead of copied.
+static int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t off, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_READ)
+
 	(void)path;
 
-	const ssize_t ret = pread((int)fi->fh, buf, size, off);
+	STATS_CLASS(get_class(fi));
 
-	return ret >= 0 ? ret : -errno;
+	struct fuse_bufvec *buf = malloc(sizeof(*buf));
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	*buf = FUSE_BUFVEC_INIT(size);
+
+	if (is_stats(fi)) {
+		char *stats = (char *)(uintptr_t)(fi->fh & ~FH_STATS);
+		const size_t len = strlen(stats);
+		const size_t start = (size_t)off < len ? (size_t)off : len;
+
+		buf->buf[0].mem = stats + start;
+		buf->buf[0].size = len - start < size ? len - start : size;
+
+		*bufp = buf;
+		return 0;
+	}
+
+	buf->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf->buf[0].fd = get_fd(fi);
+	buf->buf[0].pos = off;
+
+	prefetch_note_read(buf->buf[0].fd, off, size);
+
+	*bufp = buf;
+
+	return 0;
 }
 
-static int fs_write(const char *path, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+static int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_WRITE)
+
 	(void)path;
 
-	const ssize_t ret = pwrite((int)fi->fh, buf, size, off);
+	STATS_CLASS(get_class(fi));
 
-	return ret >= 0 ? ret : -errno;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = get_fd(fi);
+	dst.buf[0].pos = off;
+
+	return (int)fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
+static int do_fsync(const int datasync, struct fuse_file_info *fi) {
+	return -durability_fsync(get_fd(fi), datasync, get_durability(fi));
 }
 
 static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_FSYNC)
+
 	(void)path;
 
-	if (datasync) {
-		return fdatasync((int)fi->fh) == 0 ? 0 : -errno;
-	} else {
-		return fsync((int)fi->fh) == 0 ? 0 : -errno;
-	}
+	STATS_CLASS(get_class(fi));
+
+	return do_fsync(datasync, fi);
+}
+
+static int fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_FSYNCDIR)
+
+	(void)path;
+
+	STATS_CLASS(get_class(fi));
+
+	return do_fsync(datasync, fi);
 }
 
 static int fs_flush(const char *path, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_FLUSH)
+
 	(void)path;
 	(void)fi;
 
@@ -217,34 +719,97 @@ static int fs_flush(const char *path, struct fuse_file_info *fi) {
 }
 
 static int fs_statfs(const char *path, struct statvfs *buf) {
+	STATS_SCOPE(STATS_OP_STATFS)
+
 	if (path_is_fixed(path) && !path_is_steam_root(path)) {
 		return 0;
 	}
 
 	GET_REAL_PATH(path)
 	const int ret = statvfs(real_path, buf) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
 
 	return ret;
 }
 
-static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
-	(void)path;
-	(void)off;
-	(void)flags;
-
-	if (fi->fh == FD_ROOT) {
-		const char **names = path_get_root_names();
-		for (const char *name = *names; name; name = *(++names)) {
-			if (filler(buf, name, NULL, 0, 0) == 1) {
-				break;
-			}
+static inline bool is_dot_or_dotdot(const char *name) {
+	return streq(name, ".") || streq(name, "..");
+}
+
+// Children of directories with redirects may live somewhere else than the directory itself, hence the merged index.
+static int readdir_index(const char *path, void *buf, fuse_fill_dir_t filler, const bool plus) {
+	struct DirIndex *index = dirindex_get(path);
+	if (!index) {
+		return -errno;
+	}
+
+	struct stat st;
+
+	for (size_t i = 0; i < index->n; ++i) {
+		const char *name = index->entries[i].name;
+
+		bool has_attr = false;
+		if (plus && !is_dot_or_dotdot(name)) {
+			char vpath[PATH_MAX];
+			snprintf(vpath, sizeof(vpath), "%s/%s", path_is_root(path) ? "" : path, name);
+			enum StatsClass cls;
+			has_attr = do_getattr(vpath, &st, &cls) == 0;
 		}
 
+		if (filler(buf, name, has_attr ? &st : NULL, 0, has_attr ? FUSE_FILL_DIR_PLUS : 0) == 1) {
+			break;
+		}
+	}
+
+	dirindex_put(index);
+
+	return 0;
+}
+
+static int readdir_snapshot(const struct SnapshotEntry *dir, void *buf, fuse_fill_dir_t filler, const bool plus) {
+	if (filler(buf, ".", NULL, 0, 0) == 1 || filler(buf, "..", NULL, 0, 0) == 1) {
 		return 0;
 	}
 
-	int fd = dup((int)fi->fh);
+	struct stat st;
+
+	for (size_t i = 0; i < snapshot_n_children(dir); ++i) {
+		const struct SnapshotEntry *entry = snapshot_child(dir, i);
+		if (plus) {
+			snapshot_stat(entry, &st);
+		}
+
+		if (filler(buf, snapshot_name(entry), plus ? &st : NULL, 0, plus ? FUSE_FILL_DIR_PLUS : 0) == 1) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+	STATS_SCOPE(STATS_OP_READDIR)
+
+	(void)off;
+
+	const bool plus = flags & FUSE_READDIR_PLUS;
+	if (plus) {
+		stats_scope.op = STATS_OP_READDIRPLUS;
+	}
+
+	(void)path;
+
+	STATS_CLASS(get_class(fi));
+
+	const struct DirHandle *handle = get_dir(fi);
+	if (path_has_redirects(handle->path)) {
+		return readdir_index(handle->path, buf, filler, plus);
+	}
+
+	if (handle->snapshot) {
+		return readdir_snapshot(handle->snapshot, buf, filler, plus);
+	}
+
+	int fd = dup(get_fd(fi));
 	if (fd == -1) {
 		return -errno;
 	}
@@ -254,55 +819,91 @@ static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t
 		return -errno;
 	}
 
-	errno = 0;
+	int err = 0;
+
+	while (true) {
+		errno = 0;
 
-	struct dirent *ent;
-	while ((ent = readdir(dir)) != NULL) {
-		if (filler(buf, ent->d_name, NULL, 0, 0) == 1) {
+		struct dirent *ent = readdir(dir);
+		if (!ent) {
+			err = errno;
+			break;
+		}
+
+		struct stat st;
+		const bool has_attr = plus && !is_dot_or_dotdot(ent->d_name) && fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+		if (filler(buf, ent->d_name, has_attr ? &st : NULL, 0, has_attr ? FUSE_FILL_DIR_PLUS : 0) == 1) {
 			break;
 		}
 	}
 
 	closedir(dir);
 
-	return -errno;
+	return -err;
 }
 
 static int fs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_CHMOD)
+
 	if (fi) {
-		return fchmod((int)fi->fh, mode) == 0 ? 0 : -errno;
+		STATS_CLASS(get_class(fi));
+		if (is_frozen_fi(fi)) {
+			return -EROFS;
+		}
+
+		return fchmod(get_fd(fi), mode) == 0 ? 0 : -errno;
 	}
 
 	if (path_is_fixed(path)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = chmod(real_path, mode) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
+	GET_REAL_PATH_AT(path)
+	if (is_frozen(path_get_root_at(fd_path))) {
+		return -EROFS;
+	}
+
+	const int ret = fchmodat(fd_path, real_path, mode, 0) == 0 ? 0 : -errno;
 
 	return ret;
 }
 
 static int fs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_CHOWN)
+
 	if (fi) {
-		return fchown((int)fi->fh, uid, gid) == 0 ? 0 : -errno;
+		STATS_CLASS(get_class(fi));
+		if (is_frozen_fi(fi)) {
+			return -EROFS;
+		}
+
+		return fchown(get_fd(fi), uid, gid) == 0 ? 0 : -errno;
 	}
 
 	if (path_is_fixed(path)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = chown(real_path, uid, gid) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
+	GET_REAL_PATH_AT(path)
+	if (is_frozen(path_get_root_at(fd_path))) {
+		return -EROFS;
+	}
+
+	const int ret = fchownat(fd_path, real_path, uid, gid, 0) == 0 ? 0 : -errno;
 
 	return ret;
 }
 
 static int fs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_TRUNCATE)
+
 	if (fi) {
-		return ftruncate((int)fi->fh, size) == 0 ? 0 : -errno;
+		STATS_CLASS(get_class(fi));
+		if (is_frozen_fi(fi)) {
+			return -EROFS;
+		}
+
+		return ftruncate(get_fd(fi), size) == 0 ? 0 : -errno;
 	}
 
 	if (path_is_fixed(path)) {
@@ -310,50 +911,92 @@ static int fs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
 	}
 
 	GET_REAL_PATH(path)
+	if (is_frozen(path_get_root(real_path))) {
+		return -EROFS;
+	}
+
 	const int ret = truncate(real_path, size) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
 
 	return ret;
 }
 
 static int fs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_UTIMENS)
+
 	if (fi) {
-		return futimens((int)fi->fh, tv) == 0 ? 0 : -errno;
+		STATS_CLASS(get_class(fi));
+		if (is_frozen_fi(fi)) {
+			return -EROFS;
+		}
+
+		return futimens(get_fd(fi), tv) == 0 ? 0 : -errno;
 	}
 
 	if (path_is_fixed(path)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = utimensat(AT_FDCWD, real_path, tv, 0) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
+	GET_REAL_PATH_AT(path)
+	if (is_frozen(path_get_root_at(fd_path))) {
+		return -EROFS;
+	}
+
+	const int ret = utimensat(fd_path, real_path, tv, 0) == 0 ? 0 : -errno;
 
 	return ret;
 }
 
 static int fs_access(const char *path, int mask) {
+	STATS_SCOPE(STATS_OP_ACCESS)
+
 	if (path_is_fixed(path)) {
 		return 0;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = access(real_path, mask) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
+	GET_REAL_PATH_AT(path)
+
+	const struct SnapshotEntry *entry = find_install(fd_path, real_path);
+	if (entry) {
+		return -snapshot_access(entry, mask);
+	}
+
+	const int ret = faccessat(fd_path, real_path, mask, 0) == 0 ? 0 : -errno;
 
 	return ret;
 }
 
 static int fs_readlink(const char *path, char *buf, size_t len) {
+	STATS_SCOPE(STATS_OP_READLINK)
+
 	const char *link = path_get_link(path, false);
 	if (link) {
 		strncpy(buf, link, len);
 		return 0;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = (int)readlink(real_path, buf, len > 0 ? len - 1 : 0);
-	FREE_REAL_PATH(path)
+	char dir_link[PATH_MAX];
+	const ssize_t dir_link_len = path_get_dir_link(path, dir_link, sizeof(dir_link));
+	if (dir_link_len) {
+		if (dir_link_len < 0) {
+			return (int)dir_link_len;
+		}
+
+		strncpy(buf, dir_link, len);
+		return 0;
+	}
+
+	GET_REAL_PATH_AT(path)
+
+	const struct SnapshotEntry *entry = find_install(fd_path, real_path);
+	if (entry && snapshot_link(entry)) {
+		if (len > 0) {
+			snprintf(buf, len, "%s", snapshot_link(entry));
+		}
+
+		return 0;
+	}
+
+	const int ret = (int)readlinkat(fd_path, real_path, buf, len > 0 ? len - 1 : 0);
 
 	if (ret < 0) {
 		return -errno;
@@ -367,106 +1010,361 @@ static int fs_readlink(const char *path, char *buf, size_t len) {
 }
 
 static int fs_mknod(const char *path, mode_t mode, dev_t rdev) {
-	if (path_is_fixed(path)) {
+	STATS_SCOPE(STATS_OP_MKNOD)
+
+	if (is_fixed_entry(path)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = mknod(real_path, mode, rdev) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
+	GET_REAL_PATH_AT(path)
+	if (is_frozen(path_get_root_at(fd_path))) {
+		return -EROFS;
+	}
+
+	const int ret = mknodat(fd_path, real_path, mode, rdev) == 0 ? 0 : -errno;
+	if (ret == 0) {
+		entry_changed(path);
+	}
 
 	return ret;
 }
 
 static int fs_mkdir(const char *path, mode_t mode) {
-	if (path_is_fixed(path)) {
+	STATS_SCOPE(STATS_OP_MKDIR)
+
+	if (is_fixed_entry(path)) {
 		return -EACCES;
 	}
 
-	GET_REAL_PATH(path)
-	const int ret = mkdir(real_path, mode) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
+	GET_REAL_PATH_AT(path)
+	if (is_frozen(path_get_root_at(fd_path))) {
+		return -EROFS;
+	}
+
+	const int ret = mkdirat(fd_path, real_path, mode) == 0 ? 0 : -errno;
+	if (ret == 0) {
+		entry_changed(path);
+	}
 
 	return ret;
 }
 
 static int fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+	STATS_SCOPE(STATS_OP_SETXATTR)
+
+	if (path_is_stats(path)) {
+		return -filesystem_log_setxattr(name, value, size);
+	}
+
 	if (path_is_fixed(path)) {
 		return -EACCES;
 	}
 
 	GET_REAL_PATH(path)
+	if (is_frozen(path_get_root(real_path))) {
+		return -EROFS;
+	}
+
 	const int ret = setxattr(real_path, name, value, size, flags) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path);
 
 	return ret;
 }
 
 static int fs_getxattr(const char *path, const char *name, char *value, size_t size) {
+	STATS_SCOPE(STATS_OP_GETXATTR)
+
+	if (path_is_stats(path)) {
+		return (int)filesystem_log_getxattr(name, value, size);
+	}
+
 	if (path_is_fixed(path)) {
 		return 0;
 	}
 
 	GET_REAL_PATH(path)
 	const int ret = (int)getxattr(real_path, name, value, size);
-	FREE_REAL_PATH(path)
 
 	return ret >= 0 ? 0 : -errno;
 }
 
 static int fs_listxattr(const char *path, char *list, size_t size) {
+	STATS_SCOPE(STATS_OP_LISTXATTR)
+
 	if (path_is_fixed(path)) {
 		return 0;
 	}
 
 	GET_REAL_PATH(path)
 	const int ret = (int)listxattr(real_path, list, size);
-	FREE_REAL_PATH(path)
 
 	return ret >= 0 ? 0 : -errno;
 }
 
 static int fs_removexattr(const char *path, const char *name) {
+	STATS_SCOPE(STATS_OP_REMOVEXATTR)
+
 	if (path_is_fixed(path)) {
 		return -EACCES;
 	}
 
 	GET_REAL_PATH(path)
+	if (is_frozen(path_get_root(real_path))) {
+		return -EROFS;
+	}
+
 	const int ret = removexattr(real_path, name) == 0 ? 0 : -errno;
-	FREE_REAL_PATH(path)
 
 	return ret;
 }
 
 static int fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_FALLOCATE)
+
 	(void)path;
 
-	return fallocate((int)fi->fh, mode, offset, length) == 0 ? 0 : -errno;
+	STATS_CLASS(get_class(fi));
+
+	return fallocate(get_fd(fi), mode, offset, length) == 0 ? 0 : -errno;
 }
 
 static ssize_t fs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t off_in,
 								  const char *path_out, struct fuse_file_info *fi_out, off_t off_out,
 								  size_t len, int flags) {
+	STATS_SCOPE(STATS_OP_COPY_FILE_RANGE)
+
 	(void)path_in;
 	(void)path_out;
 
-	const ssize_t ret = copy_file_range((int)fi_in->fh, &off_in, (int)fi_out->fh, &off_out, len, flags);
+	STATS_CLASS(get_class(fi_out));
+
+	const ssize_t ret = filesystem_copy_range(get_fd(fi_in), &off_in, get_fd(fi_out), &off_out, len, flags);
 
 	return ret >= 0 ? ret : -errno;
 }
 
 static off_t fs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_LSEEK)
+
 	(void)path;
 
-	const off_t ret = lseek((int)fi->fh, off, whence);
+	STATS_CLASS(get_class(fi));
+
+	const off_t ret = lseek(get_fd(fi), off, whence);
 
 	return ret >= 0 ? ret : -errno;
 }
 
-static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
-	(void)conn;
+static void fs_spec_changed(void *data, const char *vpath) {
+	(void)data;
+
+	fuse_invalidate_path(g_fuse, vpath);
+}
+
+static PathMatchFunc g_spec_changed;
+
+static void *reload_thread(void *arg) {
+	(void)arg;
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+
+	while (true) {
+		int sig;
+		if (sigwait(&set, &sig) != 0 || !path_reload(g_spec_changed, NULL)) {
+			continue;
+		}
+
+		dirindex_invalidate();
+		negcache_invalidate_tree("/");
+
+		printf("Reloaded the path specs.\n");
+	}
+
+	return NULL;
+}
+
+void filesystem_reload_start(PathMatchFunc changed) {
+	if (!g_options.redirects) {
+		return;
+	}
+
+	g_spec_changed = changed;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, reload_thread, NULL) != 0) {
+		printf("Failed to start the reload thread!\n");
+		return;
+	}
+
+	pthread_detach(thread);
+}
+
+ssize_t filesystem_copy_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags) {
+	struct stat st;
+	if (flags || fstat(fd_in, &st) == -1 || !S_ISREG(st.st_mode) || *off_in >= st.st_size) {
+		goto COPY;
+	}
+
+	// A clone can't go past the end of the source, but one reaching it may end on a partial block.
+	if (len > (size_t)(st.st_size - *off_in)) {
+		len = (size_t)(st.st_size - *off_in);
+	}
+
+	struct file_clone_range range = { .src_fd = fd_in, .src_offset = (uint64_t)*off_in, .src_length = len, .dest_offset = (uint64_t)*off_out };
+	if (ioctl(fd_out, FICLONERANGE, &range) == 0) {
+		*off_in += (off_t)len;
+		*off_out += (off_t)len;
+		return (ssize_t)len;
+	}
+
+COPY:
+	// Unaligned ranges, different filesystems and filesystems without extent sharing.
+	return copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+int filesystem_log_setxattr(const char *name, const char *value, const size_t size) {
+	if (!streq(name, LOG_XATTR)) {
+		return EACCES;
+	}
+
+	char spec[512];
+	if (size >= sizeof(spec)) {
+		return EINVAL;
+	}
+
+	memcpy(spec, value, size);
+	spec[size] = '\0';
+
+	return log_configure(spec) ? 0 : EINVAL;
+}
+
+ssize_t filesystem_log_getxattr(const char *name, char *value, const size_t size) {
+	if (!streq(name, LOG_XATTR)) {
+		return -ENODATA;
+	}
 
+	char spec[512];
+	const int len = log_format_spec(spec, sizeof(spec));
+	if (len < 0 || (size_t)len >= sizeof(spec) || (size && (size_t)len > size)) {
+		return -ERANGE;
+	}
+
+	if (size) {
+		memcpy(value, spec, (size_t)len);
+	}
+
+	return len;
+}
+
+void filesystem_conn_init(struct fuse_conn_info *conn) {
+	// libfuse lowers it to what its receive buffer holds and derives max_pages from it.
+	conn->max_write = g_options.max_write ? g_options.max_write : UINT_MAX;
+
+	// The kernel starts out with the most it supports.
+	if (g_options.max_readahead && g_options.max_readahead < conn->max_readahead) {
+		conn->max_readahead = g_options.max_readahead;
+	}
+
+	conn->max_background = g_options.max_background;
+	conn->congestion_threshold = g_options.congestion_threshold ? g_options.congestion_threshold : g_options.max_background * 3 / 4;
+
+	if (g_options.sync_read) {
+		conn->want &= ~FUSE_CAP_ASYNC_READ;
+	} else {
+		conn->want |= conn->capable & FUSE_CAP_ASYNC_READ;
+	}
+
+	printf("Requested max_write=%u max_readahead=%u max_background=%u congestion_threshold=%u async_read=%s\n",
+		   conn->max_write, conn->max_readahead, conn->max_background, conn->congestion_threshold,
+		   (conn->want & FUSE_CAP_ASYNC_READ) ? "yes" : "no");
+}
+
+// The high-level API has no way to drop negative entries, those expire after negative_timeout.
+static void fs_invalidate(const char *vpath, uint64_t ino, const char *name, uint32_t mask) {
+	(void)ino;
+
+	// The kernel's entries below the directories can't be dropped by name, they are left to expire.
+	if (mask & IN_Q_OVERFLOW) {
+		if (!vpath) {
+			negcache_invalidate_tree("/");
+			dirindex_invalidate();
+			unwatched();
+		} else {
+			fuse_invalidate_path(g_fuse, vpath);
+		}
+
+		return;
+	}
+
+	// Evicted to make room for another directory, whatever was cached below it can't be trusted anymore.
+	if (mask & IN_IGNORED) {
+		negcache_invalidate_tree(vpath);
+		unwatched();
+		return;
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", path_is_root(vpath) ? "" : vpath, name);
+
+	// Writes don't change the directory.
+	if (mask & IN_MODIFY) {
+		fuse_invalidate_path(g_fuse, path);
+		return;
+	}
+
+	if (mask & IN_ISDIR) {
+		negcache_invalidate_tree(path);
+	} else {
+		negcache_invalidate(path);
+	}
+
+	fuse_invalidate_path(g_fuse, path);
+	fuse_invalidate_path(g_fuse, vpath);
+}
+
+// Nothing tells the high-level backend when the kernel forgets a directory, the least recently used ones are
+// dropped instead. Half of the per-user watches are left to other programs.
+static size_t watch_capacity() {
+	unsigned long max = 8192;
+
+	FILE *file = fopen("/proc/sys/fs/inotify/max_user_watches", "re");
+	if (file) {
+		if (fscanf(file, "%lu", &max) != 1) {
+			max = 8192;
+		}
+
+		fclose(file);
+	}
+
+	return max / 2 ? max / 2 : 1;
+}
+
+static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
 	cfg->nullpath_ok = 1;
+	cfg->attr_timeout = g_options.attr_timeout;
+	cfg->entry_timeout = g_options.entry_timeout;
+	cfg->negative_timeout = g_options.negative_timeout;
+
+	g_fuse = fuse_get_context()->fuse;
+	g_config = cfg;
+	g_watcher = watch_new(fs_invalidate, watch_capacity());
+	negcache_init(g_options.negative_cache, g_options.negative_timeout);
+	dirindex_init();
+	log_start();
+	stats_start();
+	prefetch_start();
+	durability_start(g_options.group_commit);
+	filesystem_reload_start(fs_spec_changed);
+
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	if (g_options.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		g_writeback = true;
+	}
+
+	filesystem_conn_init(conn);
 
 	return NULL;
 }
@@ -485,8 +1383,8 @@ static const struct fuse_operations operations = {
 	.chown = fs_chown,
 	.truncate = fs_truncate,
 	.open = fs_open,
-	.read = fs_read,
-	.write = fs_write,
+	.read_buf = fs_read_buf,
+	.write_buf = fs_write_buf,
 	.statfs = fs_statfs,
 	.flush = fs_flush,
 	.release = fs_release,
@@ -495,10 +1393,10 @@ static const struct fuse_operations operations = {
 	.getxattr = fs_getxattr,
 	.listxattr = fs_listxattr,
 	.removexattr = fs_removexattr,
-	.opendir = fs_open,
+	.opendir = fs_opendir,
 	.readdir = fs_readdir,
-	.releasedir = fs_release,
-	.fsyncdir = fs_fsync,
+	.releasedir = fs_releasedir,
+	.fsyncdir = fs_fsyncdir,
 	.init = fs_init,
 	.access = fs_access,
 	.utimens = fs_utimens,
@@ -507,10 +1405,76 @@ static const struct fuse_operations operations = {
 	.lseek = fs_lseek
 };
 
+const struct fuse_operations *filesystem_get_operations() {
+	return &operations;
+}
+
 int filesystem_exec(int argc, char *argv[]) {
-	if (!path_init()) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+	if (!options_parse(&args)) {
 		return 1;
 	}
 
-	return fuse_main(argc, argv, &operations, NULL);
+	if (g_options.log && !log_configure(g_options.log)) {
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	if (!path_init(g_options.redirects, g_options.hybrid)) {
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	// Only a cache, the install directory is served as usual without it.
+	if (g_options.install_snapshot && !g_options.lowlevel) {
+		snapshot_init(g_options.install_snapshot, path_get_root_fd(PATH_ROOT_INSTALL));
+	}
+
+	stats_init();
+
+	// Taken by the reload thread instead of libfuse's handler, which would unmount.
+	if (g_options.redirects) {
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+	}
+
+	if (g_options.prefetch && !prefetch_init(g_options.prefetch, g_options.prefetch_window)) {
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	int ret;
+	if (g_options.lowlevel) {
+		if (g_options.trace) {
+			fprintf(stderr, "Tracing needs the high-level backend, ignoring trace=%s\n", g_options.trace);
+		}
+
+		if (g_options.install_snapshot) {
+			fprintf(stderr, "The install snapshot needs the high-level backend, ignoring install_snapshot=%s\n", g_options.install_snapshot);
+		}
+
+		ret = filesystem_ll_exec(&args);
+	} else if (g_options.trace) {
+		if (!trace_open(g_options.trace)) {
+			fuse_opt_free_args(&args);
+			return 1;
+		}
+
+		ret = fuse_main(args.argc, args.argv, trace_wrap(&operations), NULL);
+
+		trace_close();
+	} else {
+		ret = fuse_main(args.argc, args.argv, &operations, NULL);
+	}
+
+	prefetch_stop();
+	durability_stop();
+	log_stop();
+
+	fuse_opt_free_args(&args);
+
+	return ret;
 }
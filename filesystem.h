@@ -17,4 +17,46 @@
 
 #pragma once
 
+#include "path.h"
+
+#include <fcntl.h>
+
+#include <sys/types.h>
+
+// Seconds the kernel may cache entries whose directory couldn't be watched, changes to them go unnoticed.
+#define FILESYSTEM_UNWATCHED_TIMEOUT (1.0)
+
+struct fuse_args;
+struct fuse_conn_info;
+struct fuse_operations;
+
 int filesystem_exec(int argc, char *argv[]);
+
+// The high-level handlers, for driving them without a mount. path_init() has to be called first.
+const struct fuse_operations *filesystem_get_operations();
+
+int filesystem_ll_exec(struct fuse_args *args);
+
+// With the writeback cache the kernel reads in partial pages through write-only handles too, and it tracks
+// the end of the file itself: appends arrive with explicit offsets, which O_APPEND would make pwrite() ignore.
+static inline int filesystem_writeback_flags(int flags) {
+	if ((flags & O_ACCMODE) == O_WRONLY) {
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
+	}
+
+	return flags & ~O_APPEND;
+}
+
+// copy_file_range() that shares the extents when the backing filesystem can (btrfs, XFS...), so that copying
+// a game between library folders doesn't rewrite its data. Same contract as the syscall.
+ssize_t filesystem_copy_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+
+// The log filter, as the user.log attribute of the stats file. Return an errno and a length or -errno.
+int filesystem_log_setxattr(const char *name, const char *value, size_t size);
+ssize_t filesystem_log_getxattr(const char *name, char *value, size_t size);
+
+// Negotiates request sizes and parallelism from the options, shared by both backends' init.
+void filesystem_conn_init(struct fuse_conn_info *conn);
+
+// Reloads the path specs on SIGHUP when they come from a file, changed is called for the virtual paths they touched.
+void filesystem_reload_start(PathMatchFunc changed);
@@ -0,0 +1,1704 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "filesystem.h"
+
+#include "dirindex.h"
+#include "durability.h"
+#include "log.h"
+#include "move.h"
+#include "options.h"
+#include "path.h"
+#include "prefetch.h"
+#include "stats.h"
+#include "uring.h"
+#include "watch.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#include <fuse_lowlevel.h>
+
+#define INODE_TABLE_MIN_BUCKETS (1024)
+
+// Set in the file handle when the backing file was registered for kernel passthrough.
+#define FH_PASSTHROUGH (UINT64_C(1) << 32)
+// The stats file's handle is the address of its contents, tagged with this bit.
+#define FH_STATS (UINT64_C(1) << 62)
+
+#define PROC_FD_NAME(name, fd)  \
+	char name[32];              \
+	snprintf(name, sizeof(name), "/proc/self/fd/%i", fd);
+
+struct Inode {
+	struct Inode *next;
+	// Virtual path, only kept for nodes whose children may be redirected (and for the fixed links).
+	const char *vpath;
+	// Target of the fixed root symlinks, NULL for everything else.
+	const char *link;
+	uint64_t nlookup;
+	dev_t dev;
+	ino_t ino;
+	enum PathRoot root;
+	// Of the spec the node was looked up through, inherited by the children of nodes without a vpath.
+	enum PathDurability durability;
+	// O_PATH descriptor of the real node, -1 for synthetic nodes.
+	int fd;
+	// Passthrough backing file shared by all the open handles and its access mode, protected by the table lock.
+	int backing_id;
+	int backing_mode;
+	uint32_t n_backing;
+	// inotify descriptor for directories, -1 otherwise.
+	int wd;
+	// Set once the node was looked up in a directory that isn't watched, or is one.
+	bool unwatched;
+};
+
+struct DirHandle {
+	// Merged listing for directories with redirects, which have no backing directory to read.
+	struct DirIndex *index;
+	DIR *dir;
+	struct dirent *ent;
+	off_t off;
+};
+
+// Data buffer of a read or write that completes on an io_uring thread.
+struct AsyncIo {
+	fuse_req_t req;
+	char buf[];
+};
+
+// A child name resolved into a pair suitable for the *at() family of syscalls.
+struct Child {
+	int dirfd;
+	const char *path;
+	bool mapped;
+	bool fixed;
+	enum PathRoot root;
+	char vpath[PATH_MAX];
+	char real[PATH_MAX];
+};
+
+static struct {
+	struct Inode **buckets;
+	size_t n_buckets;
+	size_t n_inodes;
+	pthread_mutex_t lock;
+} g_table = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct fuse_session *g_session;
+static struct Watcher *g_watcher;
+
+static bool g_passthrough;
+static bool g_writeback;
+static bool g_uring;
+
+static struct Inode g_root = { .vpath = "/", .nlookup = 1, .fd = -1 };
+static struct Inode g_links[PATH_ROOT_N_SYMLINK];
+static struct Inode g_stats = { .nlookup = 1, .ino = FUSE_ROOT_ID + PATH_ROOT_N_SYMLINK + 1, .fd = -1 };
+// Symlinks standing in for whole-directory redirects in hybrid mode, never freed, protected by the table lock.
+static struct Inode *g_dir_links;
+static ino_t g_next_dir_link = FUSE_ROOT_ID + PATH_ROOT_N_SYMLINK + 2;
+
+static inline struct Inode *get_inode(const fuse_ino_t ino) {
+	return ino == FUSE_ROOT_ID ? &g_root : (struct Inode *)(uintptr_t)ino;
+}
+
+static inline fuse_ino_t get_ino(const struct Inode *inode) {
+	return inode == &g_root ? FUSE_ROOT_ID : (fuse_ino_t)(uintptr_t)inode;
+}
+
+static inline int get_fd(const struct fuse_file_info *fi) {
+	return (fi->fh & FH_STATS) ? -1 : (int)(fi->fh & UINT32_MAX);
+}
+
+static inline char *get_stats(const struct fuse_file_info *fi) {
+	return (fi->fh & FH_STATS) ? (char *)(uintptr_t)(fi->fh & ~FH_STATS) : NULL;
+}
+
+static inline bool is_synthetic(const struct Inode *inode) {
+	return inode->fd == -1;
+}
+
+static inline double get_unwatched_timeout(const double timeout) {
+	return timeout < FILESYSTEM_UNWATCHED_TIMEOUT ? timeout : FILESYSTEM_UNWATCHED_TIMEOUT;
+}
+
+static inline enum StatsClass get_class(const struct Inode *inode) {
+	return is_synthetic(inode) ? STATS_CLASS_FIXED : (enum StatsClass)inode->root;
+}
+
+static inline size_t hash_key(const dev_t dev, const ino_t ino, const bool mapped) {
+	const uint64_t hash = ((uint64_t)ino * 0x9E3779B97F4A7C15ull) ^ (uint64_t)dev ^ mapped;
+	return (size_t)(hash ^ (hash >> 32));
+}
+
+static bool table_resize(const size_t n_buckets) {
+	struct Inode **buckets = calloc(n_buckets, sizeof(*buckets));
+	if (!buckets) {
+		return false;
+	}
+
+	for (size_t i = 0; i < g_table.n_buckets; ++i) {
+		struct Inode *inode = g_table.buckets[i];
+		while (inode) {
+			struct Inode *next = inode->next;
+			const size_t idx = hash_key(inode->dev, inode->ino, inode->vpath) & (n_buckets - 1);
+			inode->next = buckets[idx];
+			buckets[idx] = inode;
+			inode = next;
+		}
+	}
+
+	free(g_table.buckets);
+	g_table.buckets = buckets;
+	g_table.n_buckets = n_buckets;
+
+	return true;
+}
+
+static bool table_init() {
+	if (!table_resize(INODE_TABLE_MIN_BUCKETS)) {
+		return false;
+	}
+
+	const char **names = path_get_root_names();
+	size_t n_links = 0;
+	for (const char *name = *names; name; name = *(++names)) {
+		char vpath[NAME_MAX + 2];
+		snprintf(vpath, sizeof(vpath), "/%s", name);
+
+		const char *link = path_get_link(vpath, false);
+		if (!link) {
+			continue;
+		}
+
+		g_links[n_links] = (struct Inode){ .vpath = strdup(vpath), .link = link, .nlookup = 1, .ino = FUSE_ROOT_ID + n_links + 1, .fd = -1 };
+		if (!g_links[n_links++].vpath) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Returns the inode for an freshly opened O_PATH descriptor, taking ownership of fd and vpath.
+static struct Inode *table_get(const int fd, const struct stat *st, char *vpath, const enum PathRoot root) {
+	const bool mapped = vpath;
+
+	pthread_mutex_lock(&g_table.lock);
+
+	size_t idx = hash_key(st->st_dev, st->st_ino, mapped) & (g_table.n_buckets - 1);
+	for (struct Inode *inode = g_table.buckets[idx]; inode; inode = inode->next) {
+		if (inode->dev == st->st_dev && inode->ino == st->st_ino && (bool)inode->vpath == mapped) {
+			++inode->nlookup;
+			pthread_mutex_unlock(&g_table.lock);
+
+			close(fd);
+			free(vpath);
+
+			return inode;
+		}
+	}
+
+	if (g_table.n_inodes >= g_table.n_buckets) {
+		if (table_resize(g_table.n_buckets * 2)) {
+			idx = hash_key(st->st_dev, st->st_ino, mapped) & (g_table.n_buckets - 1);
+		}
+	}
+
+	struct Inode *inode = malloc(sizeof(*inode));
+	if (inode) {
+		*inode = (struct Inode){ .next = g_table.buckets[idx], .vpath = vpath, .nlookup = 1, .dev = st->st_dev, .ino = st->st_ino, .root = root, .fd = fd, .wd = -1 };
+		g_table.buckets[idx] = inode;
+		++g_table.n_inodes;
+	}
+
+	pthread_mutex_unlock(&g_table.lock);
+
+	if (!inode) {
+		close(fd);
+		free(vpath);
+		return NULL;
+	}
+
+	// Nobody else can see the inode until the lookup is replied to.
+	if (S_ISDIR(st->st_mode)) {
+		inode->wd = watch_add(g_watcher, fd, "", st, NULL, get_ino(inode));
+	}
+
+	return inode;
+}
+
+static void table_forget(struct Inode *inode, const uint64_t nlookup) {
+	if (is_synthetic(inode)) {
+		return;
+	}
+
+	pthread_mutex_lock(&g_table.lock);
+
+	inode->nlookup -= nlookup;
+	if (inode->nlookup) {
+		pthread_mutex_unlock(&g_table.lock);
+		return;
+	}
+
+	struct Inode **prev = &g_table.buckets[hash_key(inode->dev, inode->ino, inode->vpath) & (g_table.n_buckets - 1)];
+	while (*prev != inode) {
+		prev = &(*prev)->next;
+	}
+
+	*prev = inode->next;
+	--g_table.n_inodes;
+
+	pthread_mutex_unlock(&g_table.lock);
+
+	watch_remove(g_watcher, inode->wd, get_ino(inode));
+	close(inode->fd);
+	free((void *)inode->vpath);
+	free(inode);
+}
+
+static int child_resolve(const struct Inode *parent, const char *name, struct Child *child) {
+	child->dirfd = parent->fd;
+	child->path = name;
+	child->mapped = false;
+	child->fixed = false;
+	child->root = parent->root;
+
+	if (parent->link) {
+		return ENOTDIR;
+	}
+
+	if (!parent->vpath) {
+		return 0;
+	}
+
+	const int len = snprintf(child->vpath, sizeof(child->vpath), "%s/%s", path_is_root(parent->vpath) ? "" : parent->vpath, name);
+	if (len < 0 || (size_t)len >= sizeof(child->vpath)) {
+		return ENAMETOOLONG;
+	}
+
+	const ssize_t real_len = path_get_real_at(child->vpath, child->real, sizeof(child->real), &child->dirfd);
+	if (real_len < 0) {
+		log_path(__func__, child->vpath, NULL, PATH_ROOT_NONE);
+		return (int)-real_len;
+	}
+
+	child->path = child->real;
+	child->root = path_get_root_at(child->dirfd);
+	log_path(__func__, child->vpath, child->real, child->root);
+	child->mapped = true;
+	child->fixed = path_is_fixed(child->vpath) || path_is_dir_link(child->vpath);
+
+	return 0;
+}
+
+static void fill_synthetic_attr(const struct Inode *inode, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+
+	if (inode == &g_root) {
+		st->st_ino = FUSE_ROOT_ID;
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = PATH_ROOT_N_SYMLINK;
+	} else if (inode == &g_stats) {
+		st->st_ino = inode->ino;
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+	} else {
+		st->st_ino = inode->ino;
+		st->st_mode = S_IFLNK | 0777;
+		st->st_nlink = 1;
+		st->st_size = strlen(inode->link);
+	}
+}
+
+// A reload may point the same path elsewhere, so the inode is only reused while the target is the same.
+static struct Inode *dir_link_get(const char *vpath, const char *target) {
+	pthread_mutex_lock(&g_table.lock);
+
+	struct Inode *inode = g_dir_links;
+	while (inode && !(streq(inode->vpath, vpath) && streq(inode->link, target))) {
+		inode = inode->next;
+	}
+
+	if (!inode && (inode = calloc(1, sizeof(*inode)))) {
+		*inode = (struct Inode){ .next = g_dir_links, .vpath = strdup(vpath), .link = strdup(target), .nlookup = 1, .ino = g_next_dir_link, .fd = -1, .wd = -1 };
+		if (inode->vpath && inode->link) {
+			g_dir_links = inode;
+			++g_next_dir_link;
+		} else {
+			free((void *)inode->vpath);
+			free((void *)inode->link);
+			free(inode);
+			inode = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&g_table.lock);
+
+	return inode;
+}
+
+static int do_lookup(struct Inode *parent, const char *name, struct fuse_entry_param *e) {
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = g_options.attr_timeout;
+	e->entry_timeout = g_options.entry_timeout;
+
+	if (parent == &g_root) {
+		for (size_t i = 0; i < PATH_ROOT_N_SYMLINK; ++i) {
+			if (streq(g_links[i].vpath + 1, name)) {
+				fill_synthetic_attr(&g_links[i], &e->attr);
+				e->ino = get_ino(&g_links[i]);
+				return 0;
+			}
+		}
+
+		if (streq(name, PATH_STATS_NAME)) {
+			fill_synthetic_attr(&g_stats, &e->attr);
+			e->ino = get_ino(&g_stats);
+			return 0;
+		}
+	}
+
+	struct Child child;
+	int err = child_resolve(parent, name, &child);
+	if (err) {
+		return err;
+	}
+
+	char dir_link[PATH_MAX];
+	const ssize_t dir_link_len = child.mapped ? path_get_dir_link(child.vpath, dir_link, sizeof(dir_link)) : 0;
+	if (dir_link_len < 0) {
+		return (int)-dir_link_len;
+	} else if (dir_link_len > 0) {
+		struct Inode *inode = dir_link_get(child.vpath, dir_link);
+		if (!inode) {
+			return ENOMEM;
+		}
+
+		fill_synthetic_attr(inode, &e->attr);
+		e->ino = get_ino(inode);
+		return 0;
+	}
+
+	const int fd = openat(child.dirfd, child.path, O_PATH | O_NOFOLLOW);
+	if (fd == -1) {
+		return errno;
+	}
+
+	if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+		err = errno;
+		close(fd);
+		return err;
+	}
+
+	char *vpath = NULL;
+	if (child.mapped && path_has_redirects(child.vpath)) {
+		vpath = strdup(child.vpath);
+		if (!vpath) {
+			close(fd);
+			return ENOMEM;
+		}
+	}
+
+	struct Inode *inode = table_get(fd, &e->attr, vpath, child.root);
+	if (!inode) {
+		return ENOMEM;
+	}
+
+	inode->durability = child.mapped ? path_get_durability(child.vpath) : parent->durability;
+
+	// Nothing would tell the kernel about changes made below, it has to ask again soon.
+	if ((!is_synthetic(parent) && parent->wd == -1) || (S_ISDIR(e->attr.st_mode) && inode->wd == -1)) {
+		__atomic_store_n(&inode->unwatched, true, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_load_n(&inode->unwatched, __ATOMIC_RELAXED)) {
+		e->attr_timeout = get_unwatched_timeout(g_options.attr_timeout);
+		e->entry_timeout = get_unwatched_timeout(g_options.entry_timeout);
+	}
+
+	e->ino = get_ino(inode);
+
+	return 0;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	STATS_SCOPE(STATS_OP_LOOKUP)
+
+	struct fuse_entry_param e;
+	const int err = do_lookup(get_inode(parent), name, &e);
+	STATS_CLASS(get_class(get_inode(err ? parent : e.ino)));
+	if (err == ENOENT && g_options.negative_timeout > 0) {
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = g_options.negative_timeout;
+		fuse_reply_entry(req, &e);
+	} else if (err) {
+		fuse_reply_err(req, err);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+	STATS_SCOPE(STATS_OP_FORGET)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	table_forget(get_inode(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+	STATS_SCOPE(STATS_OP_FORGET)
+	STATS_CLASS(STATS_CLASS_OTHER);
+
+	for (size_t i = 0; i < count; ++i) {
+		table_forget(get_inode(forgets[i].ino), forgets[i].nlookup);
+	}
+
+	fuse_reply_none(req);
+}
+
+static void do_getattr(fuse_req_t req, fuse_ino_t ino) {
+	const struct Inode *inode = get_inode(ino);
+
+	struct stat st;
+	if (is_synthetic(inode)) {
+		fill_synthetic_attr(inode, &st);
+	} else if (fstatat(inode->fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	fuse_reply_attr(req, &st, __atomic_load_n(&inode->unwatched, __ATOMIC_RELAXED) ? get_unwatched_timeout(g_options.attr_timeout) : g_options.attr_timeout);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_GETATTR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	(void)fi;
+
+	do_getattr(req, ino);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int valid, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_SETATTR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+	if (is_synthetic(inode)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	PROC_FD_NAME(procname, inode->fd)
+
+	const int fd = fi ? get_fd(fi) : -1;
+	int ret = 0;
+
+	if (valid & FUSE_SET_ATTR_MODE) {
+		ret = fd != -1 ? fchmod(fd, attr->st_mode) : chmod(procname, attr->st_mode);
+	}
+
+	if (!ret && (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+		const uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1;
+		const gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1;
+		ret = fchownat(inode->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	}
+
+	if (!ret && (valid & FUSE_SET_ATTR_SIZE)) {
+		ret = fd != -1 ? ftruncate(fd, attr->st_size) : truncate(procname, attr->st_size);
+	}
+
+	if (!ret && (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+		struct timespec tv[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_nsec = UTIME_OMIT } };
+
+		if (valid & FUSE_SET_ATTR_ATIME_NOW) {
+			tv[0].tv_nsec = UTIME_NOW;
+		} else if (valid & FUSE_SET_ATTR_ATIME) {
+			tv[0] = attr->st_atim;
+		}
+
+		if (valid & FUSE_SET_ATTR_MTIME_NOW) {
+			tv[1].tv_nsec = UTIME_NOW;
+		} else if (valid & FUSE_SET_ATTR_MTIME) {
+			tv[1] = attr->st_mtim;
+		}
+
+		ret = fd != -1 ? futimens(fd, tv) : utimensat(AT_FDCWD, procname, tv, 0);
+	}
+
+	if (ret == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	do_getattr(req, ino);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+	STATS_SCOPE(STATS_OP_READLINK)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+	if (inode->link) {
+		fuse_reply_readlink(req, inode->link);
+		return;
+	}
+
+	char buf[PATH_MAX + 1];
+	const ssize_t ret = readlinkat(inode->fd, "", buf, sizeof(buf));
+	if (ret == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	if (ret == sizeof(buf)) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	buf[ret] = '\0';
+
+	fuse_reply_readlink(req, buf);
+}
+
+static void make_node(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev, const char *link) {
+	STATS_SCOPE(link ? STATS_OP_SYMLINK : S_ISDIR(mode) ? STATS_OP_MKDIR : STATS_OP_MKNOD)
+
+	struct Inode *inode = get_inode(parent);
+
+	struct Child child;
+	int err = child_resolve(inode, name, &child);
+	if (err) {
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	STATS_CLASS(child.root);
+
+	int ret;
+	if (child.fixed) {
+		ret = -1;
+		errno = EACCES;
+	} else if (S_ISDIR(mode)) {
+		ret = mkdirat(child.dirfd, child.path, mode);
+	} else if (S_ISLNK(mode)) {
+		ret = symlinkat(link, child.dirfd, child.path);
+	} else {
+		ret = mknodat(child.dirfd, child.path, mode, rdev);
+	}
+
+	err = ret == -1 ? errno : 0;
+	if (!err && child.mapped) {
+		dirindex_invalidate();
+	}
+
+	struct fuse_entry_param e;
+	if (!err) {
+		err = do_lookup(inode, name, &e);
+	}
+
+	if (err) {
+		fuse_reply_err(req, err);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+	make_node(req, parent, name, mode, rdev, NULL);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	make_node(req, parent, name, S_IFDIR | mode, 0, NULL);
+}
+
+static void ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+	char real_link[PATH_MAX];
+	const ssize_t len = path_get_real(link, real_link, sizeof(real_link));
+	if (len < 0) {
+		log_path(__func__, link, NULL, PATH_ROOT_NONE);
+		fuse_reply_err(req, (int)-len);
+		return;
+	}
+
+	log_path(__func__, link, real_link, path_get_root(real_link));
+
+	make_node(req, parent, name, S_IFLNK, 0, real_link);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+	STATS_SCOPE(STATS_OP_LINK)
+
+	struct Inode *inode = get_inode(ino);
+	if (is_synthetic(inode)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	struct Inode *parent = get_inode(newparent);
+
+	struct Child child;
+	int err = child_resolve(parent, newname, &child);
+	if (err) {
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	STATS_CLASS(child.root);
+
+	PROC_FD_NAME(procname, inode->fd)
+
+	if (child.fixed) {
+		err = EACCES;
+	} else if (linkat(AT_FDCWD, procname, child.dirfd, child.path, AT_SYMLINK_FOLLOW) == -1) {
+		err = errno;
+	} else if (child.mapped) {
+		dirindex_invalidate();
+	}
+
+	struct fuse_entry_param e;
+	if (!err) {
+		err = do_lookup(parent, newname, &e);
+	}
+
+	if (err) {
+		fuse_reply_err(req, err);
+	} else {
+		fuse_reply_entry(req, &e);
+	}
+}
+
+static void remove_node(fuse_req_t req, fuse_ino_t parent, const char *name, const int flags) {
+	STATS_SCOPE((flags & AT_REMOVEDIR) ? STATS_OP_RMDIR : STATS_OP_UNLINK)
+
+	struct Child child;
+	int err = child_resolve(get_inode(parent), name, &child);
+	if (err) {
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	STATS_CLASS(child.root);
+
+	if (child.fixed) {
+		err = EACCES;
+	} else if (unlinkat(child.dirfd, child.path, flags) == -1) {
+		err = errno;
+	} else if (child.mapped) {
+		dirindex_invalidate();
+	}
+
+	fuse_reply_err(req, err);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	remove_node(req, parent, name, 0);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	remove_node(req, parent, name, AT_REMOVEDIR);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags) {
+	STATS_SCOPE(STATS_OP_RENAME)
+
+	struct Child old;
+	int err = child_resolve(get_inode(parent), name, &old);
+	if (err) {
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	STATS_CLASS(old.root);
+
+	struct Child new;
+	err = child_resolve(get_inode(newparent), newname, &new);
+	if (err) {
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	if (old.fixed || new.fixed) {
+		err = EACCES;
+	} else if (renameat2(old.dirfd, old.path, new.dirfd, new.path, flags) == -1) {
+		err = errno == EXDEV ? move_across(old.dirfd, old.path, new.dirfd, new.path, flags) : errno;
+	}
+
+	if (!err && (old.mapped || new.mapped)) {
+		dirindex_invalidate();
+	}
+
+	fuse_reply_err(req, err);
+}
+
+// Registers the file with the kernel, so that reads, writes and mmap bypass the daemon.
+// All the handles of an inode have to share the same backing file, which is thus opened read-write if possible.
+// Handles it can't serve use direct I/O instead, the kernel doesn't mix passthrough and cached handles.
+static void backing_open(fuse_req_t req, struct Inode *inode, struct fuse_file_info *fi) {
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (!__atomic_load_n(&g_passthrough, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	struct stat st;
+	if (fstat(get_fd(fi), &st) == -1 || !S_ISREG(st.st_mode)) {
+		return;
+	}
+
+	const int mode = fi->flags & O_ACCMODE;
+
+	pthread_mutex_lock(&g_table.lock);
+
+	if (!inode->backing_id) {
+		PROC_FD_NAME(procname, get_fd(fi))
+
+		const int fd = open(procname, O_RDWR);
+		const int backing_id = fuse_passthrough_open(req, fd != -1 ? fd : get_fd(fi));
+		const int err = errno;
+
+		if (fd != -1) {
+			close(fd);
+		}
+
+		if (backing_id <= 0) {
+			pthread_mutex_unlock(&g_table.lock);
+
+			// Most likely the daemon lacks CAP_SYS_ADMIN, no point in trying again.
+			if (err == EPERM) {
+				__atomic_store_n(&g_passthrough, false, __ATOMIC_RELAXED);
+				printf("The kernel refused to register the backing file, falling back to regular I/O.\n");
+			}
+
+			return;
+		}
+
+		inode->backing_id = backing_id;
+		inode->backing_mode = fd != -1 ? O_RDWR : mode;
+	}
+
+	if (inode->backing_mode != O_RDWR && inode->backing_mode != mode) {
+		pthread_mutex_unlock(&g_table.lock);
+		fi->direct_io = 1;
+		return;
+	}
+
+	++inode->n_backing;
+	fi->backing_id = inode->backing_id;
+	fi->fh |= FH_PASSTHROUGH;
+
+	pthread_mutex_unlock(&g_table.lock);
+#else
+	(void)req;
+	(void)inode;
+	(void)fi;
+#endif
+}
+
+static void backing_release(fuse_req_t req, struct Inode *inode) {
+#ifdef FUSE_CAP_PASSTHROUGH
+	pthread_mutex_lock(&g_table.lock);
+
+	if (!--inode->n_backing) {
+		fuse_passthrough_close(req, inode->backing_id);
+		inode->backing_id = 0;
+	}
+
+	pthread_mutex_unlock(&g_table.lock);
+#else
+	(void)req;
+	(void)inode;
+#endif
+}
+
+// Negative entries are dropped as well, since those are keyed by name.
+static void ll_invalidate(const char *vpath, uint64_t ino, const char *name, uint32_t mask) {
+	if (mask & IN_Q_OVERFLOW) {
+		if (!vpath) {
+			dirindex_invalidate();
+		} else {
+			fuse_lowlevel_notify_inval_inode(g_session, ino, 0, 0);
+		}
+
+		return;
+	}
+
+	fuse_lowlevel_notify_inval_entry(g_session, ino, name, strlen(name));
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+	(void)userdata;
+
+	// Watches go away with the inodes the kernel forgets.
+	g_watcher = watch_new(ll_invalidate, 0);
+	dirindex_init();
+	log_start();
+	stats_start();
+	prefetch_start();
+	durability_start(g_options.group_commit);
+	// Inodes that were looked up keep their backing files, only new lookups see the reloaded specs.
+	filesystem_reload_start(NULL);
+
+	if (g_options.io_uring) {
+		g_uring = uring_init(g_options.io_uring_depth);
+	}
+
+	conn->want |= conn->capable & (FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	if (g_options.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		g_writeback = true;
+	}
+
+	filesystem_conn_init(conn);
+
+	if (!g_options.passthrough) {
+		return;
+	}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+		// The backing files live on regular filesystems.
+		conn->max_backing_stack_depth = 1;
+		g_passthrough = true;
+	} else {
+		printf("The kernel doesn't support passthrough, falling back to regular I/O.\n");
+	}
+#else
+	(void)conn;
+	printf("This build doesn't support passthrough, falling back to regular I/O.\n");
+#endif
+}
+
+// The contents are generated once per open, so that reads at different offsets see the same snapshot.
+static void open_stats(fuse_req_t req, struct fuse_file_info *fi) {
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	size_t len;
+	char *buf = stats_format(&len);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fi->fh = FH_STATS | (uintptr_t)buf;
+	fi->direct_io = 1;
+
+	fuse_reply_open(req, fi);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_OPEN)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+	if (inode == &g_stats) {
+		open_stats(req, fi);
+		return;
+	}
+
+	if (is_synthetic(inode)) {
+		fuse_reply_err(req, inode->link ? ELOOP : EISDIR);
+		return;
+	}
+
+	PROC_FD_NAME(procname, inode->fd)
+
+	const int flags = g_writeback ? filesystem_writeback_flags(fi->flags) : fi->flags;
+
+	int fd = open(procname, flags & ~O_NOFOLLOW);
+	// Files that can't be promoted bypass the page cache, partial pages would be read through a write-only handle.
+	if (fd == -1 && errno == EACCES && flags != fi->flags && (fi->flags & O_ACCMODE) == O_WRONLY) {
+		fd = open(procname, fi->flags & ~(O_NOFOLLOW | O_APPEND));
+		fi->direct_io = 1;
+	}
+
+	if (fd == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	fi->fh = fd;
+
+	prefetch_note_open(fd, fi->flags);
+
+	backing_open(req, get_inode(ino), fi);
+
+	fuse_reply_open(req, fi);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_CREATE)
+
+	struct Inode *inode = get_inode(parent);
+
+	struct Child child;
+	int err = child_resolve(inode, name, &child);
+	if (err) {
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	STATS_CLASS(child.root);
+
+	int fd = -1;
+	if (child.fixed) {
+		err = EACCES;
+	} else {
+		const int flags = g_writeback ? filesystem_writeback_flags(fi->flags) : fi->flags;
+		fd = openat(child.dirfd, child.path, (flags | O_CREAT) & ~O_NOFOLLOW, mode);
+		if (fd == -1) {
+			err = errno;
+		} else if (child.mapped) {
+			dirindex_invalidate();
+		}
+	}
+
+	struct fuse_entry_param e;
+	if (!err) {
+		err = do_lookup(inode, name, &e);
+	}
+
+	if (err) {
+		if (fd != -1) {
+			close(fd);
+		}
+
+		fuse_reply_err(req, err);
+		return;
+	}
+
+	fi->fh = fd;
+
+	backing_open(req, get_inode(e.ino), fi);
+
+	fuse_reply_create(req, &e, fi);
+}
+
+static void read_done(void *data, const int res) {
+	struct AsyncIo *io = data;
+
+	if (res < 0) {
+		fuse_reply_err(io->req, -res);
+	} else {
+		fuse_reply_buf(io->req, io->buf, (size_t)res);
+	}
+
+	free(io);
+}
+
+static void write_done(void *data, const int res) {
+	struct AsyncIo *io = data;
+
+	if (res < 0) {
+		fuse_reply_err(io->req, -res);
+	} else {
+		fuse_reply_write(io->req, (size_t)res);
+	}
+
+	free(io);
+}
+
+static void status_done(void *data, const int res) {
+	fuse_reply_err(data, res < 0 ? -res : 0);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_READ)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const char *stats = get_stats(fi);
+	if (stats) {
+		const size_t len = strlen(stats);
+		const size_t start = (size_t)off < len ? (size_t)off : len;
+		fuse_reply_buf(req, stats + start, len - start < size ? len - start : size);
+		return;
+	}
+
+	prefetch_note_read(get_fd(fi), off, size);
+
+	if (g_uring) {
+		struct AsyncIo *io = malloc(sizeof(*io) + size);
+		if (io) {
+			io->req = req;
+			if (uring_read(get_fd(fi), io->buf, size, off, read_done, io)) {
+				return;
+			}
+
+			free(io);
+		}
+	}
+
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = get_fd(fi);
+	buf.buf[0].pos = off;
+
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in, off_t off, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_WRITE)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	if (g_uring) {
+		const size_t size = fuse_buf_size(in);
+		struct AsyncIo *io = malloc(sizeof(*io) + size);
+		if (io) {
+			io->req = req;
+
+			// The request buffer is reused as soon as we return, so the data is copied out first.
+			struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+			mem.buf[0].mem = io->buf;
+
+			const ssize_t len = fuse_buf_copy(&mem, in, 0);
+			if (len < 0) {
+				write_done(io, (int)len);
+			} else if (!uring_write(get_fd(fi), io->buf, (size_t)len, off, write_done, io)) {
+				const ssize_t ret = pwrite(get_fd(fi), io->buf, (size_t)len, off);
+				write_done(io, ret < 0 ? -errno : (int)ret);
+			}
+
+			return;
+		}
+	}
+
+	struct fuse_bufvec out = FUSE_BUFVEC_INIT(fuse_buf_size(in));
+	out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	out.buf[0].fd = get_fd(fi);
+	out.buf[0].pos = off;
+
+	const ssize_t ret = fuse_buf_copy(&out, in, FUSE_BUF_SPLICE_NONBLOCK);
+	if (ret < 0) {
+		fuse_reply_err(req, (int)-ret);
+	} else {
+		fuse_reply_write(req, (size_t)ret);
+	}
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_FLUSH)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	(void)fi;
+
+	fuse_reply_err(req, 0);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_RELEASE)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	char *stats = get_stats(fi);
+	if (stats) {
+		free(stats);
+		fuse_reply_err(req, 0);
+		return;
+	}
+
+	if (fi->fh & FH_PASSTHROUGH) {
+		backing_release(req, get_inode(ino));
+	}
+
+	prefetch_note_close(get_fd(fi));
+	durability_release(get_fd(fi), fi->flags, get_inode(ino)->durability);
+
+	fuse_reply_err(req, close(get_fd(fi)) == 0 ? 0 : errno);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_FSYNC)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const int fd = get_fd(fi);
+	const enum PathDurability durability = get_inode(ino)->durability;
+	if (durability == PATH_DURABILITY_STRICT && g_uring && uring_fsync(fd, datasync, status_done, req)) {
+		return;
+	}
+
+	fuse_reply_err(req, durability_fsync(fd, datasync, durability));
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_OPENDIR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+	if (inode->link) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+
+	struct DirHandle *handle = calloc(1, sizeof(*handle));
+	if (!handle) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (inode->vpath) {
+		handle->index = dirindex_get(inode->vpath);
+		if (!handle->index) {
+			const int err = errno;
+			free(handle);
+			fuse_reply_err(req, err);
+			return;
+		}
+	} else {
+		const int fd = openat(inode->fd, ".", O_RDONLY | O_DIRECTORY);
+		if (fd == -1 || !(handle->dir = fdopendir(fd))) {
+			const int err = errno;
+
+			if (fd != -1) {
+				close(fd);
+			}
+
+			free(handle);
+			fuse_reply_err(req, err);
+			return;
+		}
+	}
+
+	fi->fh = (uint64_t)(uintptr_t)handle;
+
+	fuse_reply_open(req, fi);
+}
+
+// Adds an entry to the reply buffer, looking it up first in plus mode.
+// Returns the size of the entry, which is bigger than the available space if it doesn't fit.
+static size_t add_entry(fuse_req_t req, struct Inode *parent, char *buf, const size_t size, const char *name, const struct stat *st, const off_t off, const bool plus) {
+	if (!plus) {
+		return fuse_add_direntry(req, buf, size, name, st, off);
+	}
+
+	struct fuse_entry_param e;
+	if (streq(name, ".") || streq(name, "..") || do_lookup(parent, name, &e) != 0) {
+		memset(&e, 0, sizeof(e));
+		e.attr = *st;
+	}
+
+	const size_t len = fuse_add_direntry_plus(req, buf, size, name, &e, off);
+	if (len > size && e.ino) {
+		table_forget(get_inode(e.ino), 1);
+	}
+
+	return len;
+}
+
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi, const bool plus) {
+	struct Inode *inode = get_inode(ino);
+	struct DirHandle *handle = (struct DirHandle *)(uintptr_t)fi->fh;
+
+	char *buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	size_t used = 0;
+
+	if (handle->index) {
+		const struct DirIndex *index = handle->index;
+		for (size_t i = (size_t)off; i < index->n; ++i) {
+			const struct stat st = { .st_mode = DTTOIF(index->entries[i].type) };
+			const size_t len = add_entry(req, inode, buf + used, size - used, index->entries[i].name, &st, (off_t)i + 1, plus);
+			if (len > size - used) {
+				break;
+			}
+
+			used += len;
+		}
+
+		fuse_reply_buf(req, buf, used);
+		free(buf);
+		return;
+	}
+
+	if (off != handle->off) {
+		seekdir(handle->dir, off);
+		handle->ent = NULL;
+		handle->off = off;
+	}
+
+	int err = 0;
+
+	while (true) {
+		if (!handle->ent) {
+			errno = 0;
+			handle->ent = readdir(handle->dir);
+			if (!handle->ent) {
+				err = errno;
+				break;
+			}
+		}
+
+		const struct stat st = { .st_ino = handle->ent->d_ino, .st_mode = handle->ent->d_type << 12 };
+		const size_t len = add_entry(req, inode, buf + used, size - used, handle->ent->d_name, &st, handle->ent->d_off, plus);
+		if (len > size - used) {
+			break;
+		}
+
+		used += len;
+		handle->off = handle->ent->d_off;
+		handle->ent = NULL;
+	}
+
+	if (err && !used) {
+		fuse_reply_err(req, err);
+	} else {
+		fuse_reply_buf(req, buf, used);
+	}
+
+	free(buf);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_READDIR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	do_readdir(req, ino, size, off, fi, false);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_READDIRPLUS)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	do_readdir(req, ino, size, off, fi, true);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_RELEASEDIR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	struct DirHandle *handle = (struct DirHandle *)(uintptr_t)fi->fh;
+	if (handle->index) {
+		dirindex_put(handle->index);
+	}
+
+	if (handle->dir) {
+		closedir(handle->dir);
+	}
+
+	free(handle);
+
+	fuse_reply_err(req, 0);
+}
+
+static void ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_FSYNCDIR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct DirHandle *handle = (const struct DirHandle *)(uintptr_t)fi->fh;
+	if (!handle->dir) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+
+	fuse_reply_err(req, durability_fsync(dirfd(handle->dir), datasync, get_inode(ino)->durability));
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	STATS_SCOPE(STATS_OP_STATFS)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+
+	struct statvfs buf = { 0 };
+	if (!is_synthetic(inode) && fstatvfs(inode->fd, &buf) == -1) {
+		fuse_reply_err(req, errno);
+		return;
+	}
+
+	fuse_reply_statfs(req, &buf);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+	STATS_SCOPE(STATS_OP_ACCESS)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+	if (is_synthetic(inode)) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+
+	PROC_FD_NAME(procname, inode->fd)
+
+	fuse_reply_err(req, access(procname, mask) == 0 ? 0 : errno);
+}
+
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags) {
+	STATS_SCOPE(STATS_OP_SETXATTR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+	if (inode == &g_stats) {
+		fuse_reply_err(req, filesystem_log_setxattr(name, value, size));
+		return;
+	} else if (is_synthetic(inode)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	PROC_FD_NAME(procname, inode->fd)
+
+	fuse_reply_err(req, setxattr(procname, name, value, size, flags) == 0 ? 0 : errno);
+}
+
+static void ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+	STATS_SCOPE(STATS_OP_REMOVEXATTR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+	if (is_synthetic(inode)) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+
+	PROC_FD_NAME(procname, inode->fd)
+
+	fuse_reply_err(req, removexattr(procname, name) == 0 ? 0 : errno);
+}
+
+static void reply_xattr(fuse_req_t req, const ssize_t ret, const char *value, const size_t size) {
+	if (ret < 0) {
+		fuse_reply_err(req, errno);
+	} else if (size) {
+		fuse_reply_buf(req, value, (size_t)ret);
+	} else {
+		fuse_reply_xattr(req, (size_t)ret);
+	}
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+	STATS_SCOPE(STATS_OP_GETXATTR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+	if (is_synthetic(inode) && inode != &g_stats) {
+		reply_xattr(req, 0, NULL, size);
+		return;
+	}
+
+	char *value = size ? malloc(size) : NULL;
+	if (size && !value) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (inode == &g_stats) {
+		const ssize_t ret = filesystem_log_getxattr(name, value, size);
+		if (ret < 0) {
+			fuse_reply_err(req, (int)-ret);
+		} else {
+			reply_xattr(req, ret, value, size);
+		}
+
+		free(value);
+		return;
+	}
+
+	PROC_FD_NAME(procname, inode->fd)
+
+	reply_xattr(req, getxattr(procname, name, value, size), value, size);
+
+	free(value);
+}
+
+static void ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+	STATS_SCOPE(STATS_OP_LISTXATTR)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const struct Inode *inode = get_inode(ino);
+	if (is_synthetic(inode)) {
+		reply_xattr(req, 0, NULL, size);
+		return;
+	}
+
+	char *list = size ? malloc(size) : NULL;
+	if (size && !list) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	PROC_FD_NAME(procname, inode->fd)
+
+	reply_xattr(req, listxattr(procname, list, size), list, size);
+
+	free(list);
+}
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_FALLOCATE)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	if (g_uring && uring_fallocate(get_fd(fi), mode, offset, length, status_done, req)) {
+		return;
+	}
+
+	fuse_reply_err(req, fallocate(get_fd(fi), mode, offset, length) == 0 ? 0 : errno);
+}
+
+static void ll_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info *fi_in,
+							   fuse_ino_t ino_out, off_t off_out, struct fuse_file_info *fi_out,
+							   size_t len, int flags) {
+	STATS_SCOPE(STATS_OP_COPY_FILE_RANGE)
+	STATS_CLASS(get_class(get_inode(ino_out)));
+
+	(void)ino_in;
+	(void)ino_out;
+
+	const ssize_t ret = filesystem_copy_range(get_fd(fi_in), &off_in, get_fd(fi_out), &off_out, len, flags);
+	if (ret < 0) {
+		fuse_reply_err(req, errno);
+	} else {
+		fuse_reply_write(req, (size_t)ret);
+	}
+}
+
+static void ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi) {
+	STATS_SCOPE(STATS_OP_LSEEK)
+	STATS_CLASS(get_class(get_inode(ino)));
+
+	const off_t ret = lseek(get_fd(fi), off, whence);
+	if (ret < 0) {
+		fuse_reply_err(req, errno);
+	} else {
+		fuse_reply_lseek(req, ret);
+	}
+}
+
+static const struct fuse_lowlevel_ops ll_operations = {
+	.init = ll_init,
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr = ll_getattr,
+	.setattr = ll_setattr,
+	.readlink = ll_readlink,
+	.mknod = ll_mknod,
+	.mkdir = ll_mkdir,
+	.unlink = ll_unlink,
+	.rmdir = ll_rmdir,
+	.symlink = ll_symlink,
+	.rename = ll_rename,
+	.link = ll_link,
+	.open = ll_open,
+	.create = ll_create,
+	.read = ll_read,
+	.write_buf = ll_write_buf,
+	.flush = ll_flush,
+	.release = ll_release,
+	.fsync = ll_fsync,
+	.opendir = ll_opendir,
+	.readdir = ll_readdir,
+	.readdirplus = ll_readdirplus,
+	.releasedir = ll_releasedir,
+	.fsyncdir = ll_fsyncdir,
+	.statfs = ll_statfs,
+	.access = ll_access,
+	.setxattr = ll_setxattr,
+	.getxattr = ll_getxattr,
+	.listxattr = ll_listxattr,
+	.removexattr = ll_removexattr,
+	.fallocate = ll_fallocate,
+	.copy_file_range = ll_copy_file_range,
+	.lseek = ll_lseek
+};
+
+// Requests a loop thread handles before submitting what they queued, if the queue doesn't run dry first.
+#define LOOP_BATCH (32)
+// How often a loop thread with nothing to do checks whether the session ended.
+#define LOOP_POLL_MS (1000)
+
+// Drains the nonblocking device and submits the io_uring operations of everything it read at once, before it
+// waits for more.
+static void *loop_thread(void *arg) {
+	struct fuse_session *se = arg;
+
+	struct fuse_buf buf = { 0 };
+	struct pollfd pfd = { .fd = fuse_session_fd(se), .events = POLLIN };
+
+	while (!fuse_session_exited(se)) {
+		uring_flush();
+
+		if (poll(&pfd, 1, LOOP_POLL_MS) < 0 && errno != EINTR) {
+			fuse_session_exit(se);
+			break;
+		}
+
+		for (unsigned int i = 0; i < LOOP_BATCH; ++i) {
+			const int res = fuse_session_receive_buf(se, &buf);
+			if (res == -EAGAIN || res == -EINTR) {
+				break;
+			}
+
+			if (res <= 0) {
+				fuse_session_exit(se);
+				goto END;
+			}
+
+			fuse_session_process_buf(se, &buf);
+		}
+	}
+END:
+	uring_flush();
+	free(buf.mem);
+
+	return NULL;
+}
+
+// Used instead of libfuse's loops with io_uring, which submit nothing until a thread is back to reading.
+static int loop_uring(struct fuse_session *se, const unsigned int n_threads) {
+	const int fd = fuse_session_fd(se);
+	const int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		printf("Failed to make the FUSE device nonblocking: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pthread_t *threads = calloc(n_threads, sizeof(*threads));
+	if (!threads) {
+		return -1;
+	}
+
+	// The signal handlers run on this thread.
+	sigset_t all;
+	sigset_t old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	unsigned int n = 0;
+	while (n < n_threads && pthread_create(&threads[n], NULL, loop_thread, se) == 0) {
+		++n;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!n) {
+		printf("Failed to start the FUSE threads!\n");
+		free(threads);
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < n; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+
+	return 0;
+}
+
+int filesystem_ll_exec(struct fuse_args *args) {
+	struct fuse_cmdline_opts opts;
+	if (fuse_parse_cmdline(args, &opts) != 0) {
+		return 1;
+	}
+
+	int ret = 1;
+
+	if (opts.show_help) {
+		printf("usage: %s [options] <mountpoint>\n\n", args->argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+		goto FREE_OPTS;
+	}
+
+	if (opts.show_version) {
+		printf("FUSE library version %s\n", fuse_pkgversion());
+		fuse_lowlevel_version();
+		ret = 0;
+		goto FREE_OPTS;
+	}
+
+	if (!opts.mountpoint) {
+		printf("Please specify the mount point.\n");
+		goto FREE_OPTS;
+	}
+
+	if (!table_init()) {
+		goto FREE_OPTS;
+	}
+
+	struct fuse_session *se = fuse_session_new(args, &ll_operations, sizeof(ll_operations), NULL);
+	if (!se) {
+		goto FREE_OPTS;
+	}
+
+	g_session = se;
+
+	if (fuse_set_signal_handlers(se) != 0) {
+		goto DESTROY_SESSION;
+	}
+
+	if (fuse_session_mount(se, opts.mountpoint) != 0) {
+		goto REMOVE_HANDLERS;
+	}
+
+	fuse_daemonize(opts.foreground);
+
+	if (g_options.io_uring) {
+		const long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		ret = loop_uring(se, opts.singlethread || n_cpus < 1 ? 1 : (unsigned int)n_cpus);
+	} else if (opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config config = { .clone_fd = opts.clone_fd, .max_idle_threads = opts.max_idle_threads };
+		ret = fuse_session_loop_mt(se, &config);
+	}
+
+	// The completion threads reply through the session.
+	uring_stop();
+
+	fuse_session_unmount(se);
+REMOVE_HANDLERS:
+	fuse_remove_signal_handlers(se);
+DESTROY_SESSION:
+	fuse_session_destroy(se);
+FREE_OPTS:
+	free(opts.mountpoint);
+
+	return ret ? 1 : 0;
+}
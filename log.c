@@ -0,0 +1,422 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "log.h"
+
+#include "str.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+// Per thread, a full ring drops new records rather than blocking the handler.
+#define RING_SIZE (64 * 1024)
+#define MAX_MESSAGE (1024)
+#define NO_PATH (UINT16_MAX)
+
+#define ALL_OPS ((UINT64_C(1) << STATS_N_OPS) - 1)
+#define ALL_ROOTS ((1u << PATH_ROOT_INSTALL) | (1u << PATH_ROOT_DATA) | (1u << PATH_ROOT_RUN))
+
+enum RecordKind {
+	KIND_PATH,
+	KIND_MESSAGE
+};
+
+// Followed by the path and the real path (or the message), without terminators.
+struct Record {
+	uint64_t time_ns;
+	const char *func;
+	uint32_t size;
+	uint16_t path_len;
+	uint16_t real_len;
+	uint8_t level;
+	uint8_t op;
+	uint8_t root;
+	uint8_t kind;
+};
+
+// Single producer, single consumer: head is only advanced by the thread that owns the ring, tail by the logging
+// thread. Rings are never freed, when their thread exits they are handed to the next one with whatever is left.
+struct Ring {
+	struct Ring *next;
+	struct Ring *next_free;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;
+	// Only touched by the logging thread.
+	uint64_t reported;
+	char data[RING_SIZE];
+};
+
+static const char *g_level_names[LOG_N_LEVELS] = {
+	[LOG_LEVEL_ERROR] = "error",
+	[LOG_LEVEL_WARN] = "warn",
+	[LOG_LEVEL_INFO] = "info",
+	[LOG_LEVEL_DEBUG] = "debug"
+};
+
+static const char *g_root_names[] = {
+	[PATH_ROOT_NONE] = NULL,
+	[PATH_ROOT_INSTALL] = "install",
+	[PATH_ROOT_DATA] = "data",
+	[PATH_ROOT_RUN] = "run"
+};
+
+struct LogFilter g_log_filter = { .level = LOG_LEVEL_WARN, .ops = ALL_OPS, .roots = ALL_ROOTS };
+
+static struct {
+	struct Ring *rings;
+	struct Ring *free;
+	pthread_key_t key;
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	pthread_t thread;
+	bool running;
+	bool stop;
+} g_log = { .once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct Ring *t_ring;
+
+static void ring_release(void *arg) {
+	struct Ring *ring = arg;
+
+	pthread_mutex_lock(&g_log.lock);
+	ring->next_free = g_log.free;
+	g_log.free = ring;
+	pthread_mutex_unlock(&g_log.lock);
+}
+
+static void key_init() {
+	pthread_key_create(&g_log.key, ring_release);
+}
+
+static struct Ring *ring_get() {
+	if (t_ring) {
+		return t_ring;
+	}
+
+	pthread_once(&g_log.once, key_init);
+
+	pthread_mutex_lock(&g_log.lock);
+
+	struct Ring *ring = g_log.free;
+	if (ring) {
+		g_log.free = ring->next_free;
+	} else if ((ring = calloc(1, sizeof(*ring)))) {
+		ring->next = g_log.rings;
+		__atomic_store_n(&g_log.rings, ring, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&g_log.lock);
+
+	if (ring) {
+		pthread_setspecific(g_log.key, ring);
+		t_ring = ring;
+	}
+
+	return ring;
+}
+
+static void ring_write(struct Ring *ring, const uint64_t pos, const void *src, const size_t len) {
+	const size_t off = pos & (RING_SIZE - 1);
+	const size_t first = len < RING_SIZE - off ? len : RING_SIZE - off;
+
+	memcpy(ring->data + off, src, first);
+	memcpy(ring->data, (const char *)src + first, len - first);
+}
+
+static void ring_read(const struct Ring *ring, const uint64_t pos, void *dst, const size_t len) {
+	const size_t off = pos & (RING_SIZE - 1);
+	const size_t first = len < RING_SIZE - off ? len : RING_SIZE - off;
+
+	memcpy(dst, ring->data + off, first);
+	memcpy((char *)dst + first, ring->data, len - first);
+}
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void append(struct Record *record, const char *path, const char *real_path) {
+	struct Ring *ring = ring_get();
+	if (!ring) {
+		return;
+	}
+
+	record->time_ns = now_ns();
+	record->op = (uint8_t)stats_current_op();
+	record->size = (uint32_t)(sizeof(*record) + record->path_len + (record->real_len == NO_PATH ? 0 : record->real_len));
+
+	const uint64_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) + record->size > RING_SIZE) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ring_write(ring, head, record, sizeof(*record));
+	ring_write(ring, head + sizeof(*record), path, record->path_len);
+	if (record->real_len != NO_PATH) {
+		ring_write(ring, head + sizeof(*record) + record->path_len, real_path, record->real_len);
+	}
+
+	__atomic_store_n(&ring->head, head + record->size, __ATOMIC_RELEASE);
+}
+
+static uint16_t clamp_len(const char *str) {
+	const size_t len = strlen(str);
+	return len < PATH_MAX ? (uint16_t)len : PATH_MAX;
+}
+
+void log_path_record(const char *func, const char *path, const char *real_path, const enum PathRoot root) {
+	struct Record record = {
+		.func = func,
+		.path_len = clamp_len(path),
+		.real_len = real_path ? clamp_len(real_path) : NO_PATH,
+		.level = LOG_LEVEL_DEBUG,
+		.root = (uint8_t)root,
+		.kind = KIND_PATH
+	};
+
+	append(&record, path, real_path);
+}
+
+// Messages are rare (errors and warnings), unlike paths they are formatted right away.
+void log_message_record(const enum LogLevel level, const char *format, ...) {
+	char buf[MAX_MESSAGE];
+
+	va_list args;
+	va_start(args, format);
+	const int len = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	if (len < 0) {
+		return;
+	}
+
+	struct Record record = {
+		.path_len = (size_t)len < sizeof(buf) ? (uint16_t)len : sizeof(buf) - 1,
+		.real_len = NO_PATH,
+		.level = (uint8_t)level,
+		.root = PATH_ROOT_NONE,
+		.kind = KIND_MESSAGE
+	};
+
+	append(&record, buf, NULL);
+}
+
+static void print_record(const struct Record *record, const char *path, const char *real_path) {
+	const time_t sec = (time_t)(record->time_ns / 1000000000);
+	struct tm tm;
+	localtime_r(&sec, &tm);
+
+	printf("%02d:%02d:%02d.%06u %-5s ", tm.tm_hour, tm.tm_min, tm.tm_sec,
+		   (unsigned int)(record->time_ns % 1000000000 / 1000), g_level_names[record->level]);
+
+	if (record->op < STATS_N_OPS) {
+		printf("%s ", stats_op_name(record->op));
+	}
+
+	if (record->kind == KIND_MESSAGE) {
+		printf("%.*s\n", (int)record->path_len, path);
+	} else if (record->real_len == NO_PATH) {
+		printf("[%s] %.*s -> (null)\n", record->func, (int)record->path_len, path);
+	} else {
+		printf("[%s] %.*s -> %.*s (%s)\n", record->func, (int)record->path_len, path, (int)record->real_len, real_path,
+			   g_root_names[record->root] ? g_root_names[record->root] : "fixed");
+	}
+}
+
+// Formats everything that is queued, oldest record first across all the rings. Returns false if there was nothing.
+static bool drain() {
+	static char path[PATH_MAX];
+	static char real_path[PATH_MAX];
+
+	bool any = false;
+
+	for (;;) {
+		struct Ring *oldest = NULL;
+		struct Record record;
+
+		for (struct Ring *ring = __atomic_load_n(&g_log.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+			if (ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+
+			struct Record next;
+			ring_read(ring, ring->tail, &next, sizeof(next));
+			if (!oldest || next.time_ns < record.time_ns) {
+				oldest = ring;
+				record = next;
+			}
+		}
+
+		if (!oldest) {
+			break;
+		}
+
+		ring_read(oldest, oldest->tail + sizeof(record), path, record.path_len);
+		if (record.real_len != NO_PATH) {
+			ring_read(oldest, oldest->tail + sizeof(record) + record.path_len, real_path, record.real_len);
+		}
+
+		__atomic_store_n(&oldest->tail, oldest->tail + record.size, __ATOMIC_RELEASE);
+
+		print_record(&record, path, real_path);
+		any = true;
+	}
+
+	for (struct Ring *ring = __atomic_load_n(&g_log.rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		const uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			printf("[%s] %lu records dropped, the logging thread can't keep up\n", __func__, (unsigned long)(dropped - ring->reported));
+			ring->reported = dropped;
+			any = true;
+		}
+	}
+
+	if (any) {
+		fflush(stdout);
+	}
+
+	return any;
+}
+
+static void *log_thread(void *arg) {
+	(void)arg;
+
+	const struct timespec idle = { .tv_nsec = 10 * 1000 * 1000 };
+
+	while (!__atomic_load_n(&g_log.stop, __ATOMIC_RELAXED)) {
+		if (!drain()) {
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+void log_start() {
+	if (g_log.running) {
+		return;
+	}
+
+	if (pthread_create(&g_log.thread, NULL, log_thread, NULL) != 0) {
+		printf("Failed to start the logging thread!\n");
+		return;
+	}
+
+	g_log.running = true;
+}
+
+void log_stop() {
+	if (g_log.running) {
+		__atomic_store_n(&g_log.stop, true, __ATOMIC_RELAXED);
+		pthread_join(g_log.thread, NULL);
+		g_log.running = false;
+		g_log.stop = false;
+	}
+
+	drain();
+}
+
+static bool parse_category(const char *name, uint64_t *ops, uint32_t *roots) {
+	for (unsigned int op = 0; op < STATS_N_OPS; ++op) {
+		if (streq(name, stats_op_name(op))) {
+			*ops |= UINT64_C(1) << op;
+			return true;
+		}
+	}
+
+	for (unsigned int root = 0; root < sizeof(g_root_names) / sizeof(*g_root_names); ++root) {
+		if (g_root_names[root] && streq(name, g_root_names[root])) {
+			*roots |= 1u << root;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool log_configure(const char *spec) {
+	char *copy = strdup(spec);
+	if (!copy) {
+		return false;
+	}
+
+	char *categories = strchr(copy, ':');
+	if (categories) {
+		*categories++ = '\0';
+	}
+
+	unsigned int level = 0;
+	while (level < LOG_N_LEVELS && !streq(copy, g_level_names[level])) {
+		++level;
+	}
+
+	if (level == LOG_N_LEVELS) {
+		printf("Unknown log level '%s', expected error, warn, info or debug\n", copy);
+		free(copy);
+		return false;
+	}
+
+	uint64_t ops = 0;
+	uint32_t roots = 0;
+
+	char *save;
+	for (char *name = categories ? strtok_r(categories, ":", &save) : NULL; name; name = strtok_r(NULL, ":", &save)) {
+		if (!parse_category(name, &ops, &roots)) {
+			printf("Unknown log category '%s', expected an op name or install, data or run\n", name);
+			free(copy);
+			return false;
+		}
+	}
+
+	free(copy);
+
+	__atomic_store_n(&g_log_filter.ops, ops ? ops : ALL_OPS, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_log_filter.roots, roots ? roots : ALL_ROOTS, __ATOMIC_RELAXED);
+	__atomic_store_n(&g_log_filter.level, level, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+int log_format_spec(char *buf, const size_t size) {
+	const unsigned int level = __atomic_load_n(&g_log_filter.level, __ATOMIC_RELAXED);
+	const uint64_t ops = __atomic_load_n(&g_log_filter.ops, __ATOMIC_RELAXED);
+	const uint32_t roots = __atomic_load_n(&g_log_filter.roots, __ATOMIC_RELAXED);
+
+	int len = snprintf(buf, size, "%s", g_level_names[level < LOG_N_LEVELS ? level : LOG_LEVEL_DEBUG]);
+	for (unsigned int op = 0; ops != ALL_OPS && op < STATS_N_OPS; ++op) {
+		if (ops & (UINT64_C(1) << op)) {
+			len += snprintf((size_t)len < size ? buf + len : NULL, (size_t)len < size ? size - (size_t)len : 0, ":%s", stats_op_name(op));
+		}
+	}
+
+	for (unsigned int root = 0; roots != ALL_ROOTS && root < sizeof(g_root_names) / sizeof(*g_root_names); ++root) {
+		if (roots & (1u << root)) {
+			len += snprintf((size_t)len < size ? buf + len : NULL, (size_t)len < size ? size - (size_t)len : 0, ":%s", g_root_names[root]);
+		}
+	}
+
+	return len;
+}
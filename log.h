@@ -0,0 +1,88 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "path.h"
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_XATTR "user.log"
+
+enum LogLevel {
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+	LOG_N_LEVELS
+};
+
+// Read on every call site, written by log_configure().
+struct LogFilter {
+	unsigned int level;
+	// Bit per enum StatsOp and per enum PathRoot, records outside of a handler or a root always pass.
+	uint64_t ops;
+	uint32_t roots;
+};
+
+extern struct LogFilter g_log_filter;
+
+// Parses "LEVEL[:CATEGORY...]", where LEVEL is error, warn, info or debug and the categories are op names
+// (getattr, open...) and roots (install, data, run). Without categories of a kind, all of them are logged.
+// Can be called at any time, the previous filter is kept on errors.
+bool log_configure(const char *spec);
+
+// Writes the current filter in the format accepted by log_configure(), returns its length like snprintf().
+int log_format_spec(char *buf, size_t size);
+
+// Starts the thread that formats the records and writes them to stdout, log_stop() flushes what's left.
+void log_start();
+void log_stop();
+
+void log_path_record(const char *func, const char *path, const char *real_path, enum PathRoot root);
+void log_message_record(enum LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static inline bool log_enabled(const enum LogLevel level, const enum PathRoot root) {
+	if (level > __atomic_load_n(&g_log_filter.level, __ATOMIC_RELAXED)) {
+		return false;
+	}
+
+	const enum StatsOp op = stats_current_op();
+	if (op != STATS_N_OPS && !(__atomic_load_n(&g_log_filter.ops, __ATOMIC_RELAXED) & (UINT64_C(1) << op))) {
+		return false;
+	}
+
+	return root == PATH_ROOT_NONE || (__atomic_load_n(&g_log_filter.roots, __ATOMIC_RELAXED) & (1u << root));
+}
+
+// A path translated by a handler, at debug level. Only the pointers are checked here, copying and formatting
+// happen if the filter lets the record through, the latter on the logging thread.
+static inline void log_path(const char *func, const char *path, const char *real_path, const enum PathRoot root) {
+	if (log_enabled(LOG_LEVEL_DEBUG, root)) {
+		log_path_record(func, path, real_path, root);
+	}
+}
+
+#define log_message(level, ...)                     \
+	do {                                            \
+		if (log_enabled(level, PATH_ROOT_NONE)) {   \
+			log_message_record(level, __VA_ARGS__); \
+		}                                           \
+	} while (0)
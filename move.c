@@ -0,0 +1,417 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "move.h"
+
+#include "filesystem.h"
+#include "log.h"
+#include "stats.h"
+#include "str.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define N_WORKERS (4)
+// Files are copied in chunks of this size, so that progress shows up while large ones are in flight.
+#define CHUNK_SIZE (64 * 1024 * 1024)
+#define BUF_SIZE (1024 * 1024)
+
+// An entry of the tree, in the order it was created: parents come before their children.
+struct Node {
+	char *src;
+	char *dst;
+	struct stat st;
+};
+
+struct Move {
+	int src_dirfd;
+	int dst_dirfd;
+	struct Node *nodes;
+	size_t n_nodes;
+	size_t cap_nodes;
+	uint64_t bytes;
+	// Next node the workers look at, and the first error any of them hit.
+	size_t next;
+	int err;
+};
+
+static unsigned int g_counter;
+
+static char *join(const char *dir, const char *name) {
+	char *path = malloc(strlen(dir) + strlen(name) + 2);
+	if (path) {
+		sprintf(path, "%s/%s", dir, name);
+	}
+
+	return path;
+}
+
+static int add_node(struct Move *move, char *src, char *dst, const struct stat *st) {
+	if (!src || !dst) {
+		free(src);
+		free(dst);
+		return ENOMEM;
+	}
+
+	if (move->n_nodes == move->cap_nodes) {
+		const size_t cap = move->cap_nodes ? move->cap_nodes * 2 : 64;
+		struct Node *nodes = realloc(move->nodes, cap * sizeof(*nodes));
+		if (!nodes) {
+			free(src);
+			free(dst);
+			return ENOMEM;
+		}
+
+		move->nodes = nodes;
+		move->cap_nodes = cap;
+	}
+
+	move->nodes[move->n_nodes++] = (struct Node){ .src = src, .dst = dst, .st = *st };
+
+	return 0;
+}
+
+// Creates the tree's skeleton: directories, symlinks, special files and empty regular files for the workers to fill.
+static int create_tree(struct Move *move, const char *src, const char *dst) {
+	struct stat st;
+	if (fstatat(move->src_dirfd, src, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+		return errno;
+	}
+
+	int err = add_node(move, strdup(src), strdup(dst), &st);
+	if (err) {
+		return err;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		const int fd = openat(move->dst_dirfd, dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd == -1) {
+			return errno;
+		}
+
+		close(fd);
+		move->bytes += (uint64_t)st.st_size;
+		return 0;
+	} else if (S_ISLNK(st.st_mode)) {
+		char target[PATH_MAX];
+		const ssize_t len = readlinkat(move->src_dirfd, src, target, sizeof(target) - 1);
+		if (len == -1) {
+			return errno;
+		}
+
+		target[len] = '\0';
+		return symlinkat(target, move->dst_dirfd, dst) == 0 ? 0 : errno;
+	} else if (!S_ISDIR(st.st_mode)) {
+		return mknodat(move->dst_dirfd, dst, st.st_mode, st.st_rdev) == 0 ? 0 : errno;
+	}
+
+	if (mkdirat(move->dst_dirfd, dst, 0700) == -1) {
+		return errno;
+	}
+
+	const int fd = openat(move->src_dirfd, src, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+	if (!dir) {
+		err = errno;
+		if (fd != -1) {
+			close(fd);
+		}
+
+		return err;
+	}
+
+	while (!err) {
+		errno = 0;
+		const struct dirent *ent = readdir(dir);
+		if (!ent) {
+			err = errno;
+			break;
+		}
+
+		if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+			continue;
+		}
+
+		char *child_src = join(src, ent->d_name);
+		char *child_dst = join(dst, ent->d_name);
+		err = child_src && child_dst ? create_tree(move, child_src, child_dst) : ENOMEM;
+		free(child_src);
+		free(child_dst);
+	}
+
+	closedir(dir);
+
+	return err;
+}
+
+static int copy_fallback(const int in, const int out, off_t off, const off_t end) {
+	char *buf = malloc(BUF_SIZE);
+	if (!buf) {
+		return ENOMEM;
+	}
+
+	int err = 0;
+
+	while (!err && off < end) {
+		const size_t len = end - off < BUF_SIZE ? (size_t)(end - off) : BUF_SIZE;
+		const ssize_t n = pread(in, buf, len, off);
+		if (n <= 0) {
+			err = n == 0 ? EIO : errno;
+			break;
+		}
+
+		for (ssize_t done = 0; !err && done < n;) {
+			const ssize_t ret = pwrite(out, buf + done, (size_t)(n - done), off + done);
+			if (ret == -1) {
+				err = errno;
+			} else {
+				done += ret;
+			}
+		}
+
+		off += n;
+		stats_move_progress((uint64_t)n);
+	}
+
+	free(buf);
+
+	return err;
+}
+
+static int copy_file(const struct Move *move, const struct Node *node) {
+	const int in = openat(move->src_dirfd, node->src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (in == -1) {
+		return errno;
+	}
+
+	const int out = openat(move->dst_dirfd, node->dst, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (out == -1) {
+		const int err = errno;
+		close(in);
+		return err;
+	}
+
+	int err = 0;
+	off_t off = 0;
+	const off_t end = node->st.st_size;
+
+	while (off < end) {
+		off_t off_in = off;
+		off_t off_out = off;
+		const size_t len = end - off < CHUNK_SIZE ? (size_t)(end - off) : CHUNK_SIZE;
+		const ssize_t ret = filesystem_copy_range(in, &off_in, out, &off_out, len, 0);
+		if (ret > 0) {
+			off += ret;
+			stats_move_progress((uint64_t)ret);
+			continue;
+		}
+
+		// Different filesystems on older kernels, or a file that shrank.
+		err = ret == 0 ? EIO : errno;
+		if (err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ENOSYS) {
+			err = copy_fallback(in, out, off, end);
+		}
+
+		break;
+	}
+
+	close(in);
+	if (close(out) == -1 && !err) {
+		err = errno;
+	}
+
+	return err;
+}
+
+static void *worker(void *arg) {
+	struct Move *move = arg;
+
+	while (!__atomic_load_n(&move->err, __ATOMIC_RELAXED)) {
+		const size_t i = __atomic_fetch_add(&move->next, 1, __ATOMIC_RELAXED);
+		if (i >= move->n_nodes) {
+			break;
+		}
+
+		if (!S_ISREG(move->nodes[i].st.st_mode)) {
+			continue;
+		}
+
+		const int err = copy_file(move, &move->nodes[i]);
+		if (err) {
+			int expected = 0;
+			__atomic_compare_exchange_n(&move->err, &expected, err, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+static int copy_files(struct Move *move) {
+	pthread_t workers[N_WORKERS];
+	size_t n_workers = 0;
+
+	while (n_workers < N_WORKERS && pthread_create(&workers[n_workers], NULL, worker, move) == 0) {
+		++n_workers;
+	}
+
+	// Whatever is left, if no thread could be started.
+	worker(move);
+
+	for (size_t i = 0; i < n_workers; ++i) {
+		pthread_join(workers[i], NULL);
+	}
+
+	return move->err;
+}
+
+// Children first, so that the directories' times aren't changed by what's created in them afterwards.
+static void copy_metadata(const struct Move *move) {
+	for (size_t i = move->n_nodes; i-- > 0;) {
+		const struct Node *node = &move->nodes[i];
+		const struct timespec times[2] = { node->st.st_atim, node->st.st_mtim };
+
+		// Only works for the file's owner or root, the mover owns the copy otherwise.
+		fchownat(move->dst_dirfd, node->dst, node->st.st_uid, node->st.st_gid, AT_SYMLINK_NOFOLLOW);
+		if (!S_ISLNK(node->st.st_mode)) {
+			fchmodat(move->dst_dirfd, node->dst, node->st.st_mode & 07777, 0);
+		}
+
+		utimensat(move->dst_dirfd, node->dst, times, AT_SYMLINK_NOFOLLOW);
+	}
+}
+
+static int remove_tree(const int dirfd, const char *path) {
+	if (unlinkat(dirfd, path, 0) == 0) {
+		return 0;
+	} else if (errno != EISDIR && errno != EPERM) {
+		return errno;
+	}
+
+	const int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+	if (!dir) {
+		const int err = errno;
+		if (fd != -1) {
+			close(fd);
+		}
+
+		return err;
+	}
+
+	int err = 0;
+	while (!err) {
+		errno = 0;
+		const struct dirent *ent = readdir(dir);
+		if (!ent) {
+			err = errno;
+			break;
+		}
+
+		if (!streq(ent->d_name, ".") && !streq(ent->d_name, "..")) {
+			char *child = join(path, ent->d_name);
+			err = child ? remove_tree(dirfd, child) : ENOMEM;
+			free(child);
+		}
+	}
+
+	closedir(dir);
+
+	return err ? err : (unlinkat(dirfd, path, AT_REMOVEDIR) == 0 ? 0 : errno);
+}
+
+int move_across(const int old_dirfd, const char *old_path, const int new_dirfd, const char *new_path, const unsigned int flags) {
+	// Exchanging can't be done atomically across filesystems, whiteouts are for overlayfs.
+	if (flags & ~RENAME_NOREPLACE) {
+		return EXDEV;
+	}
+
+	struct stat old_st;
+	struct stat new_st;
+	if (fstatat(old_dirfd, old_path, &old_st, AT_SYMLINK_NOFOLLOW) == -1) {
+		return errno;
+	}
+
+	if (fstatat(new_dirfd, new_path, &new_st, AT_SYMLINK_NOFOLLOW) == 0) {
+		if (flags & RENAME_NOREPLACE) {
+			return EEXIST;
+		} else if (S_ISDIR(old_st.st_mode) && !S_ISDIR(new_st.st_mode)) {
+			return ENOTDIR;
+		} else if (!S_ISDIR(old_st.st_mode) && S_ISDIR(new_st.st_mode)) {
+			return EISDIR;
+		}
+	}
+
+	// Next to the destination, so that the final rename stays on its filesystem.
+	const char *slash = strrchr(new_path, '/');
+	const int dir_len = slash ? (int)(slash - new_path) + 1 : 0;
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%.*s.%s.move-%d-%u", dir_len, new_path, slash ? slash + 1 : new_path, (int)getpid(),
+				 __atomic_add_fetch(&g_counter, 1, __ATOMIC_RELAXED)) >= (int)sizeof(tmp)) {
+		return ENAMETOOLONG;
+	}
+
+	struct Move move = { .src_dirfd = old_dirfd, .dst_dirfd = new_dirfd };
+
+	int err = create_tree(&move, old_path, tmp);
+
+	stats_move_begin(move.bytes);
+	log_message(LOG_LEVEL_INFO, "[%s] moving %s (%llu bytes) across filesystems", __func__, old_path, (unsigned long long)move.bytes);
+
+	if (!err) {
+		err = copy_files(&move);
+	}
+
+	if (!err) {
+		copy_metadata(&move);
+		if (renameat2(new_dirfd, tmp, new_dirfd, new_path, flags) == -1) {
+			err = errno;
+		}
+	}
+
+	stats_move_end();
+
+	for (size_t i = 0; i < move.n_nodes; ++i) {
+		free(move.nodes[i].src);
+		free(move.nodes[i].dst);
+	}
+
+	free(move.nodes);
+
+	if (err) {
+		remove_tree(new_dirfd, tmp);
+		return err;
+	}
+
+	// The move is visible at this point, a source that can't be removed entirely is only reported.
+	const int remove_err = remove_tree(old_dirfd, old_path);
+	if (remove_err) {
+		log_message(LOG_LEVEL_WARN, "[%s] moved %s, but removing it failed: %s", __func__, old_path, strerror(remove_err));
+	}
+
+	return 0;
+}
@@ -17,20 +17,7 @@
 
 #pragma once
 
-#include <stdarg.h>
-#include <stdio.h>
-
-static inline void debug(const char *format, ...) {
-#ifdef NDEBUG
-	(void)format;
-#else
-	va_list args;
-	va_start(args, format);
-	vprintf(format, args);
-	va_end(args);
-#endif
-}
-
-static inline void debug_path_func(const char *name, const char *path, const char *real_path) {
-	debug("[%s] %s -> %s\n", name, path, real_path);
-}
+// Moves old to new for a rename() that failed with EXDEV because they live on different roots: the tree is copied
+// next to new under a temporary name (cloning the files when possible), renamed over new and then removed from old.
+// Both paths are relative to their dirfd, flags are renameat2()'s. Returns 0 or an errno value.
+int move_across(int old_dirfd, const char *old_path, int new_dirfd, const char *new_path, unsigned int flags);
@@ -0,0 +1,235 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "negcache.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+#define N_SHARDS (16)
+#define N_BUCKETS (256)
+
+struct Node {
+	struct Node *next;
+	uint64_t hash;
+	uint64_t deadline;
+	// Position in the shard's ring, for eviction.
+	size_t slot;
+	char path[];
+};
+
+// Entries are evicted in insertion order once a shard is full.
+struct Shard {
+	pthread_mutex_t lock;
+	struct Node *buckets[N_BUCKETS];
+	struct Node **ring;
+	size_t head;
+	size_t len;
+};
+
+static struct {
+	struct Shard shards[N_SHARDS];
+	size_t shard_capacity;
+	uint64_t timeout_ns;
+} g_negcache;
+
+static inline uint64_t now_ns() {
+	// Entries live for seconds, the coarse clock is plenty and avoids a vDSO fallback on some systems.
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t hash_path(const char *path) {
+	// FNV-1a.
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (; *path; ++path) {
+		hash = (hash ^ (unsigned char)*path) * 0x100000001B3ull;
+	}
+
+	return hash;
+}
+
+static inline struct Shard *get_shard(const uint64_t hash) {
+	return &g_negcache.shards[hash % N_SHARDS];
+}
+
+static inline struct Node **get_bucket(struct Shard *shard, const uint64_t hash) {
+	return &shard->buckets[(hash / N_SHARDS) % N_BUCKETS];
+}
+
+// Called with the shard's lock held.
+static void remove_node(struct Shard *shard, struct Node **prev) {
+	struct Node *node = *prev;
+
+	*prev = node->next;
+	shard->ring[node->slot] = NULL;
+	--shard->len;
+
+	free(node);
+}
+
+static struct Node **find(struct Shard *shard, const uint64_t hash, const char *path) {
+	struct Node **prev = get_bucket(shard, hash);
+
+	for (; *prev; prev = &(*prev)->next) {
+		if ((*prev)->hash == hash && strcmp((*prev)->path, path) == 0) {
+			return prev;
+		}
+	}
+
+	return NULL;
+}
+
+void negcache_init(const size_t capacity, const double timeout) {
+	g_negcache.shard_capacity = (capacity + N_SHARDS - 1) / N_SHARDS;
+	g_negcache.timeout_ns = (uint64_t)(timeout * 1e9);
+
+	for (size_t i = 0; i < N_SHARDS; ++i) {
+		struct Shard *shard = &g_negcache.shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+
+		if (g_negcache.shard_capacity) {
+			shard->ring = calloc(g_negcache.shard_capacity, sizeof(*shard->ring));
+			if (!shard->ring) {
+				g_negcache.shard_capacity = 0;
+			}
+		}
+	}
+}
+
+bool negcache_contains(const char *path) {
+	if (!g_negcache.shard_capacity) {
+		return false;
+	}
+
+	const uint64_t hash = hash_path(path);
+	struct Shard *shard = get_shard(hash);
+
+	pthread_mutex_lock(&shard->lock);
+
+	bool ret = false;
+
+	struct Node **prev = find(shard, hash, path);
+	if (prev) {
+		if ((*prev)->deadline > now_ns()) {
+			ret = true;
+		} else {
+			remove_node(shard, prev);
+		}
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return ret;
+}
+
+void negcache_add(const char *path) {
+	if (!g_negcache.shard_capacity) {
+		return;
+	}
+
+	const uint64_t hash = hash_path(path);
+	struct Shard *shard = get_shard(hash);
+	const size_t len = strlen(path);
+
+	pthread_mutex_lock(&shard->lock);
+
+	struct Node **prev = find(shard, hash, path);
+	if (prev) {
+		(*prev)->deadline = now_ns() + g_negcache.timeout_ns;
+		goto UNLOCK;
+	}
+
+	struct Node *node = malloc(sizeof(*node) + len + 1);
+	if (!node) {
+		goto UNLOCK;
+	}
+
+	// The slot at head is the oldest one, unless it was freed by an invalidation.
+	struct Node *old = shard->ring[shard->head];
+	if (old) {
+		remove_node(shard, find(shard, old->hash, old->path));
+	}
+
+	node->hash = hash;
+	node->deadline = now_ns() + g_negcache.timeout_ns;
+	node->slot = shard->head;
+	memcpy(node->path, path, len + 1);
+
+	struct Node **bucket = get_bucket(shard, hash);
+	node->next = *bucket;
+	*bucket = node;
+
+	shard->ring[shard->head] = node;
+	shard->head = (shard->head + 1) % g_negcache.shard_capacity;
+	++shard->len;
+
+UNLOCK:
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void negcache_invalidate(const char *path) {
+	if (!g_negcache.shard_capacity) {
+		return;
+	}
+
+	const uint64_t hash = hash_path(path);
+	struct Shard *shard = get_shard(hash);
+
+	pthread_mutex_lock(&shard->lock);
+
+	struct Node **prev = find(shard, hash, path);
+	if (prev) {
+		remove_node(shard, prev);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void negcache_invalidate_tree(const char *path) {
+	if (!g_negcache.shard_capacity) {
+		return;
+	}
+
+	// Everything is beneath the mount root.
+	const size_t len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+
+	for (size_t i = 0; i < N_SHARDS; ++i) {
+		struct Shard *shard = &g_negcache.shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+
+		for (size_t j = 0; shard->len && j < N_BUCKETS; ++j) {
+			for (struct Node **prev = &shard->buckets[j]; *prev;) {
+				const char *node_path = (*prev)->path;
+				if (strncmp(node_path, path, len) == 0 && (node_path[len] == '\0' || node_path[len] == '/')) {
+					remove_node(shard, prev);
+				} else {
+					prev = &(*prev)->next;
+				}
+			}
+		}
+
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
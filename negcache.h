@@ -0,0 +1,33 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Remembers virtual paths that don't exist, so that repeated probes skip translating and stat'ing them.
+// Entries expire after timeout seconds, even if no invalidation reached them. A capacity of 0 disables the cache.
+void negcache_init(size_t capacity, double timeout);
+
+bool negcache_contains(const char *path);
+void negcache_add(const char *path);
+
+// Drops path itself.
+void negcache_invalidate(const char *path);
+// Drops path and everything beneath it, for directories that appeared or moved.
+void negcache_invalidate_tree(const char *path);
@@ -0,0 +1,140 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "options.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define OPTION(templ, field, value) { templ, offsetof(struct Options, field), value }
+
+enum OptionKey {
+	KEY_HELP
+};
+
+// Changes done outside the mount are pushed to the kernel as invalidations, so the caches can be kept for long.
+struct Options g_options = {
+	.attr_timeout = 300.0,
+	.entry_timeout = 300.0,
+	.negative_timeout = 10.0,
+	.negative_cache = 4096,
+	.io_uring_depth = 64,
+	.max_background = 64,
+	.prefetch_window = 30,
+	.group_commit = 10
+};
+
+static const struct fuse_opt option_specs[] = {
+	OPTION("lowlevel", lowlevel, 1),
+	OPTION("--lowlevel", lowlevel, 1),
+	OPTION("passthrough", passthrough, 1),
+	OPTION("--passthrough", passthrough, 1),
+	OPTION("io_uring", io_uring, 1),
+	OPTION("--io_uring", io_uring, 1),
+	OPTION("writeback", writeback, 1),
+	OPTION("--writeback", writeback, 1),
+	OPTION("hybrid", hybrid, 1),
+	OPTION("--hybrid", hybrid, 1),
+	OPTION("sync_read", sync_read, 1),
+	OPTION("max_write=%u", max_write, 0),
+	OPTION("max_readahead=%u", max_readahead, 0),
+	OPTION("max_background=%u", max_background, 0),
+	OPTION("congestion_threshold=%u", congestion_threshold, 0),
+	OPTION("io_uring_depth=%u", io_uring_depth, 0),
+	OPTION("redirects=%s", redirects, 0),
+	OPTION("trace=%s", trace, 0),
+	OPTION("log=%s", log, 0),
+	OPTION("prefetch=%s", prefetch, 0),
+	OPTION("prefetch_window=%u", prefetch_window, 0),
+	OPTION("install_snapshot=%s", install_snapshot, 0),
+	OPTION("group_commit=%u", group_commit, 0),
+	OPTION("attr_timeout=%lf", attr_timeout, 0),
+	OPTION("entry_timeout=%lf", entry_timeout, 0),
+	OPTION("negative_timeout=%lf", negative_timeout, 0),
+	OPTION("negative_cache=%u", negative_cache, 0),
+
+	FUSE_OPT_KEY("-h", KEY_HELP),
+	FUSE_OPT_KEY("--help", KEY_HELP),
+	FUSE_OPT_END
+};
+
+static void print_help() {
+	printf("steam_xdg_enforcer options:\n"
+	"    -o lowlevel            serve requests through the inode-based low-level backend\n"
+	"    -o passthrough         let the kernel access opened files directly (implies lowlevel)\n"
+	"    -o io_uring            queue reads, writes and syncs to io_uring (implies lowlevel)\n"
+	"    -o io_uring_depth=N    operations in flight per worker thread (64)\n"
+	"    -o writeback           let the kernel cache writes and flush them in batches\n"
+	"    -o hybrid              present whole-directory redirects as symlinks to the real directories\n"
+	"    -o sync_read           send one read at a time for each file\n"
+	"    -o max_write=N         largest write request in bytes (as large as libfuse allows)\n"
+	"    -o max_readahead=N     largest readahead in bytes (as large as the kernel allows)\n"
+	"    -o max_background=N    background requests the kernel keeps in flight (64)\n"
+	"    -o congestion_threshold=N\n"
+	"                           background requests before the kernel backs off (3/4 of max_background)\n"
+	"    -o redirects=FILE      load the redirect specs from FILE, reloaded on SIGHUP\n"
+	"    -o trace=FILE          record every request to FILE (high-level backend only)\n"
+	"    -o log=SPEC            level and categories to log, e.g. debug:getattr:data (warn)\n"
+	"    -o prefetch=FILE       warm the files listed in FILE at mount and record a new list\n"
+	"    -o prefetch_window=S   seconds after mounting that are recorded, 0 keeps FILE as is (30)\n"
+	"    -o install_snapshot=FILE\n"
+	"                           serve the install directory's metadata from an index kept in FILE\n"
+	"    -o group_commit=MS     window in which fsyncs below group-commit redirects are coalesced (10)\n"
+	"    -o attr_timeout=T      seconds the kernel caches attributes (300)\n"
+	"    -o entry_timeout=T     seconds the kernel caches name lookups (300)\n"
+	"    -o negative_timeout=T  seconds the kernel caches failed name lookups (10)\n"
+	"    -o negative_cache=N    missing paths the high-level backend remembers, 0 disables (4096)\n"
+	"\n");
+}
+
+static int process_arg(void *data, const char *arg, int key, struct fuse_args *outargs) {
+	(void)data;
+	(void)arg;
+	(void)outargs;
+
+	if (key == KEY_HELP) {
+		print_help();
+	}
+
+	// Everything we don't consume is handed over to libfuse.
+	return 1;
+}
+
+bool options_parse(struct fuse_args *args) {
+	if (fuse_opt_parse(args, &g_options, option_specs, process_arg) != 0) {
+		return false;
+	}
+
+	// Passthrough and asynchronous replies are only available through the low-level API.
+	if (g_options.passthrough || g_options.io_uring) {
+		g_options.lowlevel = 1;
+	}
+
+	// The kernel refuses to pass files through while it caches writes for them.
+	if (g_options.writeback && g_options.passthrough) {
+		printf("writeback and passthrough can't be combined, ignoring writeback.\n");
+		g_options.writeback = 0;
+	}
+
+	if (!g_options.io_uring_depth) {
+		g_options.io_uring_depth = 1;
+	}
+
+	return true;
+}
@@ -0,0 +1,52 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <fuse_opt.h>
+
+struct Options {
+	int lowlevel;
+	int passthrough;
+	int io_uring;
+	int writeback;
+	int hybrid;
+	int sync_read;
+	unsigned int max_write;
+	unsigned int max_readahead;
+	unsigned int max_background;
+	unsigned int congestion_threshold;
+	unsigned int io_uring_depth;
+	char *redirects;
+	char *trace;
+	char *log;
+	char *prefetch;
+	char *install_snapshot;
+	unsigned int prefetch_window;
+	unsigned int group_commit;
+
+	double attr_timeout;
+	double entry_timeout;
+	double negative_timeout;
+	unsigned int negative_cache;
+};
+
+extern struct Options g_options;
+
+bool options_parse(struct fuse_args *args);
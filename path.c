@@ -19,12 +19,20 @@
 
 #include "str.h"
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
 #include <cwalk.h>
 
 #define ARRAY_SIZE(arr) (sizeof((arr)) / sizeof((arr)[0]))
@@ -33,59 +41,616 @@
 #define ENV_VAR_DATA_DIR ENV_VAR_PREFIX "DATA_DIR"
 #define ENV_VAR_RUN_DIR ENV_VAR_PREFIX "RUN_DIR"
 
+struct Root {
+	enum PathRoot id;
+	char *path;
+	size_t len;
+	int fd;
+};
+
 static struct {
-	char *install;
-	char *data;
-	char *run;
+	struct Root install;
+	struct Root data;
+	struct Root run;
 } g_roots;
 
-static struct PathSpec {
+struct PathSpec {
 	const char *match;
 	const char *redir;
-	const char *root;
-} g_specs[18];
+	const struct Root *root;
+	size_t match_len;
+	size_t redir_len;
+	bool strict;
+	// Whole-directory redirect, presented as a symlink to the real directory in hybrid mode.
+	bool link;
+	enum PathDurability durability;
+};
+
+// Radix trie over the bytes of the match strings, compiled once per set of rules and never modified afterwards.
+// Edges are byte strings rather than path components, so that prefix specs keep matching e.g. "registry.vdf.tmp".
+struct TrieNode {
+	const char *label;
+	size_t label_len;
+	struct TrieNode *child;
+	struct TrieNode *sibling;
+	const struct PathSpec *prefix;
+	const struct PathSpec *strict;
+};
+
+// Everything derived from one version of the config, immutable once published.
+struct Rules {
+	struct PathSpec *specs;
+	size_t n_specs;
+	// Directories with redirected children, the strings point into the specs' matches.
+	struct Parent {
+		const char *path;
+		size_t len;
+	} *parents;
+	size_t n_parents;
+	struct TrieNode trie;
+};
+
+// Translating threads announce the epoch they started reading in, so that a reload only frees the
+// previous rules once every reader that could still see them is done. Readers never take a lock.
+struct Reader {
+	struct Reader *next;
+	struct Reader *next_free;
+	uint64_t epoch;
+	unsigned int depth;
+};
+
+static struct {
+	struct Rules *rules;
+	uint64_t epoch;
+	char *config;
+	bool hybrid;
+	struct Reader *readers;
+	struct Reader *free;
+	// Readers that couldn't get a slot, reloads wait for all of them to leave.
+	unsigned int pinned;
+	pthread_key_t key;
+	pthread_once_t once;
+	pthread_mutex_t lock;
+} g_rules = { .epoch = 1, .once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct Reader *t_reader;
+static __thread unsigned int t_pinned;
 
-static bool is_strict_match(const char *str, const size_t len) {
-	// 0x03 corresponds to ETX (End of TeXt) in ASCII.
-	return str[len - 1] == '\x03';
+static struct TrieNode *trie_node_new(const char *label, const size_t label_len) {
+	struct TrieNode *node = calloc(1, sizeof(*node));
+	if (node) {
+		node->label = label;
+		node->label_len = label_len;
+	}
+
+	return node;
 }
 
-static char *build_path(const char *target, const struct PathSpec *spec) {
-	const size_t match_len = strlen(spec->match);
+static bool trie_insert(struct TrieNode *node, const struct PathSpec *spec) {
+	const char *str = spec->match;
+	size_t len = spec->match_len;
+
+	while (len) {
+		struct TrieNode *child = node->child;
+		while (child && child->label[0] != str[0]) {
+			child = child->sibling;
+		}
+
+		if (!child) {
+			child = trie_node_new(str, len);
+			if (!child) {
+				return false;
+			}
+
+			child->sibling = node->child;
+			node->child = child;
+			node = child;
+			break;
+		}
+
+		size_t common = 1;
+		while (common < child->label_len && common < len && child->label[common] == str[common]) {
+			++common;
+		}
+
+		if (common < child->label_len) {
+			struct TrieNode *tail = trie_node_new(child->label + common, child->label_len - common);
+			if (!tail) {
+				return false;
+			}
 
-	size_t path_size;
-	if (is_strict_match(spec->match, match_len)) {
-		path_size = cwk_path_join(spec->root, spec->redir, NULL, 0);
+			tail->child = child->child;
+			tail->prefix = child->prefix;
+			tail->strict = child->strict;
+
+			child->label_len = common;
+			child->child = tail;
+			child->prefix = NULL;
+			child->strict = NULL;
+		}
+
+		node = child;
+		str += common;
+		len -= common;
+	}
+
+	if (spec->strict) {
+		node->strict = spec;
 	} else {
-		path_size = snprintf(NULL, 0, "%s/%s%s", spec->root, spec->redir, target + strlen(spec->match));
+		node->prefix = spec;
 	}
 
-	if (!path_size) {
+	return true;
+}
+
+// Returns the most specific spec matching target, along with the length of the matched part.
+static const struct PathSpec *trie_match(const struct Rules *rules, const char *target, const size_t target_len, size_t *match_len) {
+	const struct TrieNode *node = &rules->trie;
+	const struct PathSpec *ret = NULL;
+	size_t pos = 0;
+
+	while (true) {
+		if (node->prefix) {
+			ret = node->prefix;
+			*match_len = pos;
+		}
+
+		if (pos == target_len) {
+			if (node->strict) {
+				ret = node->strict;
+				*match_len = pos;
+			}
+
+			break;
+		}
+
+		const struct TrieNode *child = node->child;
+		while (child && child->label[0] != target[pos]) {
+			child = child->sibling;
+		}
+
+		if (!child || target_len - pos < child->label_len || !strneq(target + pos, child->label, child->label_len)) {
+			break;
+		}
+
+		pos += child->label_len;
+		node = child;
+	}
+
+	return ret;
+}
+
+static void trie_free(struct TrieNode *node) {
+	while (node) {
+		struct TrieNode *sibling = node->sibling;
+		trie_free(node->child);
+		free(node);
+		node = sibling;
+	}
+}
+
+static void rules_free(struct Rules *rules) {
+	if (!rules) {
+		return;
+	}
+
+	trie_free(rules->trie.child);
+
+	for (size_t i = 0; i < rules->n_specs; ++i) {
+		free((char *)rules->specs[i].match);
+		free((char *)rules->specs[i].redir);
+	}
+
+	free(rules->specs);
+	free(rules->parents);
+	free(rules);
+}
+
+static const struct Root *root_by_name(const char *name) {
+	if (streq(name, "install")) {
+		return &g_roots.install;
+	} else if (streq(name, "data")) {
+		return &g_roots.data;
+	} else if (streq(name, "run")) {
+		return &g_roots.run;
+	}
+
+	return NULL;
+}
+
+// Takes ownership of match and redir, even on failure.
+static bool rules_add(struct Rules *rules, size_t *cap, char *match, char *redir, const struct Root *root, const bool strict, const bool link,
+					  const enum PathDurability durability) {
+	if (rules->n_specs == *cap) {
+		const size_t new_cap = *cap ? *cap * 2 : 32;
+		struct PathSpec *specs = realloc(rules->specs, new_cap * sizeof(*specs));
+		if (!specs) {
+			free(match);
+			free(redir);
+			return false;
+		}
+
+		rules->specs = specs;
+		*cap = new_cap;
+	}
+
+	rules->specs[rules->n_specs++] = (struct PathSpec){
+		.match = match,
+		.redir = redir,
+		.root = root,
+		.match_len = strlen(match),
+		.redir_len = strlen(redir),
+		.strict = strict,
+		.link = link,
+		.durability = durability
+	};
+
+	return true;
+}
+
+// Builds the trie and the parent list once all specs are in place, the specs array doesn't move anymore.
+static bool rules_compile(struct Rules *rules) {
+	rules->parents = calloc(rules->n_specs, sizeof(*rules->parents));
+	if (rules->n_specs && !rules->parents) {
+		return false;
+	}
+
+	for (size_t i = 0; i < rules->n_specs; ++i) {
+		const struct PathSpec *spec = &rules->specs[i];
+
+		if (!trie_insert(&rules->trie, spec)) {
+			return false;
+		}
+
+		const size_t len = (size_t)(strrchr(spec->match, '/') - spec->match);
+
+		bool found = false;
+		for (size_t j = 0; j < rules->n_parents && !found; ++j) {
+			found = rules->parents[j].len == len && strneq(rules->parents[j].path, spec->match, len);
+		}
+
+		if (!found) {
+			rules->parents[rules->n_parents++] = (struct Parent){ .path = spec->match, .len = len };
+		}
+	}
+
+	return true;
+}
+
+static struct Rules *rules_default() {
+	static const struct {
+		const char *match;
+		const char *redir;
+		enum PathRoot root;
+		bool strict;
+		bool link;
+		enum PathDurability durability;
+	} defaults[] = {
+		{ "/registry.vdf",                 "/config/registry.vdf",            PATH_ROOT_DATA, false, false, PATH_DURABILITY_STRICT  },
+		{ "/starting",                     "/starting",                       PATH_ROOT_DATA, true,  false, PATH_DURABILITY_STRICT  },
+		{ "/steam.config",                 "/config/steam.config",            PATH_ROOT_DATA, true,  false, PATH_DURABILITY_STRICT  },
+		{ "/steam.pid",                    "/steam.pid",                      PATH_ROOT_RUN,  true,  false, PATH_DURABILITY_STRICT  },
+		{ "/steam.pipe",                   "/steam.pipe",                     PATH_ROOT_RUN,  true,  false, PATH_DURABILITY_STRICT  },
+		{ "/steam.token",                  "/steam.token",                    PATH_ROOT_RUN,  true,  false, PATH_DURABILITY_STRICT  },
+		{ "/root/.crash",                  "/config/.crash",                  PATH_ROOT_DATA, true,  false, PATH_DURABILITY_STRICT  },
+		{ "/root/.forceupdate",            "/config/.forceupdate",            PATH_ROOT_DATA, true,  false, PATH_DURABILITY_STRICT  },
+		{ "/root/appcache",                "/appcache",                       PATH_ROOT_DATA, false, true,  PATH_DURABILITY_RELAXED },
+		{ "/root/compatibilitytools.d",    "/compatibilitytools.d",           PATH_ROOT_DATA, false, true,  PATH_DURABILITY_STRICT  },
+		{ "/root/config",                  "/config",                         PATH_ROOT_DATA, false, false, PATH_DURABILITY_STRICT  },
+		{ "/root/depotcache",              "/depotcache",                     PATH_ROOT_DATA, false, true,  PATH_DURABILITY_RELAXED },
+		{ "/root/logs",                    "/logs",                           PATH_ROOT_DATA, false, false, PATH_DURABILITY_GROUP   },
+		{ "/root/music",                   "/music",                          PATH_ROOT_DATA, false, false, PATH_DURABILITY_STRICT  },
+		{ "/root/shader_cache",            "/shader_cache",                   PATH_ROOT_DATA, false, true,  PATH_DURABILITY_RELAXED },
+		{ "/root/steamapps",               "/steamapps",                      PATH_ROOT_DATA, false, true,  PATH_DURABILITY_STRICT  },
+		{ "/root/update_hosts_cached.vdf", "/config/update_hosts_cached.vdf", PATH_ROOT_DATA, true,  false, PATH_DURABILITY_STRICT  },
+		{ "/root/userdata",                "/userdata",                       PATH_ROOT_DATA, false, true,  PATH_DURABILITY_STRICT  }
+	};
+
+	struct Rules *rules = calloc(1, sizeof(*rules));
+	if (!rules) {
+		return NULL;
+	}
+
+	size_t cap = 0;
+
+	for (size_t i = 0; i < ARRAY_SIZE(defaults); ++i) {
+		const struct Root *root = defaults[i].root == PATH_ROOT_RUN ? &g_roots.run : &g_roots.data;
+
+		char *match = strdup(defaults[i].match);
+		char *redir = strdup(defaults[i].redir);
+		if (!match || !redir) {
+			free(match);
+			free(redir);
+			goto FAIL;
+		}
+
+		if (!rules_add(rules, &cap, match, redir, root, defaults[i].strict, defaults[i].link, defaults[i].durability)) {
+			goto FAIL;
+		}
+	}
+
+	if (rules_compile(rules)) {
+		return rules;
+	}
+
+FAIL:
+	rules_free(rules);
+
+	return NULL;
+}
+
+// A match has to be a normalized absolute path below the mount root that isn't one of the fixed entries.
+static bool match_valid(const char *match) {
+	char normalized[PATH_MAX];
+	if (cwk_path_normalize(match, normalized, sizeof(normalized)) >= sizeof(normalized)) {
+		return false;
+	}
+
+	return match[0] == '/' && streq(match, normalized) && !path_is_fixed(match);
+}
+
+static bool parse_line(struct Rules *rules, size_t *cap, char *line, const char *config, const size_t n_line) {
+	char *saveptr;
+	const char *kind = strtok_r(line, " \t\n", &saveptr);
+	if (!kind || kind[0] == '#') {
+		return true;
+	}
+
+	const char *match = strtok_r(NULL, " \t\n", &saveptr);
+	const char *root_name = strtok_r(NULL, " \t\n", &saveptr);
+	const char *redir = strtok_r(NULL, " \t\n", &saveptr);
+	const char *durability_name = strtok_r(NULL, " \t\n", &saveptr);
+
+	const struct Root *root = root_name ? root_by_name(root_name) : NULL;
+	const bool strict = streq(kind, "exact");
+	const bool link = streq(kind, "link");
+
+	enum PathDurability durability = PATH_DURABILITY_STRICT;
+	bool durability_valid = !durability_name || streq(durability_name, "strict");
+	if (durability_name && streq(durability_name, "group")) {
+		durability = PATH_DURABILITY_GROUP;
+		durability_valid = true;
+	} else if (durability_name && streq(durability_name, "relaxed")) {
+		durability = PATH_DURABILITY_RELAXED;
+		durability_valid = true;
+	}
+
+	if ((!strict && !link && !streq(kind, "prefix")) || !match || !root || !redir || !durability_valid ||
+		strtok_r(NULL, " \t\n", &saveptr) || !match_valid(match) || redir[0] != '/') {
+		printf("%s:%zu: expected \"prefix|exact|link MATCH install|data|run TARGET [strict|group|relaxed]\"\n", config, n_line);
+		return false;
+	}
+
+	for (size_t i = 0; i < rules->n_specs; ++i) {
+		if (rules->specs[i].strict == strict && streq(rules->specs[i].match, match)) {
+			printf("%s:%zu: %s is redirected twice\n", config, n_line, match);
+			return false;
+		}
+	}
+
+	char *match_copy = strdup(match);
+	char *redir_copy = strdup(redir);
+	if (!match_copy || !redir_copy) {
+		free(match_copy);
+		free(redir_copy);
+		return false;
+	}
+
+	return rules_add(rules, cap, match_copy, redir_copy, root, strict, link, durability);
+}
+
+static struct Rules *rules_load(const char *config) {
+	FILE *file = fopen(config, "re");
+	if (!file) {
+		printf("Failed to open %s: %s\n", config, strerror(errno));
 		return NULL;
 	}
 
-	char *path = malloc(++path_size);
-	if (!path) {
+	struct Rules *rules = calloc(1, sizeof(*rules));
+	if (!rules) {
+		fclose(file);
 		return NULL;
 	}
 
-	if (is_strict_match(spec->match, match_len)) {
-		cwk_path_join(spec->root, spec->redir, path, path_size);
-	} else {
-		snprintf(path, path_size, "%s/%s%s", spec->root, spec->redir, target + strlen(spec->match));
+	size_t cap = 0;
+	bool ok = true;
+
+	char *line = NULL;
+	size_t size = 0;
+
+	for (size_t n_line = 1; ok && getline(&line, &size, file) != -1; ++n_line) {
+		ok = parse_line(rules, &cap, line, config, n_line);
+	}
+
+	free(line);
+	fclose(file);
+
+	if (!ok || !rules_compile(rules)) {
+		rules_free(rules);
+		return NULL;
+	}
+
+	return rules;
+}
+
+static void reader_release(void *arg) {
+	struct Reader *reader = arg;
+
+	pthread_mutex_lock(&g_rules.lock);
+	reader->next_free = g_rules.free;
+	g_rules.free = reader;
+	pthread_mutex_unlock(&g_rules.lock);
+}
+
+static void key_init() {
+	pthread_key_create(&g_rules.key, reader_release);
+}
+
+static struct Reader *reader_get() {
+	if (t_reader) {
+		return t_reader;
+	}
+
+	pthread_once(&g_rules.once, key_init);
+
+	pthread_mutex_lock(&g_rules.lock);
+
+	struct Reader *reader = g_rules.free;
+	if (reader) {
+		g_rules.free = reader->next_free;
+	} else if ((reader = calloc(1, sizeof(*reader)))) {
+		reader->next = g_rules.readers;
+		__atomic_store_n(&g_rules.readers, reader, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&g_rules.lock);
+
+	if (reader) {
+		pthread_setspecific(g_rules.key, reader);
+		t_reader = reader;
+	}
+
+	return reader;
+}
+
+// The returned rules stay valid until the matching rules_leave(), sections may nest.
+static const struct Rules *rules_enter() {
+	struct Reader *reader = t_pinned ? NULL : reader_get();
+	if (!reader) {
+		++t_pinned;
+		__atomic_add_fetch(&g_rules.pinned, 1, __ATOMIC_SEQ_CST);
+		return __atomic_load_n(&g_rules.rules, __ATOMIC_SEQ_CST);
+	}
+
+	if (reader->depth++ == 0) {
+		__atomic_store_n(&reader->epoch, __atomic_load_n(&g_rules.epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	}
+
+	return __atomic_load_n(&g_rules.rules, __ATOMIC_SEQ_CST);
+}
+
+static void rules_leave() {
+	if (t_pinned) {
+		--t_pinned;
+		__atomic_sub_fetch(&g_rules.pinned, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	struct Reader *reader = t_reader;
+
+	if (--reader->depth == 0) {
+		__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+// Publishes rules and waits until no reader can still be using the previous ones, which are returned.
+static struct Rules *rules_publish(struct Rules *rules) {
+	pthread_mutex_lock(&g_rules.lock);
+
+	struct Rules *old = __atomic_exchange_n(&g_rules.rules, rules, __ATOMIC_SEQ_CST);
+	const uint64_t epoch = __atomic_add_fetch(&g_rules.epoch, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&g_rules.lock);
+
+	const struct timespec ts = { .tv_nsec = 100 * 1000 };
+
+	for (struct Reader *reader = __atomic_load_n(&g_rules.readers, __ATOMIC_ACQUIRE); reader; reader = reader->next) {
+		while (true) {
+			const uint64_t reader_epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+			if (!reader_epoch || reader_epoch >= epoch) {
+				break;
+			}
+
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	while (__atomic_load_n(&g_rules.pinned, __ATOMIC_SEQ_CST)) {
+		nanosleep(&ts, NULL);
 	}
 
-	cwk_path_normalize(path, path, path_size);
+	return old;
+}
+
+// Replaces the first match_len bytes of the path in buf with prefix, in place.
+static ssize_t replace_prefix(char *buf, const size_t size, const size_t len, const size_t match_len, const char *prefix, const size_t prefix_len) {
+	const size_t suffix_len = len - match_len;
+	const size_t path_len = prefix_len + suffix_len;
+
+	if (path_len >= size) {
+		return -ENAMETOOLONG;
+	}
+
+	memmove(buf + prefix_len, buf + match_len, suffix_len + 1);
+	memcpy(buf, prefix, prefix_len);
 
-	return path;
+	return (ssize_t)path_len;
 }
 
-bool path_init() {
-	g_roots.install = getenv(ENV_VAR_INSTALL_DIR);
-	g_roots.data = getenv(ENV_VAR_DATA_DIR);
-	g_roots.run = getenv(ENV_VAR_RUN_DIR);
+// Normalizes and translates target in place. When it lives in one of the roots, *root is set and
+// buf is left with the path relative to it (either empty or starting with a slash).
+static ssize_t translate(const char *target, char *buf, const size_t size, const struct Root **root) {
+	*root = NULL;
 
-	if (!(g_roots.install && g_roots.data && g_roots.run)) {
+	const size_t len = cwk_path_normalize(target, buf, size);
+	if (len >= size) {
+		return -ENAMETOOLONG;
+	}
+
+	const struct Rules *rules = rules_enter();
+
+	size_t match_len;
+	const struct PathSpec *spec = trie_match(rules, buf, len, &match_len);
+	if (spec) {
+		*root = spec->root;
+		const ssize_t ret = replace_prefix(buf, size, len, match_len, spec->redir, spec->redir_len);
+		rules_leave();
+		return ret;
+	}
+
+	rules_leave();
+
+	if (cwk_path_is_relative(buf) || !strneq(buf, "/root", 5)) {
+		return (ssize_t)len;
+	}
+
+	if (len > 5 && buf[5] != '/') {
+		return -ENOENT;
+	}
+
+	*root = &g_roots.install;
+
+	return replace_prefix(buf, size, len, 5, "", 0);
+}
+
+static bool root_init(struct Root *root, const enum PathRoot id, const char *path) {
+	root->id = id;
+
+	const size_t size = cwk_path_normalize(path, NULL, 0) + 1;
+
+	root->path = malloc(size);
+	if (!root->path) {
+		printf("Failed to allocate the root path!\n");
+		return false;
+	}
+
+	root->len = cwk_path_normalize(path, root->path, size);
+
+	root->fd = open(root->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (root->fd == -1) {
+		printf("Failed to open %s: %s\n", root->path, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+bool path_init(const char *config, const bool hybrid) {
+	const char *install = getenv(ENV_VAR_INSTALL_DIR);
+	const char *data = getenv(ENV_VAR_DATA_DIR);
+	const char *run = getenv(ENV_VAR_RUN_DIR);
+
+	if (!(install && data && run)) {
 		printf("Please define all environment variables:\n\n"
 		ENV_VAR_INSTALL_DIR "\n"
 		ENV_VAR_DATA_DIR "\n"
@@ -93,63 +658,224 @@ bool path_init() {
 		return false;
 	}
 
-	g_specs[0]  = (struct PathSpec){ .match = "/registry.vdf",                     .redir = "/config/registry.vdf",            .root = g_roots.data    };
-	g_specs[1]  = (struct PathSpec){ .match = "/starting\x03",                     .redir = "/starting",                       .root = g_roots.data    };
-	g_specs[2]  = (struct PathSpec){ .match = "/steam.config\x03",                 .redir = "/config/steam.config",            .root = g_roots.data    };
-	g_specs[3]  = (struct PathSpec){ .match = "/steam.pid\x03",                    .redir = "/steam.pid",                      .root = g_roots.run     };
-	g_specs[4]  = (struct PathSpec){ .match = "/steam.pipe\x03",                   .redir = "/steam.pipe",                     .root = g_roots.run     };
-	g_specs[5]  = (struct PathSpec){ .match = "/steam.token\x03",                  .redir = "/steam.token",                    .root = g_roots.run     };
-	g_specs[6]  = (struct PathSpec){ .match = "/root/.crash\x03",                  .redir = "/config/.crash",                  .root = g_roots.data    };
-	g_specs[7]  = (struct PathSpec){ .match = "/root/.forceupdate\x03",            .redir = "/config/.forceupdate",            .root = g_roots.data    };
-	g_specs[8]  = (struct PathSpec){ .match = "/root/appcache",                    .redir = "/appcache",                       .root = g_roots.data    };
-	g_specs[9]  = (struct PathSpec){ .match = "/root/compatibilitytools.d",        .redir = "/compatibilitytools.d",           .root = g_roots.data    };
-	g_specs[10] = (struct PathSpec){ .match = "/root/config",                      .redir = "/config",                         .root = g_roots.data    };
-	g_specs[11] = (struct PathSpec){ .match = "/root/depotcache",                  .redir = "/depotcache",                     .root = g_roots.data    };
-	g_specs[12] = (struct PathSpec){ .match = "/root/logs",                        .redir = "/logs",                           .root = g_roots.data    };
-	g_specs[13] = (struct PathSpec){ .match = "/root/music",                       .redir = "/music",                          .root = g_roots.data    };
-	g_specs[14] = (struct PathSpec){ .match = "/root/shader_cache",                .redir = "/shader_cache",                   .root = g_roots.data    };
-	g_specs[15] = (struct PathSpec){ .match = "/root/steamapps",                   .redir = "/steamapps",                      .root = g_roots.data    };
-	g_specs[16] = (struct PathSpec){ .match = "/root/update_hosts_cached.vdf\x03", .redir = "/config/update_hosts_cached.vdf", .root = g_roots.data    };
-	g_specs[17] = (struct PathSpec){ .match = "/root/userdata",                    .redir = "/userdata",                       .root = g_roots.data    };
+	if (!(root_init(&g_roots.install, PATH_ROOT_INSTALL, install) &&
+		  root_init(&g_roots.data, PATH_ROOT_DATA, data) &&
+		  root_init(&g_roots.run, PATH_ROOT_RUN, run))) {
+		return false;
+	}
+
+	g_rules.hybrid = hybrid;
+
+	// Reloads happen after daemonizing changed the working directory.
+	if (config && !(g_rules.config = realpath(config, NULL))) {
+		printf("Failed to resolve %s: %s\n", config, strerror(errno));
+		return false;
+	}
+
+	g_rules.rules = config ? rules_load(g_rules.config) : rules_default();
+	if (!g_rules.rules) {
+		printf("Failed to compile the path specs!\n");
+		return false;
+	}
 
 	return true;
 }
 
-char *path_get_real(const char *target) {
-	size_t target_len = strlen(target);
-	char *target_norm = strndup(target, target_len);
-	target_len = cwk_path_normalize(target, target_norm, target_len + 1);
-	target = target_norm;
+bool path_reload(PathMatchFunc func, void *data) {
+	if (!g_rules.config) {
+		return false;
+	}
 
-	char *ret = NULL;
+	struct Rules *rules = rules_load(g_rules.config);
+	if (!rules) {
+		printf("Keeping the previous path specs.\n");
+		return false;
+	}
 
-	for (uint8_t i = 0; i < ARRAY_SIZE(g_specs); ++i) {
-		const struct PathSpec *spec = &g_specs[i];
+	struct Rules *old = rules_publish(rules);
 
-		size_t match_len = strlen(spec->match);
-		if (is_strict_match(spec->match, match_len)) {
-			if (strlen(target) != --match_len) {
-				continue;
-			}
+	if (func) {
+		for (size_t i = 0; i < old->n_specs; ++i) {
+			func(data, old->specs[i].match);
+		}
+
+		for (size_t i = 0; i < rules->n_specs; ++i) {
+			func(data, rules->specs[i].match);
 		}
+	}
+
+	rules_free(old);
+
+	return true;
+}
+
+ssize_t path_get_dir_link(const char *target, char *buf, const size_t size) {
+	if (!g_rules.hybrid) {
+		return 0;
+	}
+
+	const size_t len = strlen(target);
+
+	const struct Rules *rules = rules_enter();
+
+	size_t match_len;
+	const struct PathSpec *spec = trie_match(rules, target, len, &match_len);
+
+	// Until the directory exists it's served as usual, so that it can be created through the mount.
+	struct stat st;
+
+	ssize_t ret = 0;
+	if (spec && spec->link && match_len == len && fstatat(spec->root->fd, spec->redir + 1, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+		const int n = snprintf(buf, size, "%s%s", spec->root->len == 1 ? "" : spec->root->path, spec->redir);
+		ret = n < 0 || (size_t)n >= size ? -ENAMETOOLONG : n;
+	}
+
+	rules_leave();
+
+	return ret;
+}
+
+enum PathDurability path_get_durability(const char *target) {
+	const struct Rules *rules = rules_enter();
+
+	size_t match_len;
+	const struct PathSpec *spec = trie_match(rules, target, strlen(target), &match_len);
+	const enum PathDurability durability = spec ? spec->durability : PATH_DURABILITY_STRICT;
+
+	rules_leave();
+
+	return durability;
+}
+
+ssize_t path_get_real(const char *target, char *buf, const size_t size) {
+	const struct Root *root;
+	const ssize_t len = translate(target, buf, size, &root);
+	if (len < 0 || !root) {
+		return len;
+	}
+
+	// The roots are normalized, which means that only "/" can end with a slash.
+	const size_t root_len = root->len == 1 ? 0 : root->len;
+	const ssize_t ret = replace_prefix(buf, size, (size_t)len, 0, root->path, root_len);
+	if (ret == 0) {
+		buf[0] = '/';
+		buf[1] = '\0';
+		return 1;
+	}
+
+	return ret;
+}
+
+ssize_t path_get_real_at(const char *target, char *buf, const size_t size, int *dirfd) {
+	const struct Root *root;
+	ssize_t len = translate(target, buf, size, &root);
+	if (len < 0 || !root) {
+		*dirfd = AT_FDCWD;
+		return len;
+	}
+
+	*dirfd = root->fd;
 
-		if (strneq(target, spec->match, match_len)) {
-			ret = build_path(target, spec);
-			goto RET;
+	size_t skip = 0;
+	while (buf[skip] == '/') {
+		++skip;
+	}
+
+	if (skip == (size_t)len) {
+		buf[0] = '.';
+		buf[1] = '\0';
+		return 1;
+	}
+
+	memmove(buf, buf + skip, (size_t)len - skip + 1);
+
+	return len - (ssize_t)skip;
+}
+
+static inline bool root_contains(const struct Root *root, const char *real) {
+	return strneq(real, root->path, root->len) && (real[root->len] == '/' || real[root->len] == '\0');
+}
+
+enum PathRoot path_get_root(const char *real) {
+	// The longest match wins, in case a root lives inside another.
+	const struct Root *roots[] = { &g_roots.install, &g_roots.data, &g_roots.run };
+	const struct Root *found = NULL;
+
+	for (size_t i = 0; i < ARRAY_SIZE(roots); ++i) {
+		if (root_contains(roots[i], real) && (!found || roots[i]->len > found->len)) {
+			found = roots[i];
 		}
 	}
 
-	if (cwk_path_is_relative(target) || !strneq(target, "/root", 5)) {
-		return target_norm;
+	return found ? found->id : PATH_ROOT_NONE;
+}
+
+enum PathRoot path_get_root_at(const int dirfd) {
+	if (dirfd == g_roots.install.fd) {
+		return PATH_ROOT_INSTALL;
+	} else if (dirfd == g_roots.data.fd) {
+		return PATH_ROOT_DATA;
+	} else if (dirfd == g_roots.run.fd) {
+		return PATH_ROOT_RUN;
 	}
 
-	target += 5;
+	return PATH_ROOT_NONE;
+}
 
-	if (target_len <= 5 || target[0] == '/') {
-		ret = build_path(target, &(struct PathSpec){ .match = "\x03",.redir = target, .root = g_roots.install });
+int path_get_root_fd(const enum PathRoot root) {
+	if (root == PATH_ROOT_INSTALL) {
+		return g_roots.install.fd;
+	} else if (root == PATH_ROOT_DATA) {
+		return g_roots.data.fd;
+	} else if (root == PATH_ROOT_RUN) {
+		return g_roots.run.fd;
 	}
-RET:
-	free(target_norm);
+
+	return -1;
+}
+
+void path_foreach_redirect(const char *dir, PathRedirectFunc func, void *data) {
+	const size_t dir_len = path_is_root(dir) ? 0 : strlen(dir);
+
+	const struct Rules *rules = rules_enter();
+
+	for (size_t i = 0; i < rules->n_specs; ++i) {
+		const struct PathSpec *spec = &rules->specs[i];
+		if (spec->match_len <= dir_len + 1 || spec->match[dir_len] != '/' || !strneq(spec->match, dir, dir_len)) {
+			continue;
+		}
+
+		const char *name = spec->match + dir_len + 1;
+		if (!strchr(name, '/')) {
+			func(data, name, spec->match);
+		}
+	}
+
+	rules_leave();
+}
+
+static bool is_parent(const char *target, const size_t len) {
+	const struct Rules *rules = rules_enter();
+
+	bool ret = false;
+	for (size_t i = 0; i < rules->n_parents && !ret; ++i) {
+		ret = rules->parents[i].len == len && strneq(rules->parents[i].path, target, len);
+	}
+
+	rules_leave();
 
 	return ret;
 }
+
+bool path_has_redirects(const char *target) {
+	return path_is_root(target) || is_parent(target, strlen(target));
+}
+
+bool path_parent_has_redirects(const char *target) {
+	const char *slash = strrchr(target, '/');
+	if (!slash) {
+		return false;
+	}
+
+	return slash == target || is_parent(target, (size_t)(slash - target));
+}
@@ -22,11 +22,74 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include <limits.h>
+
+#include <sys/types.h>
+
 #define PATH_ROOT_N_SYMLINK (6)
 
-bool path_init();
+// Read-only file in the mount root with the daemon's statistics.
+#define PATH_STATS_NAME ".stats"
+
+enum PathRoot {
+	PATH_ROOT_NONE,
+	PATH_ROOT_INSTALL,
+	PATH_ROOT_DATA,
+	PATH_ROOT_RUN
+};
+
+// How fsync() is honoured below a redirect: right away, coalesced with others into one syncfs() per filesystem,
+// or not at all, leaving the data to the kernel's writeback.
+enum PathDurability {
+	PATH_DURABILITY_STRICT,
+	PATH_DURABILITY_GROUP,
+	PATH_DURABILITY_RELAXED
+};
+
+typedef void (*PathRedirectFunc)(void *data, const char *name, const char *vpath);
+typedef void (*PathMatchFunc)(void *data, const char *vpath);
+
+// Opens the roots and loads the redirect specs from config, or uses the built-in ones when it's NULL.
+// In hybrid mode the whole-directory specs are presented as symlinks, see path_get_dir_link().
+bool path_init(const char *config, bool hybrid);
+
+// Loads config again and swaps in the new specs without blocking concurrent translations, then calls func
+// with the virtual paths of both the previous and the new specs. The previous specs are kept when the file doesn't parse.
+bool path_reload(PathMatchFunc func, void *data);
+
+// Calls func for every spec that redirects a direct child of dir.
+void path_foreach_redirect(const char *dir, PathRedirectFunc func, void *data);
+
+// Children of these directories may be redirected to a different root than their parent's.
+bool path_has_redirects(const char *target);
+bool path_parent_has_redirects(const char *target);
 
-char *path_get_real(const char *target);
+// Durability of the spec that redirects target, strict for anything else.
+enum PathDurability path_get_durability(const char *target);
+
+// Writes the real path for target into buf, normalizing it in place without touching the heap.
+// Returns the length of the real path or a negative errno value.
+ssize_t path_get_real(const char *target, char *buf, size_t size);
+
+// Like path_get_real(), but writes the path relative to the root it lives in and sets *dirfd to the root's
+// descriptor, for use with the *at() family of syscalls. Paths outside of the roots are paired with AT_FDCWD.
+ssize_t path_get_real_at(const char *target, char *buf, size_t size, int *dirfd);
+
+// In hybrid mode, writes the absolute real directory into buf when target is the match of a whole-directory spec,
+// so that it can be presented as a symlink the kernel resolves without us. Returns 0 for anything else.
+ssize_t path_get_dir_link(const char *target, char *buf, size_t size);
+
+static inline bool path_is_dir_link(const char *target) {
+	char buf[PATH_MAX];
+	return path_get_dir_link(target, buf, sizeof(buf)) > 0;
+}
+
+// Tells which root a result of path_get_real() or path_get_real_at() lives in.
+enum PathRoot path_get_root(const char *real);
+enum PathRoot path_get_root_at(int dirfd);
+
+// O_PATH descriptor of a root, -1 for PATH_ROOT_NONE.
+int path_get_root_fd(enum PathRoot root);
 
 static inline const char *path_get_link(const char *target, const bool start_slash) {
 	const char *ret;
@@ -52,6 +115,7 @@ static inline const char *path_get_link(const char *target, const bool start_sla
 
 static inline const char **path_get_root_names() {
 	static const char *names[] = {
+		PATH_STATS_NAME,
 		"bin",
 		"bin32",
 		"bin64",
@@ -67,6 +131,7 @@ static inline const char **path_get_root_names() {
 
 static inline bool path_is_fixed(const char *target) {
 	if (streq(target, "/") ||
+		streq(target, "/" PATH_STATS_NAME) ||
 		streq(target, "/bin") ||
 		streq(target, "/bin32") ||
 		streq(target, "/bin64") ||
@@ -80,6 +145,10 @@ static inline bool path_is_fixed(const char *target) {
 	return false;
 }
 
+static inline bool path_is_stats(const char *target) {
+	return streq(target, "/" PATH_STATS_NAME);
+}
+
 static inline bool path_is_root(const char *target) {
 	return streq(target, "/");
 }
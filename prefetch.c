@@ -0,0 +1,484 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "prefetch.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define N_WORKERS (4)
+#define N_BUCKETS (1024)
+// Descriptors above this aren't tracked, Steam's startup stays far below.
+#define MAX_FDS (4096)
+#define MAX_RANGES (8)
+// Reads closer than this to a known range extend it instead of starting a new one.
+#define RANGE_GAP (256 * 1024)
+// Files that were opened but never read, e.g. with passthrough, are warmed up to this size.
+#define WHOLE_FILE_MAX (64 * 1024 * 1024)
+
+struct Range {
+	uint64_t off;
+	uint64_t len;
+};
+
+struct Entry {
+	struct Entry *next;
+	size_t n_ranges;
+	struct Range ranges[MAX_RANGES];
+	char path[];
+};
+
+struct EntryList {
+	struct Entry **entries;
+	size_t len;
+	size_t cap;
+};
+
+static struct {
+	int fd;
+	char *path;
+	unsigned int window;
+
+	struct EntryList profile;
+	size_t next;
+	pthread_t workers[N_WORKERS];
+	size_t n_workers;
+
+	bool learning;
+	bool stop;
+	struct EntryList learned;
+	struct Entry *buckets[N_BUCKETS];
+	struct Entry *by_fd[MAX_FDS];
+	pthread_t learner;
+	bool learner_running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} g_prefetch = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static inline size_t hash_path(const char *path) {
+	// FNV-1a.
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (; *path; ++path) {
+		hash = (hash ^ (unsigned char)*path) * 0x100000001B3ull;
+	}
+
+	return (size_t)(hash ^ (hash >> 32)) % N_BUCKETS;
+}
+
+static struct Entry *entry_new(struct EntryList *list, const char *path, const size_t len) {
+	if (list->len == list->cap) {
+		const size_t cap = list->cap ? list->cap * 2 : 256;
+		struct Entry **entries = realloc(list->entries, cap * sizeof(*entries));
+		if (!entries) {
+			return NULL;
+		}
+
+		list->entries = entries;
+		list->cap = cap;
+	}
+
+	struct Entry *entry = malloc(sizeof(*entry) + len + 1);
+	if (!entry) {
+		return NULL;
+	}
+
+	entry->next = NULL;
+	entry->n_ranges = 0;
+	memcpy(entry->path, path, len);
+	entry->path[len] = '\0';
+
+	list->entries[list->len++] = entry;
+
+	return entry;
+}
+
+static void list_free(struct EntryList *list) {
+	for (size_t i = 0; i < list->len; ++i) {
+		free(list->entries[i]);
+	}
+
+	free(list->entries);
+	*list = (struct EntryList){ 0 };
+}
+
+static void entry_add_range(struct Entry *entry, const uint64_t off, const uint64_t len) {
+	const uint64_t end = off + len;
+
+	for (size_t i = 0; i < entry->n_ranges; ++i) {
+		struct Range *range = &entry->ranges[i];
+		const uint64_t range_end = range->off + range->len;
+
+		if (off <= range_end + RANGE_GAP && end + RANGE_GAP >= range->off) {
+			const uint64_t new_off = off < range->off ? off : range->off;
+			range->len = (end > range_end ? end : range_end) - new_off;
+			range->off = new_off;
+			return;
+		}
+	}
+
+	if (entry->n_ranges < MAX_RANGES) {
+		entry->ranges[entry->n_ranges++] = (struct Range){ .off = off, .len = len };
+		return;
+	}
+
+	// Out of slots, the last range grows to cover the new one.
+	struct Range *last = &entry->ranges[MAX_RANGES - 1];
+	const uint64_t last_end = last->off + last->len;
+	const uint64_t new_off = off < last->off ? off : last->off;
+	last->len = (end > last_end ? end : last_end) - new_off;
+	last->off = new_off;
+}
+
+// Lines hold the ranges as "offset+length" separated by spaces, a tab and the absolute path. No ranges means the whole file.
+static bool parse_line(char *line) {
+	char *tab = strchr(line, '\t');
+	if (!tab || tab[1] != '/') {
+		return false;
+	}
+
+	char *path = tab + 1;
+	const size_t len = strcspn(path, "\n");
+
+	struct Entry *entry = entry_new(&g_prefetch.profile, path, len);
+	if (!entry) {
+		return false;
+	}
+
+	*tab = '\0';
+
+	for (char *ptr = line; *ptr;) {
+		char *end;
+		const uint64_t off = strtoull(ptr, &end, 10);
+		if (*end != '+') {
+			break;
+		}
+
+		const uint64_t range_len = strtoull(end + 1, &end, 10);
+		entry_add_range(entry, off, range_len);
+
+		ptr = end + strspn(end, " ");
+	}
+
+	return true;
+}
+
+static bool load_profile() {
+	FILE *file = fdopen(dup(g_prefetch.fd), "r");
+	if (!file) {
+		return false;
+	}
+
+	char *line = NULL;
+	size_t size = 0;
+	size_t n_invalid = 0;
+
+	while (getline(&line, &size, file) != -1) {
+		if (line[0] != '#' && line[0] != '\n' && !parse_line(line)) {
+			++n_invalid;
+		}
+	}
+
+	free(line);
+	fclose(file);
+
+	if (n_invalid) {
+		fprintf(stderr, "Ignored %zu invalid lines in the prefetch profile.\n", n_invalid);
+	}
+
+	return true;
+}
+
+// Written next to the profile and renamed into place, so that a crash never leaves it truncated.
+static void save_profile() {
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", g_prefetch.path) >= (int)sizeof(tmp)) {
+		return;
+	}
+
+	const int fd = mkstemp(tmp);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to rewrite the prefetch profile: %s\n", strerror(errno));
+		return;
+	}
+
+	FILE *file = fdopen(fd, "w");
+	if (!file) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	fprintf(file, "# Files read during the first %u seconds after mounting, in order.\n", g_prefetch.window);
+
+	for (size_t i = 0; i < g_prefetch.learned.len; ++i) {
+		const struct Entry *entry = g_prefetch.learned.entries[i];
+
+		for (size_t j = 0; j < entry->n_ranges; ++j) {
+			fprintf(file, "%s%" PRIu64 "+%" PRIu64, j ? " " : "", entry->ranges[j].off, entry->ranges[j].len);
+		}
+
+		fprintf(file, "\t%s\n", entry->path);
+	}
+
+	const bool ok = fchmod(fd, 0644) == 0 && fclose(file) == 0 && rename(tmp, g_prefetch.path) == 0;
+	if (!ok) {
+		fprintf(stderr, "Failed to write the prefetch profile: %s\n", strerror(errno));
+		unlink(tmp);
+	}
+}
+
+static void warm(const struct Entry *entry) {
+	const int fd = open(entry->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd == -1) {
+		return;
+	}
+
+	struct Range whole;
+	const struct Range *ranges = entry->ranges;
+	size_t n_ranges = entry->n_ranges;
+
+	if (!n_ranges) {
+		struct stat st;
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+			close(fd);
+			return;
+		}
+
+		whole = (struct Range){ .off = 0, .len = (uint64_t)st.st_size < WHOLE_FILE_MAX ? (uint64_t)st.st_size : WHOLE_FILE_MAX };
+		ranges = &whole;
+		n_ranges = 1;
+	}
+
+	for (size_t i = 0; i < n_ranges; ++i) {
+		// readahead() only works on filesystems backed by the page cache in the usual way, fadvise covers the rest.
+		if (readahead(fd, (off64_t)ranges[i].off, ranges[i].len) == -1) {
+			posix_fadvise(fd, (off_t)ranges[i].off, (off_t)ranges[i].len, POSIX_FADV_WILLNEED);
+		}
+	}
+
+	close(fd);
+}
+
+static void *worker_thread(void *arg) {
+	(void)arg;
+
+	while (!__atomic_load_n(&g_prefetch.stop, __ATOMIC_RELAXED)) {
+		const size_t idx = __atomic_fetch_add(&g_prefetch.next, 1, __ATOMIC_RELAXED);
+		if (idx >= g_prefetch.profile.len) {
+			break;
+		}
+
+		warm(g_prefetch.profile.entries[idx]);
+	}
+
+	return NULL;
+}
+
+// Called with the lock held. A window cut short by unmounting only saw part of the startup, the profile is kept.
+static void finish_learning(const bool complete) {
+	if (!g_prefetch.learning) {
+		return;
+	}
+
+	__atomic_store_n(&g_prefetch.learning, false, __ATOMIC_RELAXED);
+
+	if (complete) {
+		save_profile();
+	}
+
+	list_free(&g_prefetch.learned);
+	memset(g_prefetch.buckets, 0, sizeof(g_prefetch.buckets));
+	memset(g_prefetch.by_fd, 0, sizeof(g_prefetch.by_fd));
+}
+
+static void *learner_thread(void *arg) {
+	(void)arg;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += g_prefetch.window;
+
+	pthread_mutex_lock(&g_prefetch.lock);
+
+	bool complete = false;
+	while (!g_prefetch.stop && !complete) {
+		complete = pthread_cond_timedwait(&g_prefetch.cond, &g_prefetch.lock, &deadline) == ETIMEDOUT;
+	}
+
+	finish_learning(complete);
+
+	pthread_mutex_unlock(&g_prefetch.lock);
+
+	return NULL;
+}
+
+bool prefetch_init(const char *profile, const unsigned int window) {
+	g_prefetch.fd = open(profile, O_RDONLY | (window ? O_CREAT : 0) | O_CLOEXEC, 0644);
+	if (g_prefetch.fd == -1) {
+		fprintf(stderr, "Failed to open the prefetch profile \"%s\": %s\n", profile, strerror(errno));
+		return false;
+	}
+
+	g_prefetch.window = window;
+	g_prefetch.path = strdup(profile);
+
+	if (!g_prefetch.path || !load_profile()) {
+		fprintf(stderr, "Failed to read the prefetch profile \"%s\"!\n", profile);
+		free(g_prefetch.path);
+		g_prefetch.path = NULL;
+		close(g_prefetch.fd);
+		g_prefetch.fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+void prefetch_start() {
+	if (g_prefetch.fd == -1) {
+		return;
+	}
+
+	const size_t n_workers = g_prefetch.profile.len < N_WORKERS ? g_prefetch.profile.len : N_WORKERS;
+	for (size_t i = 0; i < n_workers; ++i) {
+		if (pthread_create(&g_prefetch.workers[g_prefetch.n_workers], NULL, worker_thread, NULL) == 0) {
+			++g_prefetch.n_workers;
+		}
+	}
+
+	if (!g_prefetch.window) {
+		return;
+	}
+
+	__atomic_store_n(&g_prefetch.learning, true, __ATOMIC_RELAXED);
+
+	if (pthread_create(&g_prefetch.learner, NULL, learner_thread, NULL) == 0) {
+		g_prefetch.learner_running = true;
+	} else {
+		fprintf(stderr, "Failed to start the prefetch learner thread!\n");
+		__atomic_store_n(&g_prefetch.learning, false, __ATOMIC_RELAXED);
+	}
+}
+
+void prefetch_stop() {
+	if (g_prefetch.fd == -1) {
+		return;
+	}
+
+	pthread_mutex_lock(&g_prefetch.lock);
+	__atomic_store_n(&g_prefetch.stop, true, __ATOMIC_RELAXED);
+	pthread_cond_signal(&g_prefetch.cond);
+	pthread_mutex_unlock(&g_prefetch.lock);
+
+	for (size_t i = 0; i < g_prefetch.n_workers; ++i) {
+		pthread_join(g_prefetch.workers[i], NULL);
+	}
+
+	if (g_prefetch.learner_running) {
+		pthread_join(g_prefetch.learner, NULL);
+	}
+
+	list_free(&g_prefetch.profile);
+
+	free(g_prefetch.path);
+	g_prefetch.path = NULL;
+
+	close(g_prefetch.fd);
+	g_prefetch.fd = -1;
+}
+
+void prefetch_note_open(const int fd, const int flags) {
+	if (!__atomic_load_n(&g_prefetch.learning, __ATOMIC_RELAXED) || fd < 0 || fd >= MAX_FDS ||
+		(flags & O_ACCMODE) == O_WRONLY) {
+		return;
+	}
+
+	char procname[64];
+	snprintf(procname, sizeof(procname), "/proc/self/fd/%i", fd);
+
+	char path[PATH_MAX];
+	const ssize_t len = readlink(procname, path, sizeof(path) - 1);
+	if (len <= 0 || path[0] != '/') {
+		return;
+	}
+
+	path[len] = '\0';
+
+	pthread_mutex_lock(&g_prefetch.lock);
+
+	if (!g_prefetch.learning) {
+		goto UNLOCK;
+	}
+
+	struct Entry **bucket = &g_prefetch.buckets[hash_path(path)];
+
+	struct Entry *entry = *bucket;
+	while (entry && strcmp(entry->path, path) != 0) {
+		entry = entry->next;
+	}
+
+	if (!entry) {
+		entry = entry_new(&g_prefetch.learned, path, (size_t)len);
+		if (!entry) {
+			goto UNLOCK;
+		}
+
+		entry->next = *bucket;
+		*bucket = entry;
+	}
+
+	g_prefetch.by_fd[fd] = entry;
+
+UNLOCK:
+	pthread_mutex_unlock(&g_prefetch.lock);
+}
+
+void prefetch_note_read(const int fd, const off_t off, const size_t size) {
+	if (!__atomic_load_n(&g_prefetch.learning, __ATOMIC_RELAXED) || fd < 0 || fd >= MAX_FDS || off < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&g_prefetch.lock);
+
+	if (g_prefetch.learning && g_prefetch.by_fd[fd]) {
+		entry_add_range(g_prefetch.by_fd[fd], (uint64_t)off, size);
+	}
+
+	pthread_mutex_unlock(&g_prefetch.lock);
+}
+
+void prefetch_note_close(const int fd) {
+	if (!__atomic_load_n(&g_prefetch.learning, __ATOMIC_RELAXED) || fd < 0 || fd >= MAX_FDS) {
+		return;
+	}
+
+	pthread_mutex_lock(&g_prefetch.lock);
+	g_prefetch.by_fd[fd] = NULL;
+	pthread_mutex_unlock(&g_prefetch.lock);
+}
@@ -0,0 +1,38 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+// Loads the profile and keeps it open for rewriting, before daemonizing changes the working directory.
+// A window of 0 only warms the cache and leaves the profile alone.
+bool prefetch_init(const char *profile, unsigned int window);
+
+// Starts warming the files from the profile and recording the ones the first window seconds touch.
+void prefetch_start();
+
+// Saves what was recorded so far, if the window is still open, and waits for the threads.
+void prefetch_stop();
+
+// Called by the backends with the backing descriptors of the files they serve, cheap once the window closed.
+void prefetch_note_open(int fd, int flags);
+void prefetch_note_read(int fd, off_t off, size_t size);
+void prefetch_note_close(int fd);
@@ -0,0 +1,610 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "snapshot.h"
+
+#include "str.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define SNAPSHOT_MAGIC "SXESNAP"
+#define SNAPSHOT_VERSION (1)
+#define NO_LINK (UINT32_MAX)
+#define MAX_GROUPS (64)
+
+// Native byte order and layout, the version is bumped whenever they change.
+struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_entries;
+	uint64_t root_dev;
+	uint64_t root_ino;
+	uint64_t entries_off;
+	uint64_t children_off;
+	uint64_t strings_off;
+	uint64_t strings_size;
+	uint64_t size;
+};
+
+// Sorted by path, the root comes first with an empty one. Strings are offsets into the NUL-terminated string table.
+struct SnapshotEntry {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t blocks;
+	uint64_t rdev;
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t atime_nsec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t nlink;
+	uint32_t blksize;
+	uint32_t path;
+	uint32_t path_len;
+	// Last component of the path.
+	uint32_t name;
+	uint32_t link;
+	// Range of the children table, which holds entry indices.
+	uint32_t children;
+	uint32_t n_children;
+};
+
+struct BuildEntry {
+	char *path;
+	char *link;
+	struct stat st;
+	struct BuildEntry *parent;
+	uint32_t index;
+	uint32_t n_children;
+	uint32_t children;
+	uint32_t next_child;
+};
+
+struct Builder {
+	struct BuildEntry **entries;
+	size_t len;
+	size_t cap;
+};
+
+static struct {
+	const char *map;
+	size_t size;
+	const struct SnapshotHeader *header;
+	const struct SnapshotEntry *entries;
+	const uint32_t *children;
+	const char *strings;
+
+	uid_t uid;
+	gid_t gid;
+	gid_t groups[MAX_GROUPS];
+	int n_groups;
+} g_snapshot;
+
+static struct BuildEntry *builder_add(struct Builder *builder, char *path, const struct stat *st, struct BuildEntry *parent) {
+	if (builder->len == builder->cap) {
+		const size_t cap = builder->cap ? builder->cap * 2 : 1024;
+		struct BuildEntry **entries = realloc(builder->entries, cap * sizeof(*entries));
+		if (!entries) {
+			free(path);
+			return NULL;
+		}
+
+		builder->entries = entries;
+		builder->cap = cap;
+	}
+
+	struct BuildEntry *entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		free(path);
+		return NULL;
+	}
+
+	entry->path = path;
+	entry->st = *st;
+	entry->parent = parent;
+	builder->entries[builder->len++] = entry;
+
+	return entry;
+}
+
+static void builder_free(struct Builder *builder) {
+	for (size_t i = 0; i < builder->len; ++i) {
+		free(builder->entries[i]->path);
+		free(builder->entries[i]->link);
+		free(builder->entries[i]);
+	}
+
+	free(builder->entries);
+}
+
+// Symlinks are recorded but not followed, mount points inside the tree are indexed like any other directory.
+static bool walk(struct Builder *builder, const int fd, struct BuildEntry *dir) {
+	DIR *stream = fdopendir(fd);
+	if (!stream) {
+		close(fd);
+		return false;
+	}
+
+	bool ok = true;
+
+	while (ok) {
+		errno = 0;
+		const struct dirent *ent = readdir(stream);
+		if (!ent) {
+			ok = errno == 0;
+			break;
+		}
+
+		if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+			continue;
+		}
+
+		struct stat st;
+		if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			// Gone in the meantime.
+			continue;
+		}
+
+		char *path = malloc(strlen(dir->path) + strlen(ent->d_name) + 2);
+		if (!path) {
+			ok = false;
+			break;
+		}
+
+		sprintf(path, "%s%s%s", dir->path, *dir->path ? "/" : "", ent->d_name);
+
+		struct BuildEntry *entry = builder_add(builder, path, &st, dir);
+		if (!entry) {
+			ok = false;
+			break;
+		}
+
+		if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			const ssize_t len = readlinkat(fd, ent->d_name, target, sizeof(target) - 1);
+			if (len >= 0) {
+				target[len] = '\0';
+				entry->link = strdup(target);
+			}
+
+		} else if (S_ISDIR(st.st_mode)) {
+			// Unreadable directories are left out, lookups below them go to the tree.
+			const int child_fd = openat(fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			ok = child_fd == -1 || walk(builder, child_fd, entry);
+		}
+	}
+
+	closedir(stream);
+
+	return ok;
+}
+
+static int compare_paths(const void *a, const void *b) {
+	return strcmp((*(struct BuildEntry *const *)a)->path, (*(struct BuildEntry *const *)b)->path);
+}
+
+static void fill_entry(struct SnapshotEntry *out, const struct BuildEntry *entry) {
+	const struct stat *st = &entry->st;
+
+	*out = (struct SnapshotEntry){
+		.dev = st->st_dev,
+		.ino = st->st_ino,
+		.size = (uint64_t)st->st_size,
+		.blocks = (uint64_t)st->st_blocks,
+		.rdev = st->st_rdev,
+		.atime = st->st_atim.tv_sec,
+		.mtime = st->st_mtim.tv_sec,
+		.ctime = st->st_ctim.tv_sec,
+		.atime_nsec = (uint32_t)st->st_atim.tv_nsec,
+		.mtime_nsec = (uint32_t)st->st_mtim.tv_nsec,
+		.ctime_nsec = (uint32_t)st->st_ctim.tv_nsec,
+		.mode = st->st_mode,
+		.uid = st->st_uid,
+		.gid = st->st_gid,
+		.nlink = (uint32_t)st->st_nlink,
+		.blksize = (uint32_t)st->st_blksize,
+		.link = NO_LINK,
+		.children = entry->children,
+		.n_children = entry->n_children
+	};
+}
+
+static size_t align8(const size_t size) {
+	return (size + 7) & ~(size_t)7;
+}
+
+// Lays the snapshot out in memory, the caller frees the buffer.
+static char *serialize(struct Builder *builder, const struct stat *root, size_t *size) {
+	struct BuildEntry **entries = builder->entries;
+	const size_t n = builder->len;
+
+	qsort(entries, n, sizeof(*entries), compare_paths);
+
+	size_t strings_size = 0;
+	for (size_t i = 0; i < n; ++i) {
+		entries[i]->index = (uint32_t)i;
+		strings_size += strlen(entries[i]->path) + 1 + (entries[i]->link ? strlen(entries[i]->link) + 1 : 0);
+		if (entries[i]->parent) {
+			++entries[i]->parent->n_children;
+		}
+	}
+
+	uint32_t next = 0;
+	for (size_t i = 0; i < n; ++i) {
+		entries[i]->children = entries[i]->next_child = next;
+		next += entries[i]->n_children;
+	}
+
+	if (strings_size > UINT32_MAX) {
+		return NULL;
+	}
+
+	const size_t entries_off = align8(sizeof(struct SnapshotHeader));
+	const size_t children_off = entries_off + n * sizeof(struct SnapshotEntry);
+	const size_t strings_off = align8(children_off + next * sizeof(uint32_t));
+	*size = strings_off + strings_size;
+
+	char *buf = calloc(1, *size);
+	if (!buf) {
+		return NULL;
+	}
+
+	struct SnapshotHeader *header = (struct SnapshotHeader *)buf;
+	memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header->version = SNAPSHOT_VERSION;
+	header->n_entries = (uint32_t)n;
+	header->root_dev = root->st_dev;
+	header->root_ino = root->st_ino;
+	header->entries_off = entries_off;
+	header->children_off = children_off;
+	header->strings_off = strings_off;
+	header->strings_size = strings_size;
+	header->size = *size;
+
+	struct SnapshotEntry *out = (struct SnapshotEntry *)(buf + entries_off);
+	uint32_t *children = (uint32_t *)(buf + children_off);
+	char *strings = buf + strings_off;
+	size_t str = 0;
+
+	// Sorted by path, so every directory's children come out sorted by name.
+	for (size_t i = 0; i < n; ++i) {
+		const struct BuildEntry *entry = entries[i];
+		fill_entry(&out[i], entry);
+
+		const size_t path_len = strlen(entry->path);
+		const char *slash = strrchr(entry->path, '/');
+		out[i].path = (uint32_t)str;
+		out[i].path_len = (uint32_t)path_len;
+		out[i].name = (uint32_t)(str + (slash ? (size_t)(slash - entry->path) + 1 : 0));
+		memcpy(strings + str, entry->path, path_len + 1);
+		str += path_len + 1;
+
+		if (entry->link) {
+			out[i].link = (uint32_t)str;
+			memcpy(strings + str, entry->link, strlen(entry->link) + 1);
+			str += strlen(entry->link) + 1;
+		}
+
+		if (entry->parent) {
+			children[entry->parent->next_child++] = entry->index;
+		}
+	}
+
+	return buf;
+}
+
+static bool write_file(const char *file, const char *buf, const size_t size) {
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file) >= (int)sizeof(tmp)) {
+		return false;
+	}
+
+	// Other mounts may be writing the same file, each one renames its own copy into place.
+	const int fd = mkstemp(tmp);
+	if (fd == -1) {
+		return false;
+	}
+
+	size_t done = 0;
+	while (done < size) {
+		const ssize_t ret = write(fd, buf + done, size - done);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		} else if (ret <= 0) {
+			break;
+		}
+
+		done += (size_t)ret;
+	}
+
+	const bool ok = done == size && fchmod(fd, 0644) == 0 && close(fd) == 0 && rename(tmp, file) == 0;
+	if (!ok) {
+		unlink(tmp);
+	}
+
+	return ok;
+}
+
+static bool build(const char *file, const int install_fd, const struct stat *root) {
+	struct Builder builder = { 0 };
+
+	char *path = strdup("");
+	struct BuildEntry *top = path ? builder_add(&builder, path, root, NULL) : NULL;
+	const int fd = top ? openat(install_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+
+	size_t size = 0;
+	char *buf = NULL;
+	if (fd != -1 && walk(&builder, fd, top)) {
+		buf = serialize(&builder, root, &size);
+	}
+
+	builder_free(&builder);
+
+	const bool ok = buf && write_file(file, buf, size);
+	if (ok) {
+		printf("Indexed %zu bytes of install tree metadata into %s\n", size, file);
+	}
+
+	free(buf);
+
+	return ok;
+}
+
+static inline const char *get_string(const uint32_t off) {
+	return g_snapshot.strings + off;
+}
+
+// Terminator of the string at off, NULL if it doesn't end within the string table.
+static const char *string_end(const uint32_t off) {
+	if (off >= g_snapshot.header->strings_size) {
+		return NULL;
+	}
+
+	return memchr(get_string(off), '\0', g_snapshot.header->strings_size - off);
+}
+
+// Checks the layout, and that no directory was modified since it was indexed: package managers replace files by
+// renaming new ones into place, which changes the directory.
+static bool validate(const int install_fd, const struct stat *root) {
+	const struct SnapshotHeader *header = g_snapshot.header;
+
+	if (g_snapshot.size < sizeof(*header) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+		header->version != SNAPSHOT_VERSION || header->size != g_snapshot.size || !header->n_entries ||
+		header->root_dev != root->st_dev || header->root_ino != root->st_ino ||
+		header->entries_off + (uint64_t)header->n_entries * sizeof(struct SnapshotEntry) > header->children_off ||
+		header->children_off + (uint64_t)(header->n_entries - 1) * sizeof(uint32_t) > header->strings_off ||
+		header->strings_off + header->strings_size != header->size) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < header->n_entries; ++i) {
+		const struct SnapshotEntry *entry = &g_snapshot.entries[i];
+		if (string_end(entry->path) != get_string(entry->path) + entry->path_len || entry->name < entry->path ||
+			entry->name > entry->path + entry->path_len || (entry->link != NO_LINK && !string_end(entry->link)) ||
+			(uint64_t)entry->children + entry->n_children > header->n_entries - 1) {
+			return false;
+		}
+
+		if (!S_ISDIR(entry->mode)) {
+			continue;
+		}
+
+		struct stat st;
+		if (fstatat(install_fd, *get_string(entry->path) ? get_string(entry->path) : ".", &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+			st.st_ino != entry->ino || st.st_mtim.tv_sec != entry->mtime || st.st_mtim.tv_nsec != entry->mtime_nsec ||
+			st.st_ctim.tv_sec != entry->ctime || st.st_ctim.tv_nsec != entry->ctime_nsec) {
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i + 1 < header->n_entries; ++i) {
+		if (g_snapshot.children[i] >= header->n_entries) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void unmap() {
+	if (g_snapshot.map) {
+		munmap((void *)g_snapshot.map, g_snapshot.size);
+	}
+
+	g_snapshot.map = NULL;
+	g_snapshot.header = NULL;
+}
+
+static bool map(const char *file, const int install_fd, const struct stat *root) {
+	const int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct SnapshotHeader)) {
+		close(fd);
+		return false;
+	}
+
+	void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED) {
+		return false;
+	}
+
+	g_snapshot.map = addr;
+	g_snapshot.size = (size_t)st.st_size;
+	g_snapshot.header = addr;
+	g_snapshot.entries = (const struct SnapshotEntry *)(g_snapshot.map + g_snapshot.header->entries_off);
+	g_snapshot.children = (const uint32_t *)(g_snapshot.map + g_snapshot.header->children_off);
+	g_snapshot.strings = g_snapshot.map + g_snapshot.header->strings_off;
+
+	if (!validate(install_fd, root)) {
+		unmap();
+		return false;
+	}
+
+	return true;
+}
+
+bool snapshot_init(const char *file, const int install_fd) {
+	struct stat root;
+	if (fstatat(install_fd, ".", &root, 0) == -1) {
+		printf("Failed to stat the install directory: %s\n", strerror(errno));
+		return false;
+	}
+
+	if (!map(file, install_fd, &root)) {
+		if (!build(file, install_fd, &root)) {
+			printf("Failed to index the install directory into %s: %s\n", file, strerror(errno));
+			return false;
+		}
+
+		if (!map(file, install_fd, &root)) {
+			printf("The install directory changed while it was indexed, not using %s\n", file);
+			return false;
+		}
+	}
+
+	g_snapshot.uid = getuid();
+	g_snapshot.gid = getgid();
+	g_snapshot.n_groups = getgroups(MAX_GROUPS, g_snapshot.groups);
+
+	return true;
+}
+
+bool snapshot_active() {
+	return g_snapshot.header != NULL;
+}
+
+const struct SnapshotEntry *snapshot_find(const char *real) {
+	if (!g_snapshot.header) {
+		return NULL;
+	}
+
+	if (streq(real, ".")) {
+		real = "";
+	}
+
+	size_t lo = 0;
+	size_t hi = g_snapshot.header->n_entries;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const int cmp = strcmp(get_string(g_snapshot.entries[mid].path), real);
+		if (cmp == 0) {
+			return &g_snapshot.entries[mid];
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+void snapshot_stat(const struct SnapshotEntry *entry, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+
+	st->st_dev = entry->dev;
+	st->st_ino = entry->ino;
+	st->st_mode = entry->mode;
+	st->st_nlink = entry->nlink;
+	st->st_uid = entry->uid;
+	st->st_gid = entry->gid;
+	st->st_rdev = entry->rdev;
+	st->st_size = (off_t)entry->size;
+	st->st_blksize = entry->blksize;
+	st->st_blocks = (blkcnt_t)entry->blocks;
+	st->st_atim = (struct timespec){ .tv_sec = entry->atime, .tv_nsec = entry->atime_nsec };
+	st->st_mtim = (struct timespec){ .tv_sec = entry->mtime, .tv_nsec = entry->mtime_nsec };
+	st->st_ctim = (struct timespec){ .tv_sec = entry->ctime, .tv_nsec = entry->ctime_nsec };
+}
+
+mode_t snapshot_mode(const struct SnapshotEntry *entry) {
+	return entry->mode;
+}
+
+const char *snapshot_link(const struct SnapshotEntry *entry) {
+	return entry->link != NO_LINK ? get_string(entry->link) : NULL;
+}
+
+static bool in_group(const gid_t gid) {
+	if (gid == g_snapshot.gid) {
+		return true;
+	}
+
+	for (int i = 0; i < g_snapshot.n_groups; ++i) {
+		if (g_snapshot.groups[i] == gid) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int snapshot_access(const struct SnapshotEntry *entry, const int mask) {
+	if (mask == F_OK) {
+		return 0;
+	}
+
+	const mode_t mode = entry->mode;
+	mode_t granted;
+
+	if (g_snapshot.uid == 0) {
+		// Root may read and write anything, and execute what anyone may execute.
+		granted = R_OK | W_OK | ((S_ISDIR(mode) || (mode & (S_IXUSR | S_IXGRP | S_IXOTH))) ? X_OK : 0);
+	} else if (entry->uid == g_snapshot.uid) {
+		granted = (mode >> 6) & 7;
+	} else if (in_group(entry->gid)) {
+		granted = (mode >> 3) & 7;
+	} else {
+		granted = mode & 7;
+	}
+
+	return ((mode_t)mask & ~granted) ? EACCES : 0;
+}
+
+size_t snapshot_n_children(const struct SnapshotEntry *entry) {
+	return entry->n_children;
+}
+
+const struct SnapshotEntry *snapshot_child(const struct SnapshotEntry *entry, const size_t i) {
+	return &g_snapshot.entries[g_snapshot.children[entry->children + i]];
+}
+
+const char *snapshot_name(const struct SnapshotEntry *entry) {
+	return get_string(entry->name);
+}
@@ -0,0 +1,50 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/stat.h>
+
+struct SnapshotEntry;
+
+// Loads the metadata snapshot of the install tree from file, or indexes the tree rooted at install_fd and writes it
+// there when the file is missing or the tree changed since. The tree is assumed not to change while mounted.
+bool snapshot_init(const char *file, int install_fd);
+
+// Whether snapshot_init() succeeded, changes to the install tree have to be refused from then on.
+bool snapshot_active();
+
+// Looks up a path relative to the install root, as written by path_get_real_at(). Paths below a symlink aren't
+// indexed, so NULL only means that the snapshot can't answer.
+const struct SnapshotEntry *snapshot_find(const char *real);
+
+void snapshot_stat(const struct SnapshotEntry *entry, struct stat *st);
+mode_t snapshot_mode(const struct SnapshotEntry *entry);
+
+// Target of a symlink, NULL for anything else.
+const char *snapshot_link(const struct SnapshotEntry *entry);
+
+// faccessat() against the recorded owner and mode, with the daemon's credentials.
+int snapshot_access(const struct SnapshotEntry *entry, int mask);
+
+// Children of a directory, sorted by name.
+size_t snapshot_n_children(const struct SnapshotEntry *entry);
+const struct SnapshotEntry *snapshot_child(const struct SnapshotEntry *entry, size_t i);
+const char *snapshot_name(const struct SnapshotEntry *entry);
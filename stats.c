@@ -0,0 +1,337 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+
+// Bucket N counts the operations that took less than 2^N nanoseconds, the last one everything slower.
+#define N_BUCKETS (36)
+
+struct OpCounters {
+	uint64_t count[STATS_N_CLASSES];
+	uint64_t total_ns[STATS_N_CLASSES];
+	uint64_t buckets[N_BUCKETS];
+};
+
+// Written by a single thread at a time without atomic read-modify-writes, read by the formatter.
+// Shards are never freed: when their thread exits they are handed to the next one, keeping the totals intact.
+struct Shard {
+	struct Shard *next;
+	struct Shard *next_free;
+	struct OpCounters ops[STATS_N_OPS];
+};
+
+static const char *g_op_names[STATS_N_OPS] = {
+	[STATS_OP_LOOKUP] = "lookup",
+	[STATS_OP_FORGET] = "forget",
+	[STATS_OP_GETATTR] = "getattr",
+	[STATS_OP_SETATTR] = "setattr",
+	[STATS_OP_READLINK] = "readlink",
+	[STATS_OP_MKNOD] = "mknod",
+	[STATS_OP_MKDIR] = "mkdir",
+	[STATS_OP_UNLINK] = "unlink",
+	[STATS_OP_RMDIR] = "rmdir",
+	[STATS_OP_SYMLINK] = "symlink",
+	[STATS_OP_RENAME] = "rename",
+	[STATS_OP_LINK] = "link",
+	[STATS_OP_CHMOD] = "chmod",
+	[STATS_OP_CHOWN] = "chown",
+	[STATS_OP_TRUNCATE] = "truncate",
+	[STATS_OP_UTIMENS] = "utimens",
+	[STATS_OP_OPEN] = "open",
+	[STATS_OP_CREATE] = "create",
+	[STATS_OP_READ] = "read",
+	[STATS_OP_WRITE] = "write",
+	[STATS_OP_FLUSH] = "flush",
+	[STATS_OP_RELEASE] = "release",
+	[STATS_OP_FSYNC] = "fsync",
+	[STATS_OP_OPENDIR] = "opendir",
+	[STATS_OP_READDIR] = "readdir",
+	[STATS_OP_READDIRPLUS] = "readdirplus",
+	[STATS_OP_RELEASEDIR] = "releasedir",
+	[STATS_OP_FSYNCDIR] = "fsyncdir",
+	[STATS_OP_STATFS] = "statfs",
+	[STATS_OP_ACCESS] = "access",
+	[STATS_OP_SETXATTR] = "setxattr",
+	[STATS_OP_GETXATTR] = "getxattr",
+	[STATS_OP_LISTXATTR] = "listxattr",
+	[STATS_OP_REMOVEXATTR] = "removexattr",
+	[STATS_OP_FALLOCATE] = "fallocate",
+	[STATS_OP_COPY_FILE_RANGE] = "copy_file_range",
+	[STATS_OP_LSEEK] = "lseek"
+};
+
+static const char *g_class_names[STATS_N_CLASSES] = {
+	[STATS_CLASS_OTHER] = "other",
+	[STATS_CLASS_INSTALL] = "install",
+	[STATS_CLASS_DATA] = "data",
+	[STATS_CLASS_RUN] = "run",
+	[STATS_CLASS_FIXED] = "fixed"
+};
+
+static struct {
+	struct Shard *list;
+	struct Shard *free;
+	pthread_key_t key;
+	pthread_once_t once;
+	pthread_mutex_t lock;
+} g_stats = { .once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Cross-root moves, updated with atomics as they make progress.
+static struct {
+	uint64_t active;
+	uint64_t finished;
+	uint64_t total_bytes;
+	uint64_t copied_bytes;
+} g_moves;
+
+static __thread struct Shard *t_shard;
+static __thread enum StatsOp t_op = STATS_N_OPS;
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void bump(uint64_t *counter, const uint64_t value) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static void shard_release(void *arg) {
+	struct Shard *shard = arg;
+
+	pthread_mutex_lock(&g_stats.lock);
+	shard->next_free = g_stats.free;
+	g_stats.free = shard;
+	pthread_mutex_unlock(&g_stats.lock);
+}
+
+static void key_init() {
+	pthread_key_create(&g_stats.key, shard_release);
+}
+
+static struct Shard *shard_get() {
+	if (t_shard) {
+		return t_shard;
+	}
+
+	pthread_once(&g_stats.once, key_init);
+
+	pthread_mutex_lock(&g_stats.lock);
+
+	struct Shard *shard = g_stats.free;
+	if (shard) {
+		g_stats.free = shard->next_free;
+	} else if ((shard = calloc(1, sizeof(*shard)))) {
+		shard->next = g_stats.list;
+		__atomic_store_n(&g_stats.list, shard, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&g_stats.lock);
+
+	if (shard) {
+		pthread_setspecific(g_stats.key, shard);
+		t_shard = shard;
+	}
+
+	return shard;
+}
+
+struct StatsScope stats_scope_begin(const enum StatsOp op) {
+	t_op = op;
+
+	return (struct StatsScope){ .op = op, .cls = STATS_CLASS_FIXED, .start = now_ns() };
+}
+
+void stats_scope_end(const struct StatsScope *scope) {
+	t_op = STATS_N_OPS;
+
+	const uint64_t elapsed = now_ns() - scope->start;
+
+	struct Shard *shard = shard_get();
+	if (!shard) {
+		return;
+	}
+
+	size_t bucket = elapsed ? 64 - (size_t)__builtin_clzll(elapsed) : 0;
+	if (bucket >= N_BUCKETS) {
+		bucket = N_BUCKETS - 1;
+	}
+
+	struct OpCounters *counters = &shard->ops[scope->op];
+	bump(&counters->count[scope->cls], 1);
+	bump(&counters->total_ns[scope->cls], elapsed);
+	bump(&counters->buckets[bucket], 1);
+}
+
+static void sum_shards(struct OpCounters *ops) {
+	for (const struct Shard *shard = __atomic_load_n(&g_stats.list, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+		for (size_t op = 0; op < STATS_N_OPS; ++op) {
+			for (size_t cls = 0; cls < STATS_N_CLASSES; ++cls) {
+				ops[op].count[cls] += __atomic_load_n(&shard->ops[op].count[cls], __ATOMIC_RELAXED);
+				ops[op].total_ns[cls] += __atomic_load_n(&shard->ops[op].total_ns[cls], __ATOMIC_RELAXED);
+			}
+
+			for (size_t i = 0; i < N_BUCKETS; ++i) {
+				ops[op].buckets[i] += __atomic_load_n(&shard->ops[op].buckets[i], __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+static void write_stats(FILE *file) {
+	static struct OpCounters ops[STATS_N_OPS];
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+	pthread_mutex_lock(&lock);
+
+	memset(ops, 0, sizeof(ops));
+	sum_shards(ops);
+
+	fprintf(file, "# op class count total_us avg_ns\n");
+
+	for (size_t op = 0; op < STATS_N_OPS; ++op) {
+		for (size_t cls = 0; cls < STATS_N_CLASSES; ++cls) {
+			const uint64_t count = ops[op].count[cls];
+			if (!count) {
+				continue;
+			}
+
+			const uint64_t total = ops[op].total_ns[cls];
+			fprintf(file, "%s %s %llu %llu %llu\n", g_op_names[op], g_class_names[cls],
+					(unsigned long long)count, (unsigned long long)(total / 1000), (unsigned long long)(total / count));
+		}
+	}
+
+	fprintf(file, "\n# op latency histogram, bucket N counts the operations faster than 2^N ns\n");
+
+	for (size_t op = 0; op < STATS_N_OPS; ++op) {
+		bool empty = true;
+		for (size_t i = 0; i < N_BUCKETS; ++i) {
+			if (!ops[op].buckets[i]) {
+				continue;
+			}
+
+			if (empty) {
+				fprintf(file, "%s", g_op_names[op]);
+				empty = false;
+			}
+
+			fprintf(file, " %zu:%llu", i, (unsigned long long)ops[op].buckets[i]);
+		}
+
+		if (!empty) {
+			fprintf(file, "\n");
+		}
+	}
+
+	fprintf(file, "\n# moves active finished copied_bytes total_bytes\n");
+	fprintf(file, "moves %llu %llu %llu %llu\n",
+			(unsigned long long)__atomic_load_n(&g_moves.active, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&g_moves.finished, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&g_moves.copied_bytes, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&g_moves.total_bytes, __ATOMIC_RELAXED));
+
+	pthread_mutex_unlock(&lock);
+}
+
+void stats_move_begin(const uint64_t bytes) {
+	__atomic_add_fetch(&g_moves.active, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_moves.total_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_move_progress(const uint64_t bytes) {
+	__atomic_add_fetch(&g_moves.copied_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_move_end() {
+	__atomic_sub_fetch(&g_moves.active, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_moves.finished, 1, __ATOMIC_RELAXED);
+}
+
+enum StatsOp stats_current_op() {
+	return t_op;
+}
+
+const char *stats_op_name(const enum StatsOp op) {
+	return op < STATS_N_OPS ? g_op_names[op] : "unknown";
+}
+
+char *stats_format(size_t *len) {
+	char *buf = NULL;
+
+	FILE *file = open_memstream(&buf, len);
+	if (!file) {
+		return NULL;
+	}
+
+	write_stats(file);
+
+	if (fclose(file) != 0) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void *dump_thread(void *arg) {
+	(void)arg;
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	while (true) {
+		int sig;
+		if (sigwait(&set, &sig) == 0) {
+			write_stats(stderr);
+			fflush(stderr);
+		}
+	}
+
+	return NULL;
+}
+
+void stats_init() {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+void stats_start() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, dump_thread, NULL) != 0) {
+		printf("Failed to start the statistics thread!\n");
+		return;
+	}
+
+	pthread_detach(thread);
+}
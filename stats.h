@@ -0,0 +1,110 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "path.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum StatsOp {
+	STATS_OP_LOOKUP,
+	STATS_OP_FORGET,
+	STATS_OP_GETATTR,
+	STATS_OP_SETATTR,
+	STATS_OP_READLINK,
+	STATS_OP_MKNOD,
+	STATS_OP_MKDIR,
+	STATS_OP_UNLINK,
+	STATS_OP_RMDIR,
+	STATS_OP_SYMLINK,
+	STATS_OP_RENAME,
+	STATS_OP_LINK,
+	STATS_OP_CHMOD,
+	STATS_OP_CHOWN,
+	STATS_OP_TRUNCATE,
+	STATS_OP_UTIMENS,
+	STATS_OP_OPEN,
+	STATS_OP_CREATE,
+	STATS_OP_READ,
+	STATS_OP_WRITE,
+	STATS_OP_FLUSH,
+	STATS_OP_RELEASE,
+	STATS_OP_FSYNC,
+	STATS_OP_OPENDIR,
+	STATS_OP_READDIR,
+	STATS_OP_READDIRPLUS,
+	STATS_OP_RELEASEDIR,
+	STATS_OP_FSYNCDIR,
+	STATS_OP_STATFS,
+	STATS_OP_ACCESS,
+	STATS_OP_SETXATTR,
+	STATS_OP_GETXATTR,
+	STATS_OP_LISTXATTR,
+	STATS_OP_REMOVEXATTR,
+	STATS_OP_FALLOCATE,
+	STATS_OP_COPY_FILE_RANGE,
+	STATS_OP_LSEEK,
+	STATS_N_OPS
+};
+
+// Where a request was served from, the roots share their values with enum PathRoot.
+enum StatsClass {
+	STATS_CLASS_OTHER = PATH_ROOT_NONE,
+	STATS_CLASS_INSTALL = PATH_ROOT_INSTALL,
+	STATS_CLASS_DATA = PATH_ROOT_DATA,
+	STATS_CLASS_RUN = PATH_ROOT_RUN,
+	// The mount root, the fixed symlinks and the stats file itself.
+	STATS_CLASS_FIXED,
+	STATS_N_CLASSES
+};
+
+struct StatsScope {
+	enum StatsOp op;
+	enum StatsClass cls;
+	uint64_t start;
+};
+
+// Times the rest of the enclosing handler, the class is refined with STATS_CLASS() once known.
+#define STATS_SCOPE(op_) \
+	struct StatsScope stats_scope __attribute__((cleanup(stats_scope_end))) = stats_scope_begin(op_);
+
+#define STATS_CLASS(cls_) (stats_scope.cls = (enum StatsClass)(cls_))
+
+// Blocks SIGUSR1 in the calling thread, before libfuse spawns the ones that inherit its signal mask.
+void stats_init();
+
+// Starts the thread that dumps the statistics to stderr on SIGUSR1.
+void stats_start();
+
+struct StatsScope stats_scope_begin(enum StatsOp op);
+void stats_scope_end(const struct StatsScope *scope);
+
+// Formats the statistics gathered so far as text, into a buffer that has to be freed.
+char *stats_format(size_t *len);
+
+// Cross-root moves done by the daemon: bytes is added to the total when one starts, and to the copied count as it goes.
+void stats_move_begin(uint64_t bytes);
+void stats_move_progress(uint64_t bytes);
+void stats_move_end();
+
+// Op of the handler running on the calling thread, STATS_N_OPS outside of one.
+enum StatsOp stats_current_op();
+
+// Name of op as it appears in the statistics.
+const char *stats_op_name(enum StatsOp op);
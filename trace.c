@@ -0,0 +1,563 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fuse.h>
+
+// Records are appended to one buffer while the writer thread drains the other one.
+#define BUF_SIZE (1024 * 1024)
+// Buffered records are written out at least this often.
+#define FLUSH_INTERVAL_S (1)
+
+/*
+ * Besides the paths and handles, records hold:
+ *
+ * readlink, getxattr, listxattr: size = buffer size
+ * mknod: flags = mode, size = rdev
+ * mkdir, chmod: flags = mode
+ * rename: flags = rename flags, path2 = new path
+ * symlink, link: path = target, path2 = new path
+ * chown: offset = uid, size = gid
+ * truncate: offset = length
+ * open, opendir: flags = open flags, fh = returned handle
+ * read, write: offset, size
+ * fsync, fsyncdir: flags = datasync
+ * setxattr: size = value size, flags = xattr flags
+ * readdir: flags = readdir flags
+ * access: flags = mask
+ * fallocate: flags = mode, offset, size = length
+ * copy_file_range: offset, size = length, flags, path2, fh2 and offset2 = output
+ * lseek: offset, flags = whence
+ */
+
+static struct {
+	const struct fuse_operations *ops;
+	struct fuse_operations wrapped;
+	int fd;
+	uint64_t start;
+	uint64_t dropped;
+	char *active;
+	size_t used;
+	// Swapped out buffer the writer thread is busy with, NULL when it's idle.
+	char *pending;
+	size_t pending_len;
+	char *spare;
+	bool stop;
+	pthread_t thread;
+	bool running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} g_trace = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static bool write_all(const char *buf, size_t len) {
+	while (len) {
+		const ssize_t ret = write(g_trace.fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return false;
+		}
+
+		buf += ret;
+		len -= (size_t)ret;
+	}
+
+	return true;
+}
+
+// Called with the lock held, hands the active buffer over to the writer thread.
+static void swap_buffers() {
+	g_trace.pending = g_trace.active;
+	g_trace.pending_len = g_trace.used;
+	g_trace.active = g_trace.spare;
+	g_trace.spare = NULL;
+	g_trace.used = 0;
+
+	pthread_cond_signal(&g_trace.cond);
+}
+
+static void *writer_thread(void *arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&g_trace.lock);
+
+	while (true) {
+		if (!g_trace.pending) {
+			if (g_trace.stop) {
+				break;
+			}
+
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += FLUSH_INTERVAL_S;
+
+			if (pthread_cond_timedwait(&g_trace.cond, &g_trace.lock, &deadline) == ETIMEDOUT && g_trace.used) {
+				swap_buffers();
+			}
+
+			continue;
+		}
+
+		char *buf = g_trace.pending;
+		const size_t len = g_trace.pending_len;
+
+		pthread_mutex_unlock(&g_trace.lock);
+
+		if (!write_all(buf, len)) {
+			fprintf(stderr, "Failed to write the trace: %s\n", strerror(errno));
+		}
+
+		pthread_mutex_lock(&g_trace.lock);
+
+		g_trace.spare = buf;
+		g_trace.pending = NULL;
+	}
+
+	pthread_mutex_unlock(&g_trace.lock);
+
+	return NULL;
+}
+
+// Fills in the timing and the paths of rec, then appends it to the active buffer.
+static void append(struct TraceRecord rec, const uint64_t start, const char *path, const char *path2) {
+	const size_t path_len = path ? strnlen(path, UINT16_MAX) : 0;
+	const size_t path2_len = path2 ? strnlen(path2, UINT16_MAX) : 0;
+
+	rec.start_ns = start - g_trace.start;
+	rec.latency_ns = now_ns() - start;
+	rec.path_len = (uint16_t)path_len;
+	rec.path2_len = (uint16_t)path2_len;
+
+	const size_t len = sizeof(rec) + path_len + path2_len;
+
+	pthread_mutex_lock(&g_trace.lock);
+
+	if (g_trace.used + len > BUF_SIZE) {
+		// Better lose records than stall the filesystem behind a slow disk.
+		if (!g_trace.spare) {
+			++g_trace.dropped;
+			pthread_mutex_unlock(&g_trace.lock);
+			return;
+		}
+
+		swap_buffers();
+	}
+
+	char *ptr = g_trace.active + g_trace.used;
+	memcpy(ptr, &rec, sizeof(rec));
+	memcpy(ptr + sizeof(rec), path, path_len);
+	memcpy(ptr + sizeof(rec) + path_len, path2, path2_len);
+	g_trace.used += len;
+
+	pthread_mutex_unlock(&g_trace.lock);
+}
+
+static void record(const enum StatsOp op, const uint64_t start, const int64_t result, const char *path, const char *path2,
+				   const uint64_t fh, const int64_t offset, const uint64_t size, const uint32_t flags) {
+	const struct TraceRecord rec = {
+		.fh = fh,
+		.offset = offset,
+		.size = size,
+		.result = result,
+		.flags = flags,
+		.op = (uint16_t)op
+	};
+
+	append(rec, start, path, path2);
+}
+
+#define FH(fi) ((fi) ? (fi)->fh : 0)
+
+static int tr_getattr(const char *path, struct stat *buf, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->getattr(path, buf, fi);
+	record(STATS_OP_GETATTR, start, ret, path, NULL, FH(fi), 0, 0, 0);
+	return ret;
+}
+
+static int tr_readlink(const char *path, char *buf, size_t len) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->readlink(path, buf, len);
+	record(STATS_OP_READLINK, start, ret, path, NULL, 0, 0, len, 0);
+	return ret;
+}
+
+static int tr_mknod(const char *path, mode_t mode, dev_t rdev) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->mknod(path, mode, rdev);
+	record(STATS_OP_MKNOD, start, ret, path, NULL, 0, 0, rdev, mode);
+	return ret;
+}
+
+static int tr_mkdir(const char *path, mode_t mode) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->mkdir(path, mode);
+	record(STATS_OP_MKDIR, start, ret, path, NULL, 0, 0, 0, mode);
+	return ret;
+}
+
+static int tr_unlink(const char *path) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->unlink(path);
+	record(STATS_OP_UNLINK, start, ret, path, NULL, 0, 0, 0, 0);
+	return ret;
+}
+
+static int tr_rmdir(const char *path) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->rmdir(path);
+	record(STATS_OP_RMDIR, start, ret, path, NULL, 0, 0, 0, 0);
+	return ret;
+}
+
+static int tr_symlink(const char *from, const char *to) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->symlink(from, to);
+	record(STATS_OP_SYMLINK, start, ret, from, to, 0, 0, 0, 0);
+	return ret;
+}
+
+static int tr_rename(const char *old, const char *new, unsigned int flags) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->rename(old, new, flags);
+	record(STATS_OP_RENAME, start, ret, old, new, 0, 0, 0, flags);
+	return ret;
+}
+
+static int tr_link(const char *from, const char *to) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->link(from, to);
+	record(STATS_OP_LINK, start, ret, from, to, 0, 0, 0, 0);
+	return ret;
+}
+
+static int tr_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->chmod(path, mode, fi);
+	record(STATS_OP_CHMOD, start, ret, path, NULL, FH(fi), 0, 0, mode);
+	return ret;
+}
+
+static int tr_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->chown(path, uid, gid, fi);
+	record(STATS_OP_CHOWN, start, ret, path, NULL, FH(fi), uid, gid, 0);
+	return ret;
+}
+
+static int tr_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->truncate(path, size, fi);
+	record(STATS_OP_TRUNCATE, start, ret, path, NULL, FH(fi), size, 0, 0);
+	return ret;
+}
+
+static int tr_open(const char *path, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->open(path, fi);
+	record(STATS_OP_OPEN, start, ret, path, NULL, ret == 0 ? fi->fh : 0, 0, 0, (uint32_t)fi->flags);
+	return ret;
+}
+
+static int tr_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t off, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->read_buf(path, bufp, size, off, fi);
+	record(STATS_OP_READ, start, ret, path, NULL, fi->fh, off, size, 0);
+	return ret;
+}
+
+static int tr_write_buf(const char *path, struct fuse_bufvec *buf, off_t off, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const size_t size = fuse_buf_size(buf);
+	const int ret = g_trace.ops->write_buf(path, buf, off, fi);
+	record(STATS_OP_WRITE, start, ret, path, NULL, fi->fh, off, size, 0);
+	return ret;
+}
+
+static int tr_statfs(const char *path, struct statvfs *buf) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->statfs(path, buf);
+	record(STATS_OP_STATFS, start, ret, path, NULL, 0, 0, 0, 0);
+	return ret;
+}
+
+static int tr_flush(const char *path, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->flush(path, fi);
+	record(STATS_OP_FLUSH, start, ret, path, NULL, fi->fh, 0, 0, 0);
+	return ret;
+}
+
+static int tr_release(const char *path, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const uint64_t fh = fi->fh;
+	const int ret = g_trace.ops->release(path, fi);
+	record(STATS_OP_RELEASE, start, ret, path, NULL, fh, 0, 0, 0);
+	return ret;
+}
+
+static int tr_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->fsync(path, datasync, fi);
+	record(STATS_OP_FSYNC, start, ret, path, NULL, fi->fh, 0, 0, (uint32_t)datasync);
+	return ret;
+}
+
+static int tr_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->setxattr(path, name, value, size, flags);
+	record(STATS_OP_SETXATTR, start, ret, path, name, 0, 0, size, (uint32_t)flags);
+	return ret;
+}
+
+static int tr_getxattr(const char *path, const char *name, char *value, size_t size) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->getxattr(path, name, value, size);
+	record(STATS_OP_GETXATTR, start, ret, path, name, 0, 0, size, 0);
+	return ret;
+}
+
+static int tr_listxattr(const char *path, char *list, size_t size) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->listxattr(path, list, size);
+	record(STATS_OP_LISTXATTR, start, ret, path, NULL, 0, 0, size, 0);
+	return ret;
+}
+
+static int tr_removexattr(const char *path, const char *name) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->removexattr(path, name);
+	record(STATS_OP_REMOVEXATTR, start, ret, path, name, 0, 0, 0, 0);
+	return ret;
+}
+
+static int tr_opendir(const char *path, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->opendir(path, fi);
+	record(STATS_OP_OPENDIR, start, ret, path, NULL, ret == 0 ? fi->fh : 0, 0, 0, (uint32_t)fi->flags);
+	return ret;
+}
+
+static int tr_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->readdir(path, buf, filler, off, fi, flags);
+	record(flags & FUSE_READDIR_PLUS ? STATS_OP_READDIRPLUS : STATS_OP_READDIR, start, ret, path, NULL, FH(fi), off, 0, flags);
+	return ret;
+}
+
+static int tr_releasedir(const char *path, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const uint64_t fh = fi->fh;
+	const int ret = g_trace.ops->releasedir(path, fi);
+	record(STATS_OP_RELEASEDIR, start, ret, path, NULL, fh, 0, 0, 0);
+	return ret;
+}
+
+static int tr_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->fsyncdir(path, datasync, fi);
+	record(STATS_OP_FSYNCDIR, start, ret, path, NULL, fi->fh, 0, 0, (uint32_t)datasync);
+	return ret;
+}
+
+// The writer thread has to be started after libfuse daemonized, threads don't survive the fork.
+static void *tr_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+	void *ret = g_trace.ops->init ? g_trace.ops->init(conn, cfg) : NULL;
+
+	g_trace.start = now_ns();
+
+	if (pthread_create(&g_trace.thread, NULL, writer_thread, NULL) != 0) {
+		fprintf(stderr, "Failed to start the trace writer thread!\n");
+	} else {
+		g_trace.running = true;
+	}
+
+	return ret;
+}
+
+static int tr_access(const char *path, int mask) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->access(path, mask);
+	record(STATS_OP_ACCESS, start, ret, path, NULL, 0, 0, 0, (uint32_t)mask);
+	return ret;
+}
+
+static int tr_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->utimens(path, tv, fi);
+	record(STATS_OP_UTIMENS, start, ret, path, NULL, FH(fi), 0, 0, 0);
+	return ret;
+}
+
+static int tr_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const int ret = g_trace.ops->fallocate(path, mode, offset, length, fi);
+	record(STATS_OP_FALLOCATE, start, ret, path, NULL, fi->fh, offset, (uint64_t)length, (uint32_t)mode);
+	return ret;
+}
+
+static ssize_t tr_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t off_in,
+								  const char *path_out, struct fuse_file_info *fi_out, off_t off_out,
+								  size_t len, int flags) {
+	const uint64_t start = now_ns();
+	const ssize_t ret = g_trace.ops->copy_file_range(path_in, fi_in, off_in, path_out, fi_out, off_out, len, flags);
+	const struct TraceRecord rec = {
+		.fh = fi_in->fh,
+		.fh2 = fi_out->fh,
+		.offset = off_in,
+		.offset2 = off_out,
+		.size = len,
+		.result = ret,
+		.flags = (uint32_t)flags,
+		.op = STATS_OP_COPY_FILE_RANGE
+	};
+
+	append(rec, start, path_in, path_out);
+	return ret;
+}
+
+static off_t tr_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
+	const uint64_t start = now_ns();
+	const off_t ret = g_trace.ops->lseek(path, off, whence, fi);
+	record(STATS_OP_LSEEK, start, ret, path, NULL, fi->fh, off, 0, (uint32_t)whence);
+	return ret;
+}
+
+bool trace_open(const char *path) {
+	g_trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (g_trace.fd < 0) {
+		fprintf(stderr, "Failed to create the trace file \"%s\": %s\n", path, strerror(errno));
+		return false;
+	}
+
+	const struct TraceHeader header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.record_size = sizeof(struct TraceRecord)
+	};
+
+	g_trace.active = malloc(BUF_SIZE);
+	g_trace.spare = malloc(BUF_SIZE);
+
+	if (!g_trace.active || !g_trace.spare || !write_all((const char *)&header, sizeof(header))) {
+		fprintf(stderr, "Failed to set up the trace file \"%s\"!\n", path);
+		trace_close();
+		return false;
+	}
+
+	g_trace.start = now_ns();
+
+	return true;
+}
+
+const struct fuse_operations *trace_wrap(const struct fuse_operations *ops) {
+	g_trace.ops = ops;
+
+	g_trace.wrapped = (struct fuse_operations) {
+		.getattr = ops->getattr ? tr_getattr : NULL,
+		.readlink = ops->readlink ? tr_readlink : NULL,
+		.mknod = ops->mknod ? tr_mknod : NULL,
+		.mkdir = ops->mkdir ? tr_mkdir : NULL,
+		.unlink = ops->unlink ? tr_unlink : NULL,
+		.rmdir = ops->rmdir ? tr_rmdir : NULL,
+		.symlink = ops->symlink ? tr_symlink : NULL,
+		.rename = ops->rename ? tr_rename : NULL,
+		.link = ops->link ? tr_link : NULL,
+		.chmod = ops->chmod ? tr_chmod : NULL,
+		.chown = ops->chown ? tr_chown : NULL,
+		.truncate = ops->truncate ? tr_truncate : NULL,
+		.open = ops->open ? tr_open : NULL,
+		.read_buf = ops->read_buf ? tr_read_buf : NULL,
+		.write_buf = ops->write_buf ? tr_write_buf : NULL,
+		.statfs = ops->statfs ? tr_statfs : NULL,
+		.flush = ops->flush ? tr_flush : NULL,
+		.release = ops->release ? tr_release : NULL,
+		.fsync = ops->fsync ? tr_fsync : NULL,
+		.setxattr = ops->setxattr ? tr_setxattr : NULL,
+		.getxattr = ops->getxattr ? tr_getxattr : NULL,
+		.listxattr = ops->listxattr ? tr_listxattr : NULL,
+		.removexattr = ops->removexattr ? tr_removexattr : NULL,
+		.opendir = ops->opendir ? tr_opendir : NULL,
+		.readdir = ops->readdir ? tr_readdir : NULL,
+		.releasedir = ops->releasedir ? tr_releasedir : NULL,
+		.fsyncdir = ops->fsyncdir ? tr_fsyncdir : NULL,
+		.init = tr_init,
+		.destroy = ops->destroy,
+		.access = ops->access ? tr_access : NULL,
+		.utimens = ops->utimens ? tr_utimens : NULL,
+		.fallocate = ops->fallocate ? tr_fallocate : NULL,
+		.copy_file_range = ops->copy_file_range ? tr_copy_file_range : NULL,
+		.lseek = ops->lseek ? tr_lseek : NULL
+	};
+
+	return &g_trace.wrapped;
+}
+
+void trace_close() {
+	if (g_trace.running) {
+		pthread_mutex_lock(&g_trace.lock);
+		g_trace.stop = true;
+		pthread_cond_signal(&g_trace.cond);
+		pthread_mutex_unlock(&g_trace.lock);
+
+		pthread_join(g_trace.thread, NULL);
+		g_trace.running = false;
+	}
+
+	if (g_trace.fd >= 0) {
+		if (g_trace.used && !write_all(g_trace.active, g_trace.used)) {
+			fprintf(stderr, "Failed to write the trace: %s\n", strerror(errno));
+		}
+
+		if (g_trace.dropped) {
+			fprintf(stderr, "Dropped %llu trace records, the disk couldn't keep up.\n", (unsigned long long)g_trace.dropped);
+		}
+
+		close(g_trace.fd);
+		g_trace.fd = -1;
+	}
+
+	free(g_trace.active);
+	free(g_trace.spare);
+	g_trace.active = NULL;
+	g_trace.spare = NULL;
+	g_trace.used = 0;
+}
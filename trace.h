@@ -0,0 +1,63 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "SXETRACE"
+#define TRACE_VERSION (1)
+
+struct fuse_operations;
+
+struct TraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+// Followed by path_len bytes of path and path2_len bytes of path2, neither of them NUL-terminated.
+// The meaning of offset, size and flags depends on the operation, see trace.c.
+struct TraceRecord {
+	// Since the trace started.
+	uint64_t start_ns;
+	uint64_t latency_ns;
+	// File handles as returned by the daemon, to pair opens with the operations on them.
+	uint64_t fh;
+	uint64_t fh2;
+	int64_t offset;
+	int64_t offset2;
+	uint64_t size;
+	// Return value of the handler, negative errno values for errors.
+	int64_t result;
+	uint32_t flags;
+	// enum StatsOp.
+	uint16_t op;
+	uint16_t path_len;
+	uint16_t path2_len;
+	uint16_t reserved[3];
+};
+
+// Creates the trace file, before daemonizing changes the working directory.
+bool trace_open(const char *path);
+
+// Returns a table that records every call before handing it to ops. The writer thread starts along with the filesystem.
+const struct fuse_operations *trace_wrap(const struct fuse_operations *ops);
+
+// Writes out what's still buffered and closes the file.
+void trace_close();
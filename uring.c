@@ -0,0 +1,418 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uring.h"
+
+#include <stdio.h>
+
+#ifdef HAVE_LIBURING
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <liburing.h>
+
+// Submissions that fail this many times in a row are done synchronously instead.
+#define MAX_SUBMIT_RETRIES (1000)
+
+struct Completion {
+	struct Completion *next;
+	UringCallback cb;
+	void *data;
+	// Enough to do the operation synchronously when the ring can't take it.
+	int opcode;
+	int fd;
+	int mode;
+	void *buf;
+	uint64_t len;
+	uint64_t off;
+};
+
+struct Ring {
+	struct io_uring ring;
+	// Submitted but not completed yet, the ring is freed once it drops to zero after its thread exited.
+	uint32_t inflight;
+	// Returned by the completion thread, taken by the owning thread.
+	struct Completion *free;
+	// Prepared since the last flush, in order.
+	struct Completion **queued;
+	unsigned int n_queued;
+	// Couldn't be submitted to anymore, everything goes through the synchronous path.
+	bool dead;
+	// Signaled by the owning thread when it exits.
+	int closed;
+	struct Completion pool[];
+};
+
+static unsigned int g_depth;
+static pthread_key_t g_key;
+
+// Rings whose completion thread is still running.
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_rings_done = PTHREAD_COND_INITIALIZER;
+static unsigned int g_n_rings;
+
+static __thread struct Ring *t_ring;
+static __thread bool t_failed;
+
+// Only the owning thread takes entries, so a popped head can't come back while it's being read.
+static struct Completion *completion_get(struct Ring *ring) {
+	struct Completion *head = __atomic_load_n(&ring->free, __ATOMIC_ACQUIRE);
+	while (head && !__atomic_compare_exchange_n(&ring->free, &head, head->next, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+	}
+
+	return head;
+}
+
+static void completion_put(struct Ring *ring, struct Completion *completion) {
+	completion->next = __atomic_load_n(&ring->free, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ring->free, &completion->next, completion, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+}
+
+static int op_run(const struct Completion *completion) {
+	ssize_t ret;
+	if (completion->opcode == IORING_OP_READ) {
+		ret = pread(completion->fd, completion->buf, completion->len, (off_t)completion->off);
+	} else if (completion->opcode == IORING_OP_WRITE) {
+		ret = pwrite(completion->fd, completion->buf, completion->len, (off_t)completion->off);
+	} else if (completion->opcode == IORING_OP_FSYNC) {
+		ret = (completion->mode & IORING_FSYNC_DATASYNC) ? fdatasync(completion->fd) : fsync(completion->fd);
+	} else {
+		ret = fallocate(completion->fd, completion->mode, (off_t)completion->off, (off_t)completion->len);
+	}
+
+	return ret < 0 ? -errno : (int)ret;
+}
+
+// Waits on the ring's descriptor rather than in io_uring_enter(), so that closing doesn't need a submission: a
+// ring that can't be submitted to anymore is still shut down.
+static void *ring_thread(void *arg) {
+	struct Ring *ring = arg;
+
+	struct pollfd fds[] = { { .fd = ring->ring.ring_fd, .events = POLLIN }, { .fd = ring->closed, .events = POLLIN } };
+
+	while (fds[1].fd != -1 || __atomic_load_n(&ring->inflight, __ATOMIC_ACQUIRE)) {
+		if (poll(fds, 2, -1) < 0) {
+			continue;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			fds[1].fd = -1;
+		}
+
+		struct io_uring_cqe *cqe;
+		unsigned int head;
+		unsigned int n = 0;
+
+		io_uring_for_each_cqe(&ring->ring, head, cqe) {
+			struct Completion *completion = io_uring_cqe_get_data(cqe);
+			completion->cb(completion->data, cqe->res);
+			completion_put(ring, completion);
+			__atomic_sub_fetch(&ring->inflight, 1, __ATOMIC_RELEASE);
+
+			++n;
+		}
+
+		io_uring_cq_advance(&ring->ring, n);
+	}
+
+	io_uring_queue_exit(&ring->ring);
+	close(ring->closed);
+	free(ring->queued);
+	free(ring);
+
+	pthread_mutex_lock(&g_rings_lock);
+	if (!--g_n_rings) {
+		pthread_cond_broadcast(&g_rings_done);
+	}
+	pthread_mutex_unlock(&g_rings_lock);
+
+	return NULL;
+}
+
+// Submits everything queued, retrying while the kernel is short on resources. When the ring fails for good the
+// remaining operations are done right here, the kernel never consumed them.
+static void ring_flush(struct Ring *ring) {
+	unsigned int retries = 0;
+
+	while (ring->n_queued) {
+		const int ret = io_uring_submit(&ring->ring);
+		if (ret > 0) {
+			ring->n_queued -= (unsigned int)ret;
+			memmove(ring->queued, ring->queued + ret, ring->n_queued * sizeof(*ring->queued));
+			retries = 0;
+			continue;
+		}
+
+		// The completion thread makes room in the completion queue.
+		if ((ret == -EINTR || ret == -EAGAIN || ret == -EBUSY) && ++retries < MAX_SUBMIT_RETRIES) {
+			const struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * 1000 };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		printf("Failed to submit to io_uring: %s, using synchronous I/O on this thread.\n", strerror(ret < 0 ? -ret : EIO));
+
+		// The entries are still in the submission queue, any later submission would run them a second time.
+		ring->dead = true;
+
+		for (unsigned int i = 0; i < ring->n_queued; ++i) {
+			struct Completion *completion = ring->queued[i];
+			completion->cb(completion->data, op_run(completion));
+			completion_put(ring, completion);
+			__atomic_sub_fetch(&ring->inflight, 1, __ATOMIC_RELEASE);
+		}
+
+		ring->n_queued = 0;
+	}
+}
+
+// Runs when the owning thread exits, the completion thread finishes the pending operations and frees the ring.
+static void ring_close(void *arg) {
+	struct Ring *ring = arg;
+
+	ring_flush(ring);
+	eventfd_write(ring->closed, 1);
+}
+
+static struct Ring *ring_get() {
+	if (t_ring || t_failed) {
+		return t_ring;
+	}
+
+	struct Ring *ring = calloc(1, sizeof(*ring) + g_depth * sizeof(*ring->pool));
+	if (!ring) {
+		return NULL;
+	}
+
+	ring->queued = calloc(g_depth, sizeof(*ring->queued));
+	if (!ring->queued) {
+		free(ring);
+		return NULL;
+	}
+
+	for (unsigned int i = 0; i < g_depth; ++i) {
+		ring->pool[i].next = ring->free;
+		ring->free = &ring->pool[i];
+	}
+
+	ring->closed = eventfd(0, EFD_CLOEXEC);
+	if (ring->closed == -1) {
+		printf("Failed to create an eventfd: %s\n", strerror(errno));
+		goto FREE_RING;
+	}
+
+	int ret = io_uring_queue_init(g_depth, &ring->ring, 0);
+	if (ret < 0) {
+		printf("Failed to create an io_uring instance: %s\n", strerror(-ret));
+		goto CLOSE_EVENTFD;
+	}
+
+	pthread_mutex_lock(&g_rings_lock);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, ring_thread, ring) != 0) {
+		pthread_mutex_unlock(&g_rings_lock);
+		printf("Failed to start an io_uring completion thread!\n");
+		io_uring_queue_exit(&ring->ring);
+		goto CLOSE_EVENTFD;
+	}
+
+	++g_n_rings;
+	pthread_mutex_unlock(&g_rings_lock);
+
+	pthread_detach(thread);
+	pthread_setspecific(g_key, ring);
+
+	t_ring = ring;
+
+	return ring;
+CLOSE_EVENTFD:
+	close(ring->closed);
+FREE_RING:
+	free(ring->queued);
+	free(ring);
+	t_failed = true;
+
+	return NULL;
+}
+
+// Queues the operation on the calling thread's ring, it's submitted by the next flush or once the ring is full.
+// false if the ring is unavailable or too busy.
+static bool op_queue(const int opcode, const int fd, const int mode, void *buf, const uint64_t len, const uint64_t off, const UringCallback cb, void *data) {
+	struct Ring *ring = ring_get();
+	if (!ring || ring->dead) {
+		return false;
+	}
+
+	// Bounded so that a burst can't overflow the completion queue, the excess is done synchronously.
+	if (__atomic_load_n(&ring->inflight, __ATOMIC_RELAXED) >= g_depth) {
+		return false;
+	}
+
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+	if (!sqe) {
+		ring_flush(ring);
+		sqe = ring->dead ? NULL : io_uring_get_sqe(&ring->ring);
+		if (!sqe) {
+			return false;
+		}
+	}
+
+	// There's one per operation in flight.
+	struct Completion *completion = completion_get(ring);
+
+	*completion = (struct Completion){ .cb = cb, .data = data, .opcode = opcode, .fd = fd, .mode = mode, .buf = buf, .len = len, .off = off };
+
+	if (opcode == IORING_OP_READ) {
+		io_uring_prep_read(sqe, fd, buf, (unsigned int)len, off);
+	} else if (opcode == IORING_OP_WRITE) {
+		io_uring_prep_write(sqe, fd, buf, (unsigned int)len, off);
+	} else if (opcode == IORING_OP_FSYNC) {
+		io_uring_prep_fsync(sqe, fd, (unsigned int)mode);
+	} else {
+		io_uring_prep_fallocate(sqe, fd, mode, off, len);
+	}
+
+	io_uring_sqe_set_data(sqe, completion);
+
+	__atomic_add_fetch(&ring->inflight, 1, __ATOMIC_RELAXED);
+	ring->queued[ring->n_queued++] = completion;
+
+	if (!io_uring_sq_space_left(&ring->ring)) {
+		ring_flush(ring);
+	}
+
+	return true;
+}
+
+bool uring_init(const unsigned int depth) {
+	struct io_uring probe;
+	const int ret = io_uring_queue_init(depth, &probe, 0);
+	if (ret < 0) {
+		printf("io_uring is not available (%s), falling back to synchronous I/O.\n", strerror(-ret));
+		return false;
+	}
+
+	io_uring_queue_exit(&probe);
+
+	if (pthread_key_create(&g_key, ring_close) != 0) {
+		printf("Failed to create the io_uring thread key, falling back to synchronous I/O.\n");
+		return false;
+	}
+
+	g_depth = depth;
+
+	return true;
+}
+
+void uring_flush() {
+	if (t_ring) {
+		ring_flush(t_ring);
+	}
+}
+
+void uring_stop() {
+	pthread_mutex_lock(&g_rings_lock);
+	while (g_n_rings) {
+		pthread_cond_wait(&g_rings_done, &g_rings_lock);
+	}
+	pthread_mutex_unlock(&g_rings_lock);
+}
+
+bool uring_read(const int fd, void *buf, const size_t size, const off_t off, const UringCallback cb, void *data) {
+	return op_queue(IORING_OP_READ, fd, 0, buf, size, (uint64_t)off, cb, data);
+}
+
+bool uring_write(const int fd, const void *buf, const size_t size, const off_t off, const UringCallback cb, void *data) {
+	return op_queue(IORING_OP_WRITE, fd, 0, (void *)buf, size, (uint64_t)off, cb, data);
+}
+
+bool uring_fsync(const int fd, const bool datasync, const UringCallback cb, void *data) {
+	return op_queue(IORING_OP_FSYNC, fd, datasync ? IORING_FSYNC_DATASYNC : 0, NULL, 0, 0, cb, data);
+}
+
+bool uring_fallocate(const int fd, const int mode, const off_t off, const off_t len, const UringCallback cb, void *data) {
+	return op_queue(IORING_OP_FALLOCATE, fd, mode, NULL, (uint64_t)len, (uint64_t)off, cb, data);
+}
+#else
+void uring_flush() {
+}
+
+void uring_stop() {
+}
+
+bool uring_init(const unsigned int depth) {
+	(void)depth;
+
+	printf("This build doesn't support io_uring, falling back to synchronous I/O.\n");
+
+	return false;
+}
+
+bool uring_read(const int fd, void *buf, const size_t size, const off_t off, const UringCallback cb, void *data) {
+	(void)fd;
+	(void)buf;
+	(void)size;
+	(void)off;
+	(void)cb;
+	(void)data;
+
+	return false;
+}
+
+bool uring_write(const int fd, const void *buf, const size_t size, const off_t off, const UringCallback cb, void *data) {
+	(void)fd;
+	(void)buf;
+	(void)size;
+	(void)off;
+	(void)cb;
+	(void)data;
+
+	return false;
+}
+
+bool uring_fsync(const int fd, const bool datasync, const UringCallback cb, void *data) {
+	(void)fd;
+	(void)datasync;
+	(void)cb;
+	(void)data;
+
+	return false;
+}
+
+bool uring_fallocate(const int fd, const int mode, const off_t off, const off_t len, const UringCallback cb, void *data) {
+	(void)fd;
+	(void)mode;
+	(void)off;
+	(void)len;
+	(void)cb;
+	(void)data;
+
+	return false;
+}
+#endif
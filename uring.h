@@ -0,0 +1,44 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+// Called from the ring's completion thread, res is the syscall result or -errno.
+typedef void (*UringCallback)(void *data, int res);
+
+// Checks that io_uring is usable and sets the queue depth of the per-thread rings.
+bool uring_init(unsigned int depth);
+
+// Each operation is queued on the calling thread's ring, which is created on first use, and submitted by the next
+// uring_flush() from that thread or as soon as the ring is full.
+// false means the operation couldn't be queued and the caller should do it synchronously.
+bool uring_read(int fd, void *buf, size_t size, off_t off, UringCallback cb, void *data);
+bool uring_write(int fd, const void *buf, size_t size, off_t off, UringCallback cb, void *data);
+bool uring_fsync(int fd, bool datasync, UringCallback cb, void *data);
+bool uring_fallocate(int fd, int mode, off_t off, off_t len, UringCallback cb, void *data);
+
+// Submits what the calling thread queued, before it waits for more requests.
+void uring_flush();
+
+// Waits until the rings of the threads that exited completed everything, so that no reply comes after the session
+// is gone.
+void uring_stop();
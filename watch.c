@@ -0,0 +1,568 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "watch.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#define N_BUCKETS (4096)
+// Different virtual directories can be redirected to the same real one.
+#define MAX_VPATHS (8)
+
+#define WATCH_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// Files being written to are invalidated this long after the first write, along with the following ones.
+#define MODIFY_DELAY_MS (50)
+#define MAX_MODIFIED (64)
+
+// One way of reaching the directory: a vpath for the high-level backend, an inode for the low-level one.
+struct WatchPath {
+	char *vpath;
+	uint64_t ino;
+	uint32_t refs;
+};
+
+struct Watch {
+	struct Watch *next_dir;
+	struct Watch *next_wd;
+	// Most recently added first.
+	struct Watch *lru_prev;
+	struct Watch *lru_next;
+	struct WatchPath vpaths[MAX_VPATHS];
+	size_t n_vpaths;
+	dev_t st_dev;
+	ino_t st_ino;
+	uint32_t refs;
+	int wd;
+};
+
+struct Modified {
+	uint64_t deadline;
+	int wd;
+	char name[NAME_MAX + 1];
+};
+
+struct Watcher {
+	WatchHandler handler;
+	struct Watch *by_dir[N_BUCKETS];
+	struct Watch *by_wd[N_BUCKETS];
+	struct Watch *lru_head;
+	struct Watch *lru_tail;
+	size_t n_watches;
+	size_t capacity;
+	pthread_mutex_t lock;
+	int fd;
+};
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline size_t dir_bucket(const dev_t dev, const ino_t ino) {
+	const uint64_t hash = ((uint64_t)ino * 0x9E3779B97F4A7C15ull) ^ (uint64_t)dev;
+	return (size_t)(hash ^ (hash >> 32)) % N_BUCKETS;
+}
+
+static inline size_t wd_bucket(const int wd) {
+	return (size_t)wd % N_BUCKETS;
+}
+
+static struct Watch *find_wd(const struct Watcher *watcher, const int wd) {
+	struct Watch *watch = watcher->by_wd[wd_bucket(wd)];
+	while (watch && watch->wd != wd) {
+		watch = watch->next_wd;
+	}
+
+	return watch;
+}
+
+static void lru_unlink(struct Watcher *watcher, struct Watch *watch) {
+	*(watch->lru_prev ? &watch->lru_prev->lru_next : &watcher->lru_head) = watch->lru_next;
+	*(watch->lru_next ? &watch->lru_next->lru_prev : &watcher->lru_tail) = watch->lru_prev;
+}
+
+static void lru_push(struct Watcher *watcher, struct Watch *watch) {
+	watch->lru_prev = NULL;
+	watch->lru_next = watcher->lru_head;
+	*(watcher->lru_head ? &watcher->lru_head->lru_prev : &watcher->lru_tail) = watch;
+	watcher->lru_head = watch;
+}
+
+static void free_watch(struct Watch *watch) {
+	for (size_t i = 0; i < watch->n_vpaths; ++i) {
+		free(watch->vpaths[i].vpath);
+	}
+
+	free(watch);
+}
+
+static void detach_watch(struct Watcher *watcher, struct Watch *watch) {
+	struct Watch **prev = &watcher->by_dir[dir_bucket(watch->st_dev, watch->st_ino)];
+	while (*prev != watch) {
+		prev = &(*prev)->next_dir;
+	}
+
+	*prev = watch->next_dir;
+
+	prev = &watcher->by_wd[wd_bucket(watch->wd)];
+	while (*prev != watch) {
+		prev = &(*prev)->next_wd;
+	}
+
+	*prev = watch->next_wd;
+
+	lru_unlink(watcher, watch);
+	--watcher->n_watches;
+}
+
+static void unlink_watch(struct Watcher *watcher, struct Watch *watch) {
+	detach_watch(watcher, watch);
+	free_watch(watch);
+}
+
+static inline bool same_vpath(const char *a, const char *b) {
+	return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+// Returns false when vpath and ino are new and can't be stored, so that the caller doesn't rely on them being
+// reported.
+static bool add_vpath(struct Watch *watch, const char *vpath, const uint64_t ino) {
+	for (size_t i = 0; i < watch->n_vpaths; ++i) {
+		if (watch->vpaths[i].ino == ino && same_vpath(watch->vpaths[i].vpath, vpath)) {
+			++watch->vpaths[i].refs;
+			return true;
+		}
+	}
+
+	if (watch->n_vpaths == MAX_VPATHS) {
+		return false;
+	}
+
+	char *copy = NULL;
+	if (vpath && !(copy = strdup(vpath))) {
+		return false;
+	}
+
+	watch->vpaths[watch->n_vpaths++] = (struct WatchPath){ .vpath = copy, .ino = ino, .refs = 1 };
+
+	return true;
+}
+
+// Copies what the handler needs, it's called without the lock.
+static size_t copy_vpaths(const struct Watch *watch, char vpaths[][PATH_MAX], uint64_t *inos) {
+	for (size_t i = 0; i < watch->n_vpaths; ++i) {
+		snprintf(vpaths[i], PATH_MAX, "%s", watch->vpaths[i].vpath ? watch->vpaths[i].vpath : "");
+		inos[i] = watch->vpaths[i].ino;
+	}
+
+	return watch->n_vpaths;
+}
+
+// Events were lost, so anything could have changed in any of the directories.
+static void report_overflow(struct Watcher *watcher) {
+	watcher->handler(NULL, 0, "", IN_Q_OVERFLOW);
+
+	struct Dir {
+		char *vpath;
+		uint64_t ino;
+	} *dirs = NULL;
+	size_t n_dirs = 0;
+
+	pthread_mutex_lock(&watcher->lock);
+
+	size_t n_max = 0;
+	for (const struct Watch *watch = watcher->lru_head; watch; watch = watch->lru_next) {
+		n_max += watch->n_vpaths;
+	}
+
+	dirs = n_max ? malloc(n_max * sizeof(*dirs)) : NULL;
+
+	for (const struct Watch *watch = watcher->lru_head; dirs && watch; watch = watch->lru_next) {
+		for (size_t i = 0; i < watch->n_vpaths; ++i) {
+			char *vpath = strdup(watch->vpaths[i].vpath ? watch->vpaths[i].vpath : "");
+			if (vpath) {
+				dirs[n_dirs++] = (struct Dir){ .vpath = vpath, .ino = watch->vpaths[i].ino };
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&watcher->lock);
+
+	for (size_t i = 0; i < n_dirs; ++i) {
+		watcher->handler(dirs[i].vpath, dirs[i].ino, "", IN_Q_OVERFLOW);
+		free(dirs[i].vpath);
+	}
+
+	free(dirs);
+}
+
+// Passes an event on to the handler, once for every vpath of its directory.
+static void dispatch(struct Watcher *watcher, const int wd, const char *name, const uint32_t mask) {
+	// The handler talks to the kernel, which may be waiting on a request that needs the lock.
+	char vpaths[MAX_VPATHS][PATH_MAX];
+	uint64_t inos[MAX_VPATHS];
+	size_t n_vpaths = 0;
+
+	pthread_mutex_lock(&watcher->lock);
+
+	const struct Watch *watch = find_wd(watcher, wd);
+	if (watch) {
+		n_vpaths = copy_vpaths(watch, vpaths, inos);
+	}
+
+	pthread_mutex_unlock(&watcher->lock);
+
+	for (size_t i = 0; i < n_vpaths; ++i) {
+		watcher->handler(vpaths[i], inos[i], name, mask);
+	}
+}
+
+// Writes are reported once per file and MODIFY_DELAY_MS at most, whatever their number.
+static void add_modified(struct Modified *pending, size_t *n_pending, const int wd, const char *name, const uint64_t now) {
+	for (size_t i = 0; i < *n_pending; ++i) {
+		if (pending[i].wd == wd && strcmp(pending[i].name, name) == 0) {
+			return;
+		}
+	}
+
+	struct Modified *modified = &pending[(*n_pending)++];
+	modified->wd = wd;
+	modified->deadline = now + MODIFY_DELAY_MS * 1000000ull;
+	snprintf(modified->name, sizeof(modified->name), "%s", name);
+}
+
+// Any other event on the file invalidates it as well.
+static void drop_modified(struct Modified *pending, size_t *n_pending, const int wd, const char *name) {
+	for (size_t i = 0; i < *n_pending; ++i) {
+		if (pending[i].wd == wd && strcmp(pending[i].name, name) == 0) {
+			pending[i] = pending[--*n_pending];
+			return;
+		}
+	}
+}
+
+static void flush_modified(struct Watcher *watcher, struct Modified *pending, size_t *n_pending, const uint64_t now) {
+	for (size_t i = 0; i < *n_pending;) {
+		if (pending[i].deadline > now) {
+			++i;
+			continue;
+		}
+
+		const struct Modified modified = pending[i];
+		pending[i] = pending[--*n_pending];
+
+		dispatch(watcher, modified.wd, modified.name, IN_MODIFY);
+	}
+}
+
+static void *watch_thread(void *arg) {
+	struct Watcher *watcher = arg;
+
+	char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct Modified pending[MAX_MODIFIED];
+	size_t n_pending = 0;
+
+	while (true) {
+		int timeout = -1;
+		if (n_pending) {
+			const uint64_t now = now_ns();
+			uint64_t next = UINT64_MAX;
+			for (size_t i = 0; i < n_pending; ++i) {
+				next = pending[i].deadline < next ? pending[i].deadline : next;
+			}
+
+			timeout = next > now ? (int)((next - now + 999999) / 1000000) : 0;
+		}
+
+		struct pollfd pfd = { .fd = watcher->fd, .events = POLLIN };
+		const int ready = poll(&pfd, 1, timeout);
+		if (ready == -1 && errno != EINTR) {
+			break;
+		}
+
+		if (ready <= 0) {
+			flush_modified(watcher, pending, &n_pending, now_ns());
+			continue;
+		}
+
+		const ssize_t len = read(watcher->fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len == -1 && (errno == EINTR || errno == EAGAIN)) {
+				continue;
+			}
+
+			break;
+		}
+
+		const uint64_t now = now_ns();
+
+		for (char *ptr = buf; ptr < buf + len;) {
+			const struct inotify_event *event = (const struct inotify_event *)ptr;
+			ptr += sizeof(*event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				log_message(LOG_LEVEL_WARN, "[%s] event queue overflow, some changes were missed", __func__);
+				n_pending = 0;
+				report_overflow(watcher);
+				continue;
+			}
+
+			// The directory is gone, so is the watch.
+			if (event->mask & IN_IGNORED) {
+				pthread_mutex_lock(&watcher->lock);
+
+				struct Watch *watch = find_wd(watcher, event->wd);
+				if (watch) {
+					unlink_watch(watcher, watch);
+				}
+
+				pthread_mutex_unlock(&watcher->lock);
+				continue;
+			}
+
+			if (!event->len) {
+				continue;
+			}
+
+			if (event->mask & IN_MODIFY) {
+				if (n_pending == MAX_MODIFIED) {
+					flush_modified(watcher, pending, &n_pending, UINT64_MAX);
+				}
+
+				add_modified(pending, &n_pending, event->wd, event->name, now);
+				continue;
+			}
+
+			drop_modified(pending, &n_pending, event->wd, event->name);
+			dispatch(watcher, event->wd, event->name, event->mask);
+		}
+
+		flush_modified(watcher, pending, &n_pending, now);
+	}
+
+	return NULL;
+}
+
+struct Watcher *watch_new(WatchHandler handler, const size_t capacity) {
+	struct Watcher *watcher = calloc(1, sizeof(*watcher));
+	if (!watcher) {
+		return NULL;
+	}
+
+	watcher->handler = handler;
+	watcher->capacity = capacity;
+	pthread_mutex_init(&watcher->lock, NULL);
+
+	watcher->fd = inotify_init1(IN_CLOEXEC);
+	if (watcher->fd == -1) {
+		printf("Failed to initialize inotify: %s\n", strerror(errno));
+		free(watcher);
+		return NULL;
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, watch_thread, watcher) != 0) {
+		printf("Failed to start the watcher thread!\n");
+		close(watcher->fd);
+		free(watcher);
+		return NULL;
+	}
+
+	pthread_detach(thread);
+
+	return watcher;
+}
+
+int watch_add(struct Watcher *watcher, const int dirfd, const char *path, const struct stat *st, const char *vpath, const uint64_t ino) {
+	if (!watcher) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&watcher->lock);
+
+	const size_t bucket = dir_bucket(st->st_dev, st->st_ino);
+	for (struct Watch *watch = watcher->by_dir[bucket]; watch; watch = watch->next_dir) {
+		if (watch->st_dev == st->st_dev && watch->st_ino == st->st_ino) {
+			const int wd = add_vpath(watch, vpath, ino) ? watch->wd : -1;
+			if (wd != -1) {
+				++watch->refs;
+				lru_unlink(watcher, watch);
+				lru_push(watcher, watch);
+			}
+
+			pthread_mutex_unlock(&watcher->lock);
+			return wd;
+		}
+	}
+
+	// inotify has no *at() variant, the descriptor is reached through procfs instead.
+	char proc_path[PATH_MAX];
+	if (dirfd != AT_FDCWD) {
+		snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%i/%s", dirfd, path);
+		path = proc_path;
+	}
+
+	int wd = inotify_add_watch(watcher->fd, path, WATCH_MASK);
+	if (wd == -1) {
+		pthread_mutex_unlock(&watcher->lock);
+		log_message(LOG_LEVEL_WARN, "[%s] %s: %s", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	struct Watch *watch = find_wd(watcher, wd);
+	if (!watch) {
+		watch = malloc(sizeof(*watch));
+		if (watch) {
+			*watch = (struct Watch){ .next_dir = watcher->by_dir[bucket], .next_wd = watcher->by_wd[wd_bucket(wd)], .st_dev = st->st_dev, .st_ino = st->st_ino, .wd = wd };
+			watcher->by_dir[bucket] = watch;
+			watcher->by_wd[wd_bucket(wd)] = watch;
+			lru_push(watcher, watch);
+			++watcher->n_watches;
+		} else {
+			inotify_rm_watch(watcher->fd, wd);
+			wd = -1;
+		}
+	}
+
+	if (watch && add_vpath(watch, vpath, ino)) {
+		++watch->refs;
+	} else {
+		wd = -1;
+	}
+
+	// The new watch is at the head, so it's never the one evicted.
+	struct Watch *evicted = NULL;
+	if (watcher->capacity && watcher->n_watches > watcher->capacity) {
+		evicted = watcher->lru_tail;
+		inotify_rm_watch(watcher->fd, evicted->wd);
+		detach_watch(watcher, evicted);
+	}
+
+	pthread_mutex_unlock(&watcher->lock);
+
+	if (evicted) {
+		for (size_t i = 0; i < evicted->n_vpaths; ++i) {
+			watcher->handler(evicted->vpaths[i].vpath ? evicted->vpaths[i].vpath : "", evicted->vpaths[i].ino, "", IN_IGNORED);
+		}
+
+		free_watch(evicted);
+	}
+
+	return wd;
+}
+
+void watch_remove(struct Watcher *watcher, const int wd, const uint64_t ino) {
+	if (!watcher || wd == -1) {
+		return;
+	}
+
+	pthread_mutex_lock(&watcher->lock);
+
+	struct Watch *watch = find_wd(watcher, wd);
+	for (size_t i = 0; watch && i < watch->n_vpaths; ++i) {
+		struct WatchPath *entry = &watch->vpaths[i];
+		if (!entry->vpath && entry->ino == ino && !--entry->refs) {
+			*entry = watch->vpaths[--watch->n_vpaths];
+			break;
+		}
+	}
+
+	if (watch && !--watch->refs) {
+		// Events still queued for the descriptor are simply dropped by the watcher thread.
+		inotify_rm_watch(watcher->fd, wd);
+		unlink_watch(watcher, watch);
+	}
+
+	pthread_mutex_unlock(&watcher->lock);
+}
+
+// The part of path below prefix, NULL when it's not prefix itself or below it.
+static const char *get_below(const char *path, const char *prefix) {
+	const size_t len = strlen(prefix);
+
+	return strncmp(path, prefix, len) == 0 && (path[len] == '\0' || path[len] == '/') ? path + len : NULL;
+}
+
+void watch_rename(struct Watcher *watcher, const char *old_vpath, const char *new_vpath, const bool exchange) {
+	if (!watcher) {
+		return;
+	}
+
+	pthread_mutex_lock(&watcher->lock);
+
+	for (struct Watch *watch = watcher->lru_head; watch; watch = watch->lru_next) {
+		for (size_t i = 0; i < watch->n_vpaths;) {
+			struct WatchPath *entry = &watch->vpaths[i];
+			if (!entry->vpath) {
+				++i;
+				continue;
+			}
+
+			const char *to = new_vpath;
+			const char *rest = get_below(entry->vpath, old_vpath);
+			if (!rest && exchange) {
+				to = old_vpath;
+				rest = get_below(entry->vpath, new_vpath);
+			}
+
+			char vpath[PATH_MAX];
+			if (!rest || snprintf(vpath, sizeof(vpath), "%s%s", to, rest) >= (int)sizeof(vpath)) {
+				++i;
+				continue;
+			}
+
+			bool known = false;
+			for (size_t j = 0; j < watch->n_vpaths; ++j) {
+				known |= watch->vpaths[j].ino == entry->ino && same_vpath(watch->vpaths[j].vpath, vpath);
+			}
+
+			char *copy = known ? NULL : strdup(vpath);
+			free(entry->vpath);
+
+			// Already reached under the new name, or out of memory: the old name is dropped either way.
+			if (!copy) {
+				*entry = watch->vpaths[--watch->n_vpaths];
+				continue;
+			}
+
+			entry->vpath = copy;
+			++i;
+		}
+	}
+
+	pthread_mutex_unlock(&watcher->lock);
+}
@@ -0,0 +1,50 @@
+/*
+ * steam_xdg_enforcer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+struct Watcher;
+
+// Called from the watcher's thread whenever the entry called name changes inside a watched directory, once for
+// every vpath the directory was added with. vpath is empty for directories that were added without one, mask holds
+// the inotify event bits.
+typedef void (*WatchHandler)(const char *vpath, uint64_t ino, const char *name, uint32_t mask);
+
+// When the kernel's event queue overflowed, the handler is called with an empty name and IN_Q_OVERFLOW: once with
+// a NULL vpath, then for every vpath of every watched directory.
+// With a capacity, the least recently added directories stop being watched once there are more. Their vpaths are
+// passed to the handler with an empty name and IN_IGNORED, from the thread that added the new one.
+struct Watcher *watch_new(WatchHandler handler, size_t capacity);
+
+// Starts watching the directory at path (relative to dirfd), unless it's being watched already.
+// vpath and ino identify the directory to the handler, they're added to the ones it already has: a directory reached
+// through several vpaths or inodes is reported under each of them. vpath is copied.
+// Returns -1 when the directory isn't watched or vpath couldn't be added. Adding it again counts as using it.
+int watch_add(struct Watcher *watcher, int dirfd, const char *path, const struct stat *st, const char *vpath, uint64_t ino);
+
+// ino is the one the directory was added with and without a vpath, it isn't reported anymore.
+void watch_remove(struct Watcher *watcher, int wd, uint64_t ino);
+
+// Moves the vpaths at old_vpath and below it to new_vpath, after the directory was renamed through the mount.
+// With exchange, the ones at new_vpath move to old_vpath at the same time.
+void watch_rename(struct Watcher *watcher, const char *old_vpath, const char *new_vpath, bool exchange);